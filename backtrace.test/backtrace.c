@@ -96,6 +96,100 @@ sigtrap_hndl(int signum)
 
 	done = 1;
 }
+#elif defined(USE_FP_UNWIND)
+
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#ifdef __OpenBSD__
+#include <pthread_np.h>
+#endif
+
+/*
+ * Frame pointer walker, works for code compiled with
+ * -fno-omit-frame-pointer only. Walk starts at the frame which
+ * got interrupted by SIGTRAP, the registers are taken from signal
+ * context. The walk stops when frame pointer leaves the stack
+ * of thread which called bt_init().
+ *
+ * pthread_getattr_np() is not async-signal-safe (it allocates and
+ * reads /proc/self/maps for main thread), so the stack range is
+ * found by bt_init() before int3 fires, signal handler only reads it.
+ */
+static uintptr_t stack_lo;
+static uintptr_t stack_hi;
+
+static void
+get_stack_range(void)
+{
+#ifdef __OpenBSD__
+	stack_t ss;
+
+	if (pthread_stackseg_np(pthread_self(), &ss) == 0) {
+		stack_hi = (uintptr_t)ss.ss_sp;
+		stack_lo = stack_hi - ss.ss_size;
+	}
+#else
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_sz;
+
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		if (pthread_attr_getstack(&attr, &stack_addr, &stack_sz) == 0) {
+			stack_lo = (uintptr_t)stack_addr;
+			stack_hi = stack_lo + stack_sz;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+}
+
+static void
+collect_backtrace_fp(uintptr_t pc, uintptr_t *fp)
+{
+	uintptr_t lo = stack_lo, hi = stack_hi;
+	uintptr_t *next_fp;
+
+	if (pc != 0)
+		*top++ = pc;
+
+	while ((uintptr_t)fp >= lo && (uintptr_t)fp <= hi - 2 * sizeof (*fp) &&
+	    ((uintptr_t)fp & (sizeof (*fp) - 1)) == 0 &&
+	    top < &stack[MAX_STACK_DEPTH]) {
+		if (fp[1] == 0)
+			break;
+		*top++ = fp[1];
+#ifdef VERBOSE
+		write_hex(fp[1]);
+		write(1, "\n", 1);
+#endif
+		next_fp = (uintptr_t *)fp[0];
+		if (next_fp <= fp)
+			break;
+		fp = next_fp;
+	}
+}
+
+static void
+sigtrap_hndl(int signum, siginfo_t *si, void *uctx_arg)
+{
+	ucontext_t *uctx = (ucontext_t *)uctx_arg;
+
+	if (done != 0)	/* todo: uninstall/disengage handler */
+		return;
+
+	top = stack;
+#if defined(__linux__) && defined(__x86_64__)
+	collect_backtrace_fp(uctx->uc_mcontext.gregs[REG_RIP],
+	    (uintptr_t *)uctx->uc_mcontext.gregs[REG_RBP]);
+#elif defined(__OpenBSD__) && defined(__amd64__)
+	collect_backtrace_fp(uctx->sc_rip, (uintptr_t *)uctx->sc_rbp);
+#else
+	collect_backtrace_fp(0, (uintptr_t *)__builtin_frame_address(0));
+#endif
+
+	done = 1;
+}
 #else
 #include <unwind.h>
 
@@ -156,8 +250,14 @@ bt_init(void)
 	 * instruction.  The handler then should do the stack unwind.
 	 */
         sigemptyset(&sa.sa_mask);
+#if defined(USE_FP_UNWIND) && !defined(_LIBUNWIND)
+	get_stack_range();
+        sa.sa_flags = SA_SIGINFO;
+        sa.sa_sigaction = sigtrap_hndl;
+#else
         sa.sa_flags = 0;
         sa.sa_handler = sigtrap_hndl;
+#endif
         sigaction(SIGTRAP, &sa, NULL);
 }
 
@@ -173,7 +273,7 @@ bt_print_stack(void)
 
 	while (walk < top) {
 		kelf_snprintsym(syms, buf, sizeof (buf), *walk, 0);
-		printf("%s", buf);
+		printf("%s\n", buf);
 		walk++;
 	}
 }
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2025 <sashan@openssl.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of symbol lookup. It loads symbols of all objects
+ * found in process using per-object tables (what ksyms.c does) and
+ * builds single table with symbols of all objects which is sorted
+ * again whenever object is added (what ksyms.c did before). Then it
+ * looks up the same random addresses in both and prints ns spent per
+ * lookup. Libraries given on command line are dlopen()ed first, so
+ * there are more symbols to search:
+ *
+ *	symbench [lookups] [/path/to/libcrypto.so ...]
+ */
+
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+
+#include "ksyms.c"
+
+static unsigned int lookups = 1000000;
+static volatile unsigned long sink;
+
+static int
+open_object(struct dl_phdr_info *dlpi, size_t sz, void *arg)
+{
+	struct syms **syms = arg;
+	const char *name = dlpi->dlpi_name;
+
+	if (name == NULL || *name == '\0')
+		name = "/proc/self/exe";
+	if (strstr(name, "linux-vdso") != NULL)
+		return (0);
+
+	*syms = kelf_open(name, *syms, dlpi->dlpi_addr);
+
+	return (0);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * appends symbols of each object to flat table and sorts all of
+ * them again.
+ */
+static struct sym *
+flat_table(struct syms *syms, size_t *nsymb)
+{
+	struct sym *flat = NULL;
+	size_t i, n = 0;
+
+	for (i = 0; i < syms->ntabs; i++) {
+		flat = reallocarray(flat, n + syms->tabs[i].symt_nsymb,
+		    sizeof *flat);
+		if (flat == NULL)
+			err(1, NULL);
+		memcpy(flat + n, syms->tabs[i].symt_table,
+		    syms->tabs[i].symt_nsymb * sizeof *flat);
+		n += syms->tabs[i].symt_nsymb;
+		qsort(flat, n, sizeof *flat, sym_compare_sort);
+	}
+	*nsymb = n;
+
+	return (flat);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct syms *syms = NULL;
+	struct symtab *symt;
+	struct sym *flat, key, *a, *b;
+	unsigned long *pcs;
+	size_t nsymb, total = 0;
+	unsigned int i, seed = 1, mismatch = 0;
+	uint64_t start, end;
+
+	if (argc > 1)
+		lookups = strtoul(argv[1], NULL, 10);
+	if (lookups == 0)
+		lookups = 1;
+	for (i = 2; i < (unsigned int)argc; i++) {
+		if (dlopen(argv[i], RTLD_NOW) == NULL)
+			errx(1, "%s", dlerror());
+	}
+
+	start = now_ns();
+	dl_iterate_phdr(open_object, &syms);
+	end = now_ns();
+	if (syms == NULL || syms->ntabs == 0)
+		errx(1, "no symbols loaded");
+	for (i = 0; i < syms->ntabs; i++)
+		total += syms->tabs[i].symt_nsymb;
+	printf("objects %zu symbols %zu\n", syms->ntabs, total);
+	printf("%-10s load %10.1f us\n", "per-object",
+	    (double)(end - start) / 1000);
+
+	start = now_ns();
+	flat = flat_table(syms, &nsymb);
+	end = now_ns();
+	printf("%-10s sort %10.1f us (on top of load)\n", "flat",
+	    (double)(end - start) / 1000);
+
+	/* pick random addresses inside of random functions */
+	pcs = calloc(lookups, sizeof *pcs);
+	if (pcs == NULL)
+		err(1, NULL);
+	for (i = 0; i < lookups; i++) {
+		symt = &syms->tabs[rand_r(&seed) % syms->ntabs];
+		key = symt->symt_table[rand_r(&seed) % symt->symt_nsymb];
+		pcs[i] = key.sym_value + (key.sym_size ?
+		    rand_r(&seed) % key.sym_size : 0);
+	}
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++) {
+		key.sym_value = pcs[i];
+		a = bsearch(&key, flat, nsymb, sizeof *flat,
+		    sym_compare_search);
+		sink += (unsigned long)a;
+	}
+	end = now_ns();
+	printf("%-10s lookup %8.1f ns\n", "flat",
+	    (double)(end - start) / lookups);
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++) {
+		b = kelf_lookup(syms, pcs[i]);
+		sink += (unsigned long)b;
+	}
+	end = now_ns();
+	printf("%-10s lookup %8.1f ns\n", "per-object",
+	    (double)(end - start) / lookups);
+
+	/* both must agree on symbol name */
+	for (i = 0; i < lookups; i++) {
+		key.sym_value = pcs[i];
+		a = bsearch(&key, flat, nsymb, sizeof *flat,
+		    sym_compare_search);
+		b = kelf_lookup(syms, pcs[i]);
+		if ((a == NULL) != (b == NULL) ||
+		    (a != NULL && a->sym_value != b->sym_value))
+			mismatch++;
+	}
+	if (mismatch != 0)
+		printf("%u lookups differ\n", mismatch);
+
+	free(pcs);
+	free(flat);
+	kelf_close(syms);
+
+	return (0);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2025 <sashan@openssl.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmark which compares cost of stack collection done by
+ * _Unwind_Backtrace() from libgcc_s, libunwind (build with
+ * -DUSE_LIBUNWIND) and frame pointer walk. The program recurses
+ * to desired depth and collects the stack there in a loop. It prints
+ * number of frames found and ns spent per stack.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unwind.h>
+#ifdef USE_LIBUNWIND
+#define UNW_LOCAL_ONLY
+#include <libunwind.h>
+#endif
+
+#define	MAX_DEPTH	128
+
+typedef int (*unwind_f)(uintptr_t *, int);
+
+static uintptr_t stack_lo, stack_hi;
+static unsigned int loops = 100000;
+static volatile int sink;
+
+struct unwind_state {
+	uintptr_t	*us_stack;
+	int		 us_depth;
+	int		 us_max;
+};
+
+static _Unwind_Reason_Code
+unwind_cb(struct _Unwind_Context *ctx, void *arg)
+{
+	struct unwind_state *us = arg;
+
+	if (us->us_depth >= us->us_max)
+		return (_URC_END_OF_STACK);
+
+	us->us_stack[us->us_depth++] = _Unwind_GetIP(ctx);
+
+	return (_URC_NO_REASON);
+}
+
+static __attribute__((noinline)) int
+unwind_gcc(uintptr_t *stack, int max)
+{
+	struct unwind_state us;
+
+	us.us_stack = stack;
+	us.us_depth = 0;
+	us.us_max = max;
+	_Unwind_Backtrace(unwind_cb, &us);
+
+	return (us.us_depth);
+}
+
+#ifdef USE_LIBUNWIND
+static __attribute__((noinline)) int
+unwind_libunwind(uintptr_t *stack, int max)
+{
+	unw_cursor_t cursor;
+	unw_context_t uc;
+	unw_word_t ip;
+	int depth = 0;
+
+	unw_getcontext(&uc);
+	unw_init_local(&cursor, &uc);
+	while (depth < max && unw_step(&cursor) > 0) {
+		unw_get_reg(&cursor, UNW_REG_IP, &ip);
+		stack[depth++] = ip;
+	}
+
+	return (depth);
+}
+#endif
+
+static __attribute__((noinline)) int
+unwind_fp(uintptr_t *stack, int max)
+{
+	uintptr_t *fp = __builtin_frame_address(0);
+	uintptr_t *next_fp;
+	int depth = 0;
+
+	while ((uintptr_t)fp >= stack_lo &&
+	    (uintptr_t)fp <= stack_hi - 2 * sizeof (*fp) &&
+	    ((uintptr_t)fp & (sizeof (*fp) - 1)) == 0 && depth < max) {
+		if (fp[1] == 0)
+			break;
+		stack[depth++] = fp[1];
+		next_fp = (uintptr_t *)fp[0];
+		if (next_fp <= fp)
+			break;
+		fp = next_fp;
+	}
+
+	return (depth);
+}
+
+static void
+get_stack_range(void)
+{
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_sz;
+
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return;
+
+	if (pthread_attr_getstack(&attr, &stack_addr, &stack_sz) == 0) {
+		stack_lo = (uintptr_t)stack_addr;
+		stack_hi = stack_lo + stack_sz;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+run_bench(const char *name, unwind_f unwind, int depth)
+{
+	uintptr_t stack[MAX_DEPTH];
+	unsigned int i;
+	uint64_t start, end;
+	int frames = 0;
+
+	start = now_ns();
+	for (i = 0; i < loops; i++)
+		frames = unwind(stack, MAX_DEPTH);
+	end = now_ns();
+
+	printf("%-10s depth %3d frames %3d %8.1f ns/stack\n", name, depth,
+	    frames, (double)(end - start) / loops);
+}
+
+/*
+ * Adding result of recursive call keeps compiler from turning
+ * recursion to loop.
+ */
+static __attribute__((noinline)) int
+recurse(int level, int depth)
+{
+	if (level < depth)
+		return (recurse(level + 1, depth) + sink);
+
+	run_bench("gcc_s", unwind_gcc, depth);
+#ifdef USE_LIBUNWIND
+	run_bench("libunwind", unwind_libunwind, depth);
+#endif
+	run_bench("fp", unwind_fp, depth);
+
+	return (sink);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int depths[] = { 4, 16, 32, 64 };
+	unsigned int i;
+
+	if (argc > 1)
+		loops = strtoul(argv[1], NULL, 10);
+	if (loops == 0)
+		loops = 1;
+
+	get_stack_range();
+
+	for (i = 0; i < sizeof (depths) / sizeof (depths[0]); i++)
+		sink += recurse(0, depths[i]);
+
+	return (0);
+}
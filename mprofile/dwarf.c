@@ -0,0 +1,1585 @@
+/*
+ * Copyright (c) 2025 <sashan@openssl.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal DWARF reader which translates address to file:line and to
+ * chain of inlined functions. It reads line tables from .debug_line
+ * (DWARF 2-5) and DW_TAG_inlined_subroutine entries from .debug_info.
+ * Everything is parsed once, when object is loaded, to arrays sorted
+ * by address:
+ *	kd_rows		rows of line tables (address, file, line)
+ *	kd_inlines	address ranges of inlined functions
+ * so each lookup is just a binary search. Strings are not copied,
+ * they point to sections in ELF image. Type units, split DWARF,
+ * .dwz files and compressed sections are not supported.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kdwarf.h"
+
+#define	DW_TAG_inlined_subroutine	0x1d
+#define	DW_TAG_compile_unit		0x11
+#define	DW_TAG_partial_unit		0x3c
+
+#define	DW_AT_name			0x03
+#define	DW_AT_stmt_list			0x10
+#define	DW_AT_low_pc			0x11
+#define	DW_AT_high_pc			0x12
+#define	DW_AT_abstract_origin		0x31
+#define	DW_AT_specification		0x47
+#define	DW_AT_ranges			0x55
+#define	DW_AT_call_file			0x58
+#define	DW_AT_call_line			0x59
+#define	DW_AT_str_offsets_base		0x72
+#define	DW_AT_addr_base			0x73
+#define	DW_AT_rnglists_base		0x74
+
+#define	DW_FORM_addr			0x01
+#define	DW_FORM_block2			0x03
+#define	DW_FORM_block4			0x04
+#define	DW_FORM_data2			0x05
+#define	DW_FORM_data4			0x06
+#define	DW_FORM_data8			0x07
+#define	DW_FORM_string			0x08
+#define	DW_FORM_block			0x09
+#define	DW_FORM_block1			0x0a
+#define	DW_FORM_data1			0x0b
+#define	DW_FORM_flag			0x0c
+#define	DW_FORM_sdata			0x0d
+#define	DW_FORM_strp			0x0e
+#define	DW_FORM_udata			0x0f
+#define	DW_FORM_ref_addr		0x10
+#define	DW_FORM_ref1			0x11
+#define	DW_FORM_ref2			0x12
+#define	DW_FORM_ref4			0x13
+#define	DW_FORM_ref8			0x14
+#define	DW_FORM_ref_udata		0x15
+#define	DW_FORM_indirect		0x16
+#define	DW_FORM_sec_offset		0x17
+#define	DW_FORM_exprloc			0x18
+#define	DW_FORM_flag_present		0x19
+#define	DW_FORM_strx			0x1a
+#define	DW_FORM_addrx			0x1b
+#define	DW_FORM_ref_sup4		0x1c
+#define	DW_FORM_strp_sup		0x1d
+#define	DW_FORM_data16			0x1e
+#define	DW_FORM_line_strp		0x1f
+#define	DW_FORM_ref_sig8		0x20
+#define	DW_FORM_implicit_const		0x21
+#define	DW_FORM_loclistx		0x22
+#define	DW_FORM_rnglistx		0x23
+#define	DW_FORM_ref_sup8		0x24
+#define	DW_FORM_strx1			0x25
+#define	DW_FORM_strx2			0x26
+#define	DW_FORM_strx3			0x27
+#define	DW_FORM_strx4			0x28
+#define	DW_FORM_addrx1			0x29
+#define	DW_FORM_addrx2			0x2a
+#define	DW_FORM_addrx3			0x2b
+#define	DW_FORM_addrx4			0x2c
+#define	DW_FORM_GNU_addr_index		0x1f01
+#define	DW_FORM_GNU_str_index		0x1f02
+#define	DW_FORM_GNU_ref_alt		0x1f20
+#define	DW_FORM_GNU_strp_alt		0x1f21
+
+#define	DW_UT_compile			0x01
+#define	DW_UT_partial			0x03
+
+#define	DW_LNS_copy			0x01
+#define	DW_LNS_advance_pc		0x02
+#define	DW_LNS_advance_line		0x03
+#define	DW_LNS_set_file			0x04
+#define	DW_LNS_const_add_pc		0x08
+#define	DW_LNS_fixed_advance_pc		0x09
+
+#define	DW_LNE_end_sequence		0x01
+#define	DW_LNE_set_address		0x02
+#define	DW_LNE_define_file		0x03
+
+#define	DW_LNCT_path			0x01
+
+#define	DW_RLE_end_of_list		0x00
+#define	DW_RLE_base_addressx		0x01
+#define	DW_RLE_startx_endx		0x02
+#define	DW_RLE_startx_length		0x03
+#define	DW_RLE_offset_pair		0x04
+#define	DW_RLE_base_address		0x05
+#define	DW_RLE_start_end		0x06
+#define	DW_RLE_start_length		0x07
+
+#define	KD_NOFILE	0xffffffffU	/* row ends sequence */
+#define	KD_MAX_DEPTH	256		/* nesting of DIEs we follow */
+#define	KD_MAX_INLINE	32		/* inlined calls we print */
+
+struct kd_buf {
+	const unsigned char	*b_ptr;
+	const unsigned char	*b_end;
+	int			 b_err;
+};
+
+struct kd_row {
+	uint64_t	kr_addr;
+	uint32_t	kr_file;	/* index to kd_files */
+	uint32_t	kr_line;
+};
+
+struct kd_seq {
+	uint64_t	ks_addr;
+	size_t		ks_first;	/* first row in kd_rows */
+	size_t		ks_count;
+};
+
+struct kd_inline {
+	uint64_t	 ki_lo;
+	uint64_t	 ki_hi;
+	uint64_t	 ki_maxhi;	/* max ki_hi of this and entries before */
+	const char	*ki_name;
+	uint32_t	 ki_call_file;	/* index to kd_files */
+	uint32_t	 ki_call_line;
+	uint32_t	 ki_depth;
+};
+
+/* line program, files it defines are stored to kd_files */
+struct kd_prog {
+	uint64_t	kp_off;
+	uint32_t	kp_file;
+	uint32_t	kp_nfiles;
+	int		kp_version;
+};
+
+struct kd_attrspec {
+	uint64_t	as_name;
+	uint64_t	as_form;
+	int64_t		as_const;
+};
+
+struct kd_abbrev {
+	uint64_t	ka_code;
+	uint64_t	ka_tag;
+	int		ka_children;
+	size_t		ka_attr;	/* first in cu_attrs */
+	size_t		ka_nattrs;
+};
+
+struct kd_cu {
+	uint64_t		 cu_off;
+	uint64_t		 cu_end;
+	uint64_t		 cu_dies;
+	uint64_t		 cu_abbrev_off;
+	int			 cu_version;
+	int			 cu_addr_size;
+	int			 cu_off_size;
+	uint64_t		 cu_base;
+	uint64_t		 cu_str_offsets;
+	uint64_t		 cu_addr_base;
+	uint64_t		 cu_rnglists_base;
+	struct kd_prog		*cu_prog;
+	struct kd_abbrev	*cu_abbrevs;
+	size_t			 cu_nabbrevs;
+	struct kd_attrspec	*cu_attrs;
+	int			 cu_abbrevs_read;
+};
+
+struct kd_attr {
+	uint64_t	 at_form;
+	uint64_t	 at_u;
+	const char	*at_str;	/* DW_FORM_string */
+	int		 at_set;
+};
+
+/* attributes we are interested in */
+enum {
+	KA_NAME,
+	KA_STMT_LIST,
+	KA_LOW_PC,
+	KA_HIGH_PC,
+	KA_ORIGIN,
+	KA_SPEC,
+	KA_RANGES,
+	KA_CALL_FILE,
+	KA_CALL_LINE,
+	KA_STR_OFFSETS,
+	KA_ADDR_BASE,
+	KA_RNGLISTS_BASE,
+	KA_COUNT
+};
+
+struct kdwarf {
+	struct kd_sect		 kd_sect[KD_NSECT];
+	struct kd_row		*kd_rows;
+	size_t			 kd_nrows;
+	size_t			 kd_rows_size;
+	struct kd_seq		*kd_seqs;
+	size_t			 kd_nseqs;
+	size_t			 kd_seqs_size;
+	const char		**kd_files;
+	size_t			 kd_nfiles;
+	size_t			 kd_files_size;
+	struct kd_prog		*kd_progs;
+	size_t			 kd_nprogs;
+	size_t			 kd_progs_size;
+	struct kd_inline	*kd_inlines;
+	size_t			 kd_ninlines;
+	size_t			 kd_inlines_size;
+	struct kd_cu		*kd_cus;
+	size_t			 kd_ncus;
+	size_t			 kd_cus_size;
+};
+
+/*
+ * makes sure there is room for one more element in array.
+ */
+static void *
+kd_grow(void *array, size_t count, size_t *size, size_t elem)
+{
+	void *tmp;
+
+	if (count < *size)
+		return (array);
+
+	tmp = reallocarray(array, (*size == 0) ? 64 : *size * 2, elem);
+	if (tmp == NULL)
+		err(1, NULL);
+	*size = (*size == 0) ? 64 : *size * 2;
+
+	return (tmp);
+}
+
+static void
+kd_buf_init(struct kd_buf *b, const struct kd_sect *s, uint64_t off,
+    uint64_t len)
+{
+	b->b_err = (s->kds_data == NULL || off > s->kds_len ||
+	    len > s->kds_len - off);
+	if (b->b_err) {
+		b->b_ptr = b->b_end = NULL;
+		return;
+	}
+	b->b_ptr = s->kds_data + off;
+	b->b_end = b->b_ptr + len;
+}
+
+static void
+rd_skip(struct kd_buf *b, uint64_t n)
+{
+	if (b->b_err || n > (uint64_t)(b->b_end - b->b_ptr)) {
+		b->b_err = 1;
+		b->b_ptr = b->b_end;
+		return;
+	}
+	b->b_ptr += n;
+}
+
+/*
+ * reads n bytes long unsigned integer, DWARF uses byte order of
+ * ELF file which is the same as ours.
+ */
+static uint64_t
+rd_u(struct kd_buf *b, int n)
+{
+	uint64_t v = 0;
+	uint32_t v32;
+	uint16_t v16;
+
+	if (b->b_err || n > b->b_end - b->b_ptr) {
+		b->b_err = 1;
+		b->b_ptr = b->b_end;
+		return (0);
+	}
+
+	switch (n) {
+	case 1:
+		v = b->b_ptr[0];
+		break;
+	case 2:
+		memcpy(&v16, b->b_ptr, 2);
+		v = v16;
+		break;
+	case 3:
+		v = b->b_ptr[0] | (b->b_ptr[1] << 8) | (b->b_ptr[2] << 16);
+		break;
+	case 4:
+		memcpy(&v32, b->b_ptr, 4);
+		v = v32;
+		break;
+	case 8:
+		memcpy(&v, b->b_ptr, 8);
+		break;
+	default:
+		b->b_err = 1;
+	}
+	b->b_ptr += n;
+
+	return (v);
+}
+
+static uint64_t
+rd_uleb(struct kd_buf *b)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
+	unsigned char c;
+
+	do {
+		if (b->b_err || b->b_ptr == b->b_end) {
+			b->b_err = 1;
+			return (0);
+		}
+		c = *b->b_ptr++;
+		if (shift < 64)
+			v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return (v);
+}
+
+static int64_t
+rd_sleb(struct kd_buf *b)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
+	unsigned char c;
+
+	do {
+		if (b->b_err || b->b_ptr == b->b_end) {
+			b->b_err = 1;
+			return (0);
+		}
+		c = *b->b_ptr++;
+		if (shift < 64)
+			v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	if (shift < 64 && (c & 0x40))
+		v |= ~0ULL << shift;
+
+	return ((int64_t)v);
+}
+
+static const char *
+rd_str(struct kd_buf *b)
+{
+	const unsigned char *s = b->b_ptr;
+	const unsigned char *nul;
+
+	if (b->b_err)
+		return (NULL);
+	nul = memchr(s, '\0', b->b_end - s);
+	if (nul == NULL) {
+		b->b_err = 1;
+		b->b_ptr = b->b_end;
+		return (NULL);
+	}
+	b->b_ptr = nul + 1;
+
+	return ((const char *)s);
+}
+
+/*
+ * returns string at offset in .debug_str or .debug_line_str
+ */
+static const char *
+sect_str(struct kdwarf *kd, int sect, uint64_t off)
+{
+	const struct kd_sect *s = &kd->kd_sect[sect];
+
+	if (s->kds_data == NULL || off >= s->kds_len ||
+	    memchr(s->kds_data + off, '\0', s->kds_len - off) == NULL)
+		return (NULL);
+
+	return ((const char *)s->kds_data + off);
+}
+
+/*
+ * reads unit length, sets *off_size to 4 or 8 (32-bit or 64-bit DWARF).
+ */
+static uint64_t
+rd_length(struct kd_buf *b, int *off_size)
+{
+	uint64_t len;
+
+	len = rd_u(b, 4);
+	*off_size = 4;
+	if (len == 0xffffffff) {
+		len = rd_u(b, 8);
+		*off_size = 8;
+	}
+
+	return (len);
+}
+
+/*
+ * file names are kept without directory, the full path is too long
+ * for stack frame.
+ */
+static const char *
+base_name(const char *path)
+{
+	const char *slash;
+
+	if (path == NULL)
+		return ("??");
+	slash = strrchr(path, '/');
+
+	return ((slash != NULL) ? slash + 1 : path);
+}
+
+static void
+add_file(struct kdwarf *kd, struct kd_prog *kp, const char *path)
+{
+	kd->kd_files = kd_grow(kd->kd_files, kd->kd_nfiles, &kd->kd_files_size,
+	    sizeof (const char *));
+	kd->kd_files[kd->kd_nfiles++] = base_name(path);
+	kp->kp_nfiles++;
+}
+
+static void
+add_row(struct kdwarf *kd, uint64_t addr, uint32_t file, uint32_t line)
+{
+	struct kd_row *kr;
+
+	kd->kd_rows = kd_grow(kd->kd_rows, kd->kd_nrows, &kd->kd_rows_size,
+	    sizeof (struct kd_row));
+	kr = &kd->kd_rows[kd->kd_nrows++];
+	kr->kr_addr = addr;
+	kr->kr_file = file;
+	kr->kr_line = line;
+}
+
+/*
+ * translates file number found in line program or in DW_AT_call_file
+ * to index in kd_files. Files are numbered from 1 before DWARF 5.
+ */
+static uint32_t
+prog_file(struct kd_prog *kp, uint64_t file)
+{
+	if (kp == NULL)
+		return (KD_NOFILE);
+	if (kp->kp_version < 5) {
+		if (file == 0)
+			return (KD_NOFILE);
+		file--;
+	}
+	if (file >= kp->kp_nfiles)
+		return (KD_NOFILE);
+
+	return (kp->kp_file + file);
+}
+
+/*
+ * reads value of form in DWARF 5 directory/file entry. Returns string
+ * for path, number for others.
+ */
+static const char *
+rd_entry_form(struct kdwarf *kd, struct kd_buf *b, uint64_t form,
+    int off_size, uint64_t *val)
+{
+	*val = 0;
+	switch (form) {
+	case DW_FORM_string:
+		return (rd_str(b));
+	case DW_FORM_line_strp:
+		return (sect_str(kd, KD_LINE_STR, rd_u(b, off_size)));
+	case DW_FORM_strp:
+		return (sect_str(kd, KD_STR, rd_u(b, off_size)));
+	case DW_FORM_udata:
+		*val = rd_uleb(b);
+		break;
+	case DW_FORM_data1:
+		*val = rd_u(b, 1);
+		break;
+	case DW_FORM_data2:
+		*val = rd_u(b, 2);
+		break;
+	case DW_FORM_data4:
+		*val = rd_u(b, 4);
+		break;
+	case DW_FORM_data8:
+		*val = rd_u(b, 8);
+		break;
+	case DW_FORM_data16:
+		rd_skip(b, 16);
+		break;
+	case DW_FORM_block:
+		rd_skip(b, rd_uleb(b));
+		break;
+	default:
+		/* strx forms need CU, we can not resolve them here */
+		b->b_err = 1;
+	}
+
+	return (NULL);
+}
+
+/*
+ * reads DWARF 5 table of directories or files, paths of files are
+ * added to kd_files.
+ */
+static int
+rd_entries(struct kdwarf *kd, struct kd_buf *b, struct kd_prog *kp,
+    int off_size)
+{
+	uint64_t formats[16][2], count, i, val;
+	unsigned int nformats, j;
+	const char *path, *s;
+
+	nformats = rd_u(b, 1);
+	if (nformats > 16)
+		return (-1);
+	for (j = 0; j < nformats; j++) {
+		formats[j][0] = rd_uleb(b);
+		formats[j][1] = rd_uleb(b);
+	}
+	count = rd_uleb(b);
+	for (i = 0; i < count && !b->b_err; i++) {
+		path = NULL;
+		for (j = 0; j < nformats; j++) {
+			s = rd_entry_form(kd, b, formats[j][1], off_size, &val);
+			if (formats[j][0] == DW_LNCT_path)
+				path = s;
+		}
+		if (kp != NULL)
+			add_file(kd, kp, path);
+	}
+
+	return (b->b_err ? -1 : 0);
+}
+
+/*
+ * runs line program found at offset off in .debug_line. Rows are
+ * appended to kd_rows, each sequence is recorded in kd_seqs.
+ * Returns length of program or 0 on error.
+ */
+static uint64_t
+read_line_prog(struct kdwarf *kd, uint64_t off)
+{
+	struct kd_buf b, hb;
+	struct kd_prog *kp;
+	struct kd_seq *ks;
+	const unsigned char *std_len;
+	const char *path;
+	uint64_t len, hdr_len, addr = 0, file = 1, ext_len, i;
+	int64_t line = 1;
+	int off_size, min_inst, line_base, line_range, opcode_base;
+	int version, op;
+	size_t seq_first;
+
+	kd_buf_init(&b, &kd->kd_sect[KD_LINE], off, 12);
+	len = rd_length(&b, &off_size);
+	if (b.b_err)
+		return (0);
+	off += (off_size == 4) ? 4 : 12;
+	kd_buf_init(&b, &kd->kd_sect[KD_LINE], off, len);
+	if (b.b_err)
+		return (0);
+
+	version = rd_u(&b, 2);
+	if (version < 2 || version > 5)
+		return (len + ((off_size == 4) ? 4 : 12));
+	if (version >= 5) {
+		rd_u(&b, 1);	/* address size */
+		rd_u(&b, 1);	/* segment selector size */
+	}
+	hdr_len = rd_u(&b, off_size);
+	hb = b;
+	rd_skip(&b, hdr_len);	/* b now points to program */
+	min_inst = rd_u(&hb, 1);
+	if (version >= 4)
+		rd_u(&hb, 1);	/* max ops per instruction */
+	rd_u(&hb, 1);		/* default is_stmt */
+	line_base = (int8_t)rd_u(&hb, 1);
+	line_range = rd_u(&hb, 1);
+	opcode_base = rd_u(&hb, 1);
+	std_len = hb.b_ptr;
+	rd_skip(&hb, (opcode_base > 0) ? opcode_base - 1 : 0);
+	if (b.b_err || hb.b_err || line_range == 0 || opcode_base == 0)
+		return (0);
+
+	kd->kd_progs = kd_grow(kd->kd_progs, kd->kd_nprogs, &kd->kd_progs_size,
+	    sizeof (struct kd_prog));
+	kp = &kd->kd_progs[kd->kd_nprogs++];
+	kp->kp_off = off - ((off_size == 4) ? 4 : 12);
+	kp->kp_file = kd->kd_nfiles;
+	kp->kp_nfiles = 0;
+	kp->kp_version = version;
+
+	if (version >= 5) {
+		if (rd_entries(kd, &hb, NULL, off_size) == -1 ||
+		    rd_entries(kd, &hb, kp, off_size) == -1)
+			return (0);
+	} else {
+		/* include directories, we don't need them */
+		while ((path = rd_str(&hb)) != NULL && *path != '\0')
+			;
+		while ((path = rd_str(&hb)) != NULL && *path != '\0') {
+			rd_uleb(&hb);	/* directory */
+			rd_uleb(&hb);	/* time */
+			rd_uleb(&hb);	/* size */
+			add_file(kd, kp, path);
+		}
+		if (hb.b_err)
+			return (0);
+	}
+
+	seq_first = kd->kd_nrows;
+	while (b.b_ptr < b.b_end && !b.b_err) {
+		op = rd_u(&b, 1);
+		if (op >= opcode_base) {
+			op -= opcode_base;
+			addr += (op / line_range) * min_inst;
+			line += line_base + op % line_range;
+			add_row(kd, addr, prog_file(kp, file), line);
+			continue;
+		}
+		switch (op) {
+		case 0:
+			ext_len = rd_uleb(&b);
+			hb = b;
+			rd_skip(&b, ext_len);
+			if (ext_len == 0)
+				break;
+			switch (rd_u(&hb, 1)) {
+			case DW_LNE_end_sequence:
+				add_row(kd, addr, KD_NOFILE, 0);
+				/*
+				 * Sequences at address 0 come from functions
+				 * dropped by linker, forget them.
+				 */
+				if (kd->kd_nrows - seq_first > 1 &&
+				    kd->kd_rows[seq_first].kr_addr != 0 &&
+				    kd->kd_rows[seq_first].kr_addr != ~0ULL) {
+					kd->kd_seqs = kd_grow(kd->kd_seqs,
+					    kd->kd_nseqs, &kd->kd_seqs_size,
+					    sizeof (struct kd_seq));
+					ks = &kd->kd_seqs[kd->kd_nseqs++];
+					ks->ks_addr =
+					    kd->kd_rows[seq_first].kr_addr;
+					ks->ks_first = seq_first;
+					ks->ks_count = kd->kd_nrows - seq_first;
+				} else
+					kd->kd_nrows = seq_first;
+				seq_first = kd->kd_nrows;
+				addr = 0;
+				file = 1;
+				line = 1;
+				break;
+			case DW_LNE_set_address:
+				addr = rd_u(&hb, ext_len - 1);
+				break;
+			case DW_LNE_define_file:
+				add_file(kd, kp, rd_str(&hb));
+				break;
+			}
+			break;
+		case DW_LNS_copy:
+			add_row(kd, addr, prog_file(kp, file), line);
+			break;
+		case DW_LNS_advance_pc:
+			addr += rd_uleb(&b) * min_inst;
+			break;
+		case DW_LNS_advance_line:
+			line += rd_sleb(&b);
+			break;
+		case DW_LNS_set_file:
+			file = rd_uleb(&b);
+			break;
+		case DW_LNS_const_add_pc:
+			addr += ((255 - opcode_base) / line_range) * min_inst;
+			break;
+		case DW_LNS_fixed_advance_pc:
+			addr += rd_u(&b, 2);
+			break;
+		default:
+			/* skip operands of other standard opcodes */
+			for (i = 0; i < std_len[op - 1]; i++)
+				rd_uleb(&b);
+		}
+	}
+	/* drop unterminated sequence */
+	kd->kd_nrows = seq_first;
+
+	return (len + ((off_size == 4) ? 4 : 12));
+}
+
+static int
+seq_compare(const void *a, const void *b)
+{
+	const struct kd_seq *a_ks = a, *b_ks = b;
+
+	if (a_ks->ks_addr < b_ks->ks_addr)
+		return (-1);
+	return (a_ks->ks_addr > b_ks->ks_addr);
+}
+
+/*
+ * reads all line programs and builds single table of rows sorted by
+ * address. Rows which do not change file:line are dropped, when more
+ * rows share address the last one is kept.
+ */
+static void
+read_lines(struct kdwarf *kd)
+{
+	struct kd_row *rows, *kr;
+	struct kd_seq *ks;
+	uint64_t off = 0, len;
+	size_t i, j, n = 0;
+
+	while (off < kd->kd_sect[KD_LINE].kds_len) {
+		if ((len = read_line_prog(kd, off)) == 0)
+			break;
+		off += len;
+	}
+
+	if (kd->kd_nrows == 0)
+		return;
+
+	qsort(kd->kd_seqs, kd->kd_nseqs, sizeof (struct kd_seq), seq_compare);
+	rows = reallocarray(NULL, kd->kd_nrows, sizeof (struct kd_row));
+	if (rows == NULL)
+		err(1, NULL);
+	for (i = 0; i < kd->kd_nseqs; i++) {
+		ks = &kd->kd_seqs[i];
+		for (j = 0; j < ks->ks_count; j++) {
+			kr = &kd->kd_rows[ks->ks_first + j];
+			if (j + 1 < ks->ks_count &&
+			    kr[1].kr_addr == kr->kr_addr)
+				continue;
+			if (n > 0 && kr->kr_file != KD_NOFILE &&
+			    rows[n - 1].kr_file == kr->kr_file &&
+			    rows[n - 1].kr_line == kr->kr_line)
+				continue;
+			rows[n++] = *kr;
+		}
+	}
+	free(kd->kd_rows);
+	free(kd->kd_seqs);
+	kd->kd_seqs = NULL;
+	kd->kd_nseqs = kd->kd_seqs_size = 0;
+	kd->kd_rows = rows;
+	kd->kd_nrows = kd->kd_rows_size = n;
+}
+
+static int
+prog_compare(const void *key, const void *entry)
+{
+	uint64_t off = *(const uint64_t *)key;
+	const struct kd_prog *kp = entry;
+
+	if (off < kp->kp_off)
+		return (-1);
+	return (off > kp->kp_off);
+}
+
+static int
+read_abbrevs(struct kdwarf *kd, struct kd_cu *cu)
+{
+	struct kd_buf b;
+	struct kd_abbrev *ka;
+	struct kd_attrspec *as;
+	size_t abbrevs_size = 0, attrs_size = 0, nattrs = 0;
+	uint64_t code, name, form;
+
+	cu->cu_abbrevs_read = 1;
+	kd_buf_init(&b, &kd->kd_sect[KD_ABBREV], cu->cu_abbrev_off,
+	    (cu->cu_abbrev_off <= kd->kd_sect[KD_ABBREV].kds_len) ?
+	    kd->kd_sect[KD_ABBREV].kds_len - cu->cu_abbrev_off : 0);
+
+	while ((code = rd_uleb(&b)) != 0 && !b.b_err) {
+		cu->cu_abbrevs = kd_grow(cu->cu_abbrevs, cu->cu_nabbrevs,
+		    &abbrevs_size, sizeof (struct kd_abbrev));
+		ka = &cu->cu_abbrevs[cu->cu_nabbrevs++];
+		ka->ka_code = code;
+		ka->ka_tag = rd_uleb(&b);
+		ka->ka_children = rd_u(&b, 1);
+		ka->ka_attr = nattrs;
+		ka->ka_nattrs = 0;
+		for (;;) {
+			name = rd_uleb(&b);
+			form = rd_uleb(&b);
+			if ((name == 0 && form == 0) || b.b_err)
+				break;
+			cu->cu_attrs = kd_grow(cu->cu_attrs, nattrs,
+			    &attrs_size, sizeof (struct kd_attrspec));
+			as = &cu->cu_attrs[nattrs++];
+			as->as_name = name;
+			as->as_form = form;
+			as->as_const = (form == DW_FORM_implicit_const) ?
+			    rd_sleb(&b) : 0;
+			ka->ka_nattrs++;
+		}
+	}
+
+	return (b.b_err ? -1 : 0);
+}
+
+static struct kd_abbrev *
+find_abbrev(struct kd_cu *cu, uint64_t code)
+{
+	size_t lo = 0, hi = cu->cu_nabbrevs, mid;
+
+	/* codes are usually 1, 2, 3, ... */
+	if (code > 0 && code <= cu->cu_nabbrevs &&
+	    cu->cu_abbrevs[code - 1].ka_code == code)
+		return (&cu->cu_abbrevs[code - 1]);
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cu->cu_abbrevs[mid].ka_code == code)
+			return (&cu->cu_abbrevs[mid]);
+		if (cu->cu_abbrevs[mid].ka_code < code)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (lo = 0; lo < cu->cu_nabbrevs; lo++) {
+		if (cu->cu_abbrevs[lo].ka_code == code)
+			return (&cu->cu_abbrevs[lo]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * reads value of attribute. References are turned to offsets in
+ * .debug_info.
+ */
+static void
+rd_form(struct kd_cu *cu, struct kd_buf *b, uint64_t form, int64_t cnst,
+    struct kd_attr *at)
+{
+	at->at_form = form;
+	at->at_u = 0;
+	at->at_str = NULL;
+
+	switch (form) {
+	case DW_FORM_addr:
+		at->at_u = rd_u(b, cu->cu_addr_size);
+		break;
+	case DW_FORM_block2:
+		rd_skip(b, rd_u(b, 2));
+		break;
+	case DW_FORM_block4:
+		rd_skip(b, rd_u(b, 4));
+		break;
+	case DW_FORM_data1:
+	case DW_FORM_ref1:
+	case DW_FORM_flag:
+	case DW_FORM_strx1:
+	case DW_FORM_addrx1:
+		at->at_u = rd_u(b, 1);
+		break;
+	case DW_FORM_data2:
+	case DW_FORM_ref2:
+	case DW_FORM_strx2:
+	case DW_FORM_addrx2:
+		at->at_u = rd_u(b, 2);
+		break;
+	case DW_FORM_strx3:
+	case DW_FORM_addrx3:
+		at->at_u = rd_u(b, 3);
+		break;
+	case DW_FORM_data4:
+	case DW_FORM_ref4:
+	case DW_FORM_ref_sup4:
+	case DW_FORM_strx4:
+	case DW_FORM_addrx4:
+		at->at_u = rd_u(b, 4);
+		break;
+	case DW_FORM_data8:
+	case DW_FORM_ref8:
+	case DW_FORM_ref_sig8:
+	case DW_FORM_ref_sup8:
+		at->at_u = rd_u(b, 8);
+		break;
+	case DW_FORM_data16:
+		rd_skip(b, 16);
+		break;
+	case DW_FORM_string:
+		at->at_str = rd_str(b);
+		break;
+	case DW_FORM_block:
+	case DW_FORM_exprloc:
+		rd_skip(b, rd_uleb(b));
+		break;
+	case DW_FORM_block1:
+		rd_skip(b, rd_u(b, 1));
+		break;
+	case DW_FORM_sdata:
+		at->at_u = rd_sleb(b);
+		break;
+	case DW_FORM_udata:
+	case DW_FORM_ref_udata:
+	case DW_FORM_strx:
+	case DW_FORM_addrx:
+	case DW_FORM_loclistx:
+	case DW_FORM_rnglistx:
+	case DW_FORM_GNU_addr_index:
+	case DW_FORM_GNU_str_index:
+		at->at_u = rd_uleb(b);
+		break;
+	case DW_FORM_ref_addr:
+		at->at_u = rd_u(b, (cu->cu_version <= 2) ?
+		    cu->cu_addr_size : cu->cu_off_size);
+		break;
+	case DW_FORM_strp:
+	case DW_FORM_line_strp:
+	case DW_FORM_sec_offset:
+	case DW_FORM_strp_sup:
+	case DW_FORM_GNU_ref_alt:
+	case DW_FORM_GNU_strp_alt:
+		at->at_u = rd_u(b, cu->cu_off_size);
+		break;
+	case DW_FORM_flag_present:
+		at->at_u = 1;
+		break;
+	case DW_FORM_implicit_const:
+		at->at_u = cnst;
+		break;
+	case DW_FORM_indirect:
+		rd_form(cu, b, rd_uleb(b), cnst, at);
+		return;
+	default:
+		b->b_err = 1;
+	}
+
+	switch (form) {
+	case DW_FORM_ref1:
+	case DW_FORM_ref2:
+	case DW_FORM_ref4:
+	case DW_FORM_ref8:
+	case DW_FORM_ref_udata:
+		at->at_u += cu->cu_off;
+		break;
+	}
+}
+
+/*
+ * reads attributes of DIE, only those we need are returned in attrs.
+ */
+static void
+rd_die(struct kd_cu *cu, struct kd_buf *b, struct kd_abbrev *ka,
+    struct kd_attr *attrs)
+{
+	struct kd_attrspec *as;
+	struct kd_attr at;
+	size_t i;
+	int slot;
+
+	for (i = 0; i < KA_COUNT; i++)
+		attrs[i].at_set = 0;
+
+	for (i = 0; i < ka->ka_nattrs && !b->b_err; i++) {
+		as = &cu->cu_attrs[ka->ka_attr + i];
+		rd_form(cu, b, as->as_form, as->as_const, &at);
+		switch (as->as_name) {
+		case DW_AT_name:
+			slot = KA_NAME;
+			break;
+		case DW_AT_stmt_list:
+			slot = KA_STMT_LIST;
+			break;
+		case DW_AT_low_pc:
+			slot = KA_LOW_PC;
+			break;
+		case DW_AT_high_pc:
+			slot = KA_HIGH_PC;
+			break;
+		case DW_AT_abstract_origin:
+			slot = KA_ORIGIN;
+			break;
+		case DW_AT_specification:
+			slot = KA_SPEC;
+			break;
+		case DW_AT_ranges:
+			slot = KA_RANGES;
+			break;
+		case DW_AT_call_file:
+			slot = KA_CALL_FILE;
+			break;
+		case DW_AT_call_line:
+			slot = KA_CALL_LINE;
+			break;
+		case DW_AT_str_offsets_base:
+			slot = KA_STR_OFFSETS;
+			break;
+		case DW_AT_addr_base:
+			slot = KA_ADDR_BASE;
+			break;
+		case DW_AT_rnglists_base:
+			slot = KA_RNGLISTS_BASE;
+			break;
+		default:
+			continue;
+		}
+		attrs[slot] = at;
+		attrs[slot].at_set = 1;
+	}
+}
+
+static const char *
+attr_str(struct kdwarf *kd, struct kd_cu *cu, struct kd_attr *at)
+{
+	struct kd_buf b;
+
+	switch (at->at_form) {
+	case DW_FORM_string:
+		return (at->at_str);
+	case DW_FORM_strp:
+		return (sect_str(kd, KD_STR, at->at_u));
+	case DW_FORM_line_strp:
+		return (sect_str(kd, KD_LINE_STR, at->at_u));
+	case DW_FORM_strx:
+	case DW_FORM_strx1:
+	case DW_FORM_strx2:
+	case DW_FORM_strx3:
+	case DW_FORM_strx4:
+	case DW_FORM_GNU_str_index:
+		kd_buf_init(&b, &kd->kd_sect[KD_STR_OFFSETS],
+		    cu->cu_str_offsets + at->at_u * cu->cu_off_size,
+		    cu->cu_off_size);
+		return (sect_str(kd, KD_STR, rd_u(&b, cu->cu_off_size)));
+	}
+
+	return (NULL);
+}
+
+static uint64_t
+attr_addr(struct kdwarf *kd, struct kd_cu *cu, struct kd_attr *at)
+{
+	struct kd_buf b;
+
+	switch (at->at_form) {
+	case DW_FORM_addrx:
+	case DW_FORM_addrx1:
+	case DW_FORM_addrx2:
+	case DW_FORM_addrx3:
+	case DW_FORM_addrx4:
+	case DW_FORM_GNU_addr_index:
+		kd_buf_init(&b, &kd->kd_sect[KD_ADDR],
+		    cu->cu_addr_base + at->at_u * cu->cu_addr_size,
+		    cu->cu_addr_size);
+		return (rd_u(&b, cu->cu_addr_size));
+	}
+
+	return (at->at_u);
+}
+
+static int
+cu_compare(const void *key, const void *entry)
+{
+	uint64_t off = *(const uint64_t *)key;
+	const struct kd_cu *cu = entry;
+
+	if (off < cu->cu_off)
+		return (-1);
+	return (off >= cu->cu_end);
+}
+
+/*
+ * returns name of function DIE at offset off refers to. Inlined
+ * function refers to abstract DIE which may in turn refer to
+ * declaration.
+ */
+static const char *
+die_name(struct kdwarf *kd, uint64_t off, int hops)
+{
+	struct kd_attr attrs[KA_COUNT];
+	struct kd_abbrev *ka;
+	struct kd_cu *cu;
+	struct kd_buf b;
+
+	cu = bsearch(&off, kd->kd_cus, kd->kd_ncus, sizeof (struct kd_cu),
+	    cu_compare);
+	if (cu == NULL || hops > 4)
+		return (NULL);
+	if (!cu->cu_abbrevs_read && read_abbrevs(kd, cu) == -1)
+		return (NULL);
+
+	kd_buf_init(&b, &kd->kd_sect[KD_INFO], off, cu->cu_end - off);
+	if ((ka = find_abbrev(cu, rd_uleb(&b))) == NULL)
+		return (NULL);
+	rd_die(cu, &b, ka, attrs);
+	if (b.b_err)
+		return (NULL);
+
+	if (attrs[KA_NAME].at_set)
+		return (attr_str(kd, cu, &attrs[KA_NAME]));
+	if (attrs[KA_ORIGIN].at_set &&
+	    attrs[KA_ORIGIN].at_form != DW_FORM_GNU_ref_alt)
+		return (die_name(kd, attrs[KA_ORIGIN].at_u, hops + 1));
+	if (attrs[KA_SPEC].at_set &&
+	    attrs[KA_SPEC].at_form != DW_FORM_GNU_ref_alt)
+		return (die_name(kd, attrs[KA_SPEC].at_u, hops + 1));
+
+	return (NULL);
+}
+
+static void
+add_inline(struct kdwarf *kd, struct kd_inline *tmpl, uint64_t lo,
+    uint64_t hi)
+{
+	struct kd_inline *ki;
+
+	if (lo == 0 || lo >= hi)
+		return;
+
+	kd->kd_inlines = kd_grow(kd->kd_inlines, kd->kd_ninlines,
+	    &kd->kd_inlines_size, sizeof (struct kd_inline));
+	ki = &kd->kd_inlines[kd->kd_ninlines++];
+	*ki = *tmpl;
+	ki->ki_lo = lo;
+	ki->ki_hi = hi;
+}
+
+/*
+ * adds address ranges of inlined function, ranges come either from
+ * DW_AT_low_pc/DW_AT_high_pc or from range list.
+ */
+static void
+add_ranges(struct kdwarf *kd, struct kd_cu *cu, struct kd_attr *attrs,
+    struct kd_inline *tmpl)
+{
+	struct kd_attr at;
+	struct kd_buf b;
+	uint64_t lo, hi, base = cu->cu_base, off;
+	int kind;
+
+	if (attrs[KA_LOW_PC].at_set && attrs[KA_HIGH_PC].at_set) {
+		lo = attr_addr(kd, cu, &attrs[KA_LOW_PC]);
+		hi = attr_addr(kd, cu, &attrs[KA_HIGH_PC]);
+		switch (attrs[KA_HIGH_PC].at_form) {
+		case DW_FORM_addr:
+		case DW_FORM_addrx:
+		case DW_FORM_addrx1:
+		case DW_FORM_addrx2:
+		case DW_FORM_addrx3:
+		case DW_FORM_addrx4:
+		case DW_FORM_GNU_addr_index:
+			break;
+		default:
+			hi += lo;	/* high pc is offset from low pc */
+		}
+		add_inline(kd, tmpl, lo, hi);
+		return;
+	}
+
+	if (!attrs[KA_RANGES].at_set)
+		return;
+
+	if (cu->cu_version < 5) {
+		kd_buf_init(&b, &kd->kd_sect[KD_RANGES], attrs[KA_RANGES].at_u,
+		    (attrs[KA_RANGES].at_u <= kd->kd_sect[KD_RANGES].kds_len) ?
+		    kd->kd_sect[KD_RANGES].kds_len - attrs[KA_RANGES].at_u : 0);
+		while (!b.b_err) {
+			lo = rd_u(&b, cu->cu_addr_size);
+			hi = rd_u(&b, cu->cu_addr_size);
+			if (lo == 0 && hi == 0)
+				break;
+			if (lo == ((cu->cu_addr_size == 8) ?
+			    ~0ULL : 0xffffffffULL))
+				base = hi;
+			else
+				add_inline(kd, tmpl, base + lo, base + hi);
+		}
+		return;
+	}
+
+	off = attrs[KA_RANGES].at_u;
+	if (attrs[KA_RANGES].at_form == DW_FORM_rnglistx) {
+		kd_buf_init(&b, &kd->kd_sect[KD_RNGLISTS],
+		    cu->cu_rnglists_base + off * cu->cu_off_size,
+		    cu->cu_off_size);
+		off = cu->cu_rnglists_base + rd_u(&b, cu->cu_off_size);
+		if (b.b_err)
+			return;
+	}
+	kd_buf_init(&b, &kd->kd_sect[KD_RNGLISTS], off,
+	    (off <= kd->kd_sect[KD_RNGLISTS].kds_len) ?
+	    kd->kd_sect[KD_RNGLISTS].kds_len - off : 0);
+	at.at_form = DW_FORM_addrx;
+	while (!b.b_err && (kind = rd_u(&b, 1)) != DW_RLE_end_of_list) {
+		switch (kind) {
+		case DW_RLE_base_addressx:
+			at.at_u = rd_uleb(&b);
+			base = attr_addr(kd, cu, &at);
+			break;
+		case DW_RLE_startx_endx:
+			at.at_u = rd_uleb(&b);
+			lo = attr_addr(kd, cu, &at);
+			at.at_u = rd_uleb(&b);
+			hi = attr_addr(kd, cu, &at);
+			add_inline(kd, tmpl, lo, hi);
+			break;
+		case DW_RLE_startx_length:
+			at.at_u = rd_uleb(&b);
+			lo = attr_addr(kd, cu, &at);
+			add_inline(kd, tmpl, lo, lo + rd_uleb(&b));
+			break;
+		case DW_RLE_offset_pair:
+			lo = rd_uleb(&b);
+			hi = rd_uleb(&b);
+			add_inline(kd, tmpl, base + lo, base + hi);
+			break;
+		case DW_RLE_base_address:
+			base = rd_u(&b, cu->cu_addr_size);
+			break;
+		case DW_RLE_start_end:
+			lo = rd_u(&b, cu->cu_addr_size);
+			hi = rd_u(&b, cu->cu_addr_size);
+			add_inline(kd, tmpl, lo, hi);
+			break;
+		case DW_RLE_start_length:
+			lo = rd_u(&b, cu->cu_addr_size);
+			add_inline(kd, tmpl, lo, lo + rd_uleb(&b));
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/*
+ * walks DIEs of compile unit and records inlined functions.
+ */
+static void
+read_cu(struct kdwarf *kd, struct kd_cu *cu)
+{
+	struct kd_attr attrs[KA_COUNT];
+	struct kd_abbrev *ka;
+	struct kd_inline tmpl;
+	struct kd_buf b;
+	uint32_t inlines[KD_MAX_DEPTH];
+	uint64_t code, off;
+	int level = 0;
+
+	if (!cu->cu_abbrevs_read && read_abbrevs(kd, cu) == -1)
+		return;
+
+	kd_buf_init(&b, &kd->kd_sect[KD_INFO], cu->cu_dies,
+	    cu->cu_end - cu->cu_dies);
+	inlines[0] = 0;
+	while (b.b_ptr < b.b_end && !b.b_err) {
+		if ((code = rd_uleb(&b)) == 0) {
+			if (level > 0)
+				level--;
+			continue;
+		}
+		if ((ka = find_abbrev(cu, code)) == NULL)
+			return;
+		rd_die(cu, &b, ka, attrs);
+
+		if (ka->ka_tag == DW_TAG_compile_unit ||
+		    ka->ka_tag == DW_TAG_partial_unit) {
+			if (attrs[KA_STR_OFFSETS].at_set)
+				cu->cu_str_offsets = attrs[KA_STR_OFFSETS].at_u;
+			if (attrs[KA_ADDR_BASE].at_set)
+				cu->cu_addr_base = attrs[KA_ADDR_BASE].at_u;
+			if (attrs[KA_RNGLISTS_BASE].at_set)
+				cu->cu_rnglists_base =
+				    attrs[KA_RNGLISTS_BASE].at_u;
+			if (attrs[KA_LOW_PC].at_set)
+				cu->cu_base = attr_addr(kd, cu,
+				    &attrs[KA_LOW_PC]);
+			if (attrs[KA_STMT_LIST].at_set) {
+				off = attrs[KA_STMT_LIST].at_u;
+				cu->cu_prog = bsearch(&off, kd->kd_progs,
+				    kd->kd_nprogs, sizeof (struct kd_prog),
+				    prog_compare);
+			}
+		} else if (ka->ka_tag == DW_TAG_inlined_subroutine) {
+			tmpl.ki_name = NULL;
+			if (attrs[KA_ORIGIN].at_set &&
+			    attrs[KA_ORIGIN].at_form != DW_FORM_GNU_ref_alt)
+				tmpl.ki_name = die_name(kd,
+				    attrs[KA_ORIGIN].at_u, 0);
+			tmpl.ki_call_file = prog_file(cu->cu_prog,
+			    attrs[KA_CALL_FILE].at_set ?
+			    attrs[KA_CALL_FILE].at_u : 0);
+			tmpl.ki_call_line = attrs[KA_CALL_LINE].at_set ?
+			    attrs[KA_CALL_LINE].at_u : 0;
+			tmpl.ki_depth = inlines[level];
+			add_ranges(kd, cu, attrs, &tmpl);
+		}
+
+		if (ka->ka_children) {
+			if (level + 1 == KD_MAX_DEPTH)
+				return;
+			inlines[level + 1] = inlines[level] +
+			    (ka->ka_tag == DW_TAG_inlined_subroutine);
+			level++;
+		}
+	}
+}
+
+/*
+ * reads headers of all compile units, then walks them.
+ */
+static void
+read_info(struct kdwarf *kd)
+{
+	struct kd_buf b;
+	struct kd_cu *cu;
+	uint64_t off = 0, len;
+	size_t i;
+	int off_size, unit_type;
+
+	while (off < kd->kd_sect[KD_INFO].kds_len) {
+		kd_buf_init(&b, &kd->kd_sect[KD_INFO], off,
+		    kd->kd_sect[KD_INFO].kds_len - off);
+		len = rd_length(&b, &off_size);
+		if (b.b_err || len > (uint64_t)(b.b_end - b.b_ptr))
+			break;
+		kd->kd_cus = kd_grow(kd->kd_cus, kd->kd_ncus, &kd->kd_cus_size,
+		    sizeof (struct kd_cu));
+		cu = &kd->kd_cus[kd->kd_ncus];
+		memset(cu, 0, sizeof (struct kd_cu));
+		cu->cu_off = off;
+		cu->cu_end = (b.b_ptr - kd->kd_sect[KD_INFO].kds_data) + len;
+		cu->cu_off_size = off_size;
+		cu->cu_version = rd_u(&b, 2);
+		unit_type = DW_UT_compile;
+		if (cu->cu_version >= 5) {
+			unit_type = rd_u(&b, 1);
+			cu->cu_addr_size = rd_u(&b, 1);
+			cu->cu_abbrev_off = rd_u(&b, off_size);
+		} else {
+			cu->cu_abbrev_off = rd_u(&b, off_size);
+			cu->cu_addr_size = rd_u(&b, 1);
+		}
+		cu->cu_dies = b.b_ptr - kd->kd_sect[KD_INFO].kds_data;
+		off = cu->cu_end;
+		if (b.b_err || cu->cu_version < 2 || cu->cu_version > 5 ||
+		    (cu->cu_addr_size != 4 && cu->cu_addr_size != 8) ||
+		    (unit_type != DW_UT_compile && unit_type != DW_UT_partial))
+			continue;
+		kd->kd_ncus++;
+	}
+
+	for (i = 0; i < kd->kd_ncus; i++)
+		read_cu(kd, &kd->kd_cus[i]);
+}
+
+static int
+inline_compare(const void *a, const void *b)
+{
+	const struct kd_inline *a_ki = a, *b_ki = b;
+
+	if (a_ki->ki_lo != b_ki->ki_lo)
+		return ((a_ki->ki_lo < b_ki->ki_lo) ? -1 : 1);
+	if (a_ki->ki_depth != b_ki->ki_depth)
+		return ((a_ki->ki_depth < b_ki->ki_depth) ? -1 : 1);
+	return (0);
+}
+
+struct kdwarf *
+kdwarf_open(const struct kd_sect *sect)
+{
+	struct kdwarf *kd;
+	uint64_t maxhi = 0;
+	size_t i;
+
+	if (sect[KD_LINE].kds_data == NULL)
+		return (NULL);
+
+	if ((kd = calloc(1, sizeof (struct kdwarf))) == NULL)
+		err(1, NULL);
+	memcpy(kd->kd_sect, sect, sizeof (kd->kd_sect));
+
+	read_lines(kd);
+	if (sect[KD_INFO].kds_data != NULL && sect[KD_ABBREV].kds_data != NULL)
+		read_info(kd);
+
+	/* abbreviations are needed only while DIEs are read */
+	for (i = 0; i < kd->kd_ncus; i++) {
+		free(kd->kd_cus[i].cu_abbrevs);
+		free(kd->kd_cus[i].cu_attrs);
+	}
+	free(kd->kd_cus);
+	kd->kd_cus = NULL;
+	kd->kd_ncus = 0;
+	free(kd->kd_progs);
+	kd->kd_progs = NULL;
+	kd->kd_nprogs = 0;
+
+	qsort(kd->kd_inlines, kd->kd_ninlines, sizeof (struct kd_inline),
+	    inline_compare);
+	for (i = 0; i < kd->kd_ninlines; i++) {
+		if (kd->kd_inlines[i].ki_hi > maxhi)
+			maxhi = kd->kd_inlines[i].ki_hi;
+		kd->kd_inlines[i].ki_maxhi = maxhi;
+	}
+
+	if (kd->kd_nrows == 0 && kd->kd_ninlines == 0) {
+		kdwarf_close(kd);
+		return (NULL);
+	}
+
+	return (kd);
+}
+
+void
+kdwarf_close(struct kdwarf *kd)
+{
+	if (kd == NULL)
+		return;
+
+	free(kd->kd_rows);
+	free(kd->kd_files);
+	free(kd->kd_inlines);
+	free(kd);
+}
+
+/*
+ * returns the last row at or below pc or NULL.
+ */
+static struct kd_row *
+find_row(struct kdwarf *kd, uint64_t pc)
+{
+	size_t lo = 0, hi = kd->kd_nrows, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (kd->kd_rows[mid].kr_addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || kd->kd_rows[lo - 1].kr_file == KD_NOFILE)
+		return (NULL);
+
+	return (&kd->kd_rows[lo - 1]);
+}
+
+/*
+ * collects inlined functions which cover pc, outermost goes first.
+ * Entries are sorted by ki_lo, ki_maxhi tells when we can stop walking
+ * back.
+ */
+static int
+find_inlines(struct kdwarf *kd, uint64_t pc, struct kd_inline **found)
+{
+	struct kd_inline *ki;
+	size_t lo = 0, hi = kd->kd_ninlines, mid;
+	int n = 0, i;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (kd->kd_inlines[mid].ki_lo <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	while (lo > 0 && n < KD_MAX_INLINE) {
+		ki = &kd->kd_inlines[--lo];
+		if (ki->ki_maxhi <= pc)
+			break;
+		if (pc >= ki->ki_hi)
+			continue;
+		/* insert sorted by depth */
+		for (i = n; i > 0 && found[i - 1]->ki_depth > ki->ki_depth;
+		    i--)
+			found[i] = found[i - 1];
+		found[i] = ki;
+		n++;
+	}
+
+	/* the same depth twice means broken DWARF, keep the first */
+	for (i = 1; i < n; i++) {
+		if (found[i]->ki_depth == found[i - 1]->ki_depth) {
+			memmove(&found[i], &found[i + 1],
+			    (n - i - 1) * sizeof (*found));
+			n--;
+			i--;
+		}
+	}
+
+	return (n);
+}
+
+static const char *
+file_name(struct kdwarf *kd, uint32_t file)
+{
+	return ((file < kd->kd_nfiles) ? kd->kd_files[file] : "??");
+}
+
+/*
+ * Writes source location of pc to str, pc is address in object (not
+ * in process). Frames hold return addresses, so we look up pc - 1
+ * to get the call instruction. When pc falls to inlined code the
+ * inlined functions follow, each with its own location:
+ *	" (digest.c:412) | sha256_update (sha256.c:88) | ..."
+ * Location given to function is where the next inlined function is
+ * called from, the last one gets location from line table. Returns
+ * length of string as snprintf(3) does, 0 if nothing is known
+ * about pc.
+ */
+int
+kdwarf_snprintline(struct kdwarf *kd, char *str, size_t size,
+    unsigned long pc)
+{
+	struct kd_inline *found[KD_MAX_INLINE];
+	struct kd_row *kr;
+	const char *file;
+	unsigned int line;
+	size_t len = 0;
+	char *p;
+	int n, i, rv;
+
+	if (kd == NULL || pc == 0)
+		return (0);
+	pc--;
+
+	kr = find_row(kd, pc);
+	n = find_inlines(kd, pc, found);
+	if (kr == NULL && n == 0)
+		return (0);
+
+	for (i = 0; i <= n; i++) {
+		if (i < n) {
+			file = file_name(kd, found[i]->ki_call_file);
+			line = found[i]->ki_call_line;
+		} else if (kr != NULL) {
+			file = file_name(kd, kr->kr_file);
+			line = kr->kr_line;
+		} else {
+			file = "??";
+			line = 0;
+		}
+		p = (len < size) ? str + len : NULL;
+		if (i == 0)
+			rv = snprintf(p, (p != NULL) ? size - len : 0,
+			    " (%s:%u)", file, line);
+		else
+			rv = snprintf(p, (p != NULL) ? size - len : 0,
+			    " | %s (%s:%u)", (found[i - 1]->ki_name != NULL) ?
+			    found[i - 1]->ki_name : "??", file, line);
+		if (rv < 0)
+			return (rv);
+		len += rv;
+	}
+
+	return (len);
+}
@@ -15,8 +15,17 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
+#ifdef __OpenBSD__
+#include <pthread_np.h>
+#endif
 #include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/atomic.h>
 
 #include <openssl/crypto.h>
@@ -42,16 +51,54 @@ struct memhdr {
 	uint64_t	mh_chk;
 };
 
+/*
+ * Stats mode keeps its own header, smh_time is allocation time used
+ * for lifetime histogram. smh_pad keeps the header 32 bytes, so buffers
+ * stay 16 bytes aligned. Trace modes use 16 bytes struct memhdr.
+ */
+struct stats_memhdr {
+	size_t		smh_size;
+	uint64_t	smh_chk;
+	uint64_t	smh_time;
+	uint64_t	smh_pad;
+};
+
 #define	MS_TOTAL_ALLOCATED	"\"total_allocated_sz\""
 #define	MS_TOTAL_RELEASED	"\"total_released_sz\""
 #define	MS_ALLOCS		"\"allocs\""
 #define	MS_RELEASES		"\"releases\""
 #define	MS_REALLOCS		"\"reallocs\""
 #define	MS_MAX			"\"max\""
+#define	MS_MAX_ERROR		"\"max_error\""
 #define	MS_TSTART		"\"tstart\""
 #define	MS_TFINISH		"\"tfinish\""
 #define	MS_SEC			"\"sec\""
 #define	MS_NSEC			"\"nsec\""
+#define	MS_CLOCK_RES		"\"clock_resolution_ns\""
+#define	MS_SIZE_HIST		"\"size_histogram\""
+#define	MS_LIFE_HIST		"\"lifetime_histogram_us\""
+#define	MS_LIFE_HIST_TICKS	"\"lifetime_histogram_ticks\""
+
+/*
+ * Histograms have log2 buckets. Bucket n holds values from
+ * [2^(n-1), 2^n - 1], bucket 0 holds 0. Size histogram counts
+ * requested sizes of malloc and realloc, lifetime histogram counts
+ * microseconds (or clock ticks with coarse clock) between allocation
+ * and release of buffer. Buffers which are not released are not found
+ * in lifetime histogram.
+ */
+#define	MS_HIST_BUCKETS		40
+
+/*
+ * Timestamps for lifetime histogram come from CLOCK_MONOTONIC, buffers
+ * often live for few microseconds only. MPROFILE_CLOCK=coarse selects
+ * CLOCK_MONOTONIC_COARSE, which is cheaper but its resolution is 1-4ms.
+ * Lifetimes are then counted in ticks of clock resolution (ms_life_unit
+ * in ns) instead of microseconds. The resolution is found in stats.
+ */
+static clockid_t ms_clock = CLOCK_MONOTONIC;
+static uint64_t ms_life_unit = 1000;
+
 static struct memstats {
 	uint64_t	ms_total_allocated;
 	uint64_t	ms_total_released;
@@ -59,15 +106,79 @@ static struct memstats {
 	uint64_t	ms_allocs;
 	uint64_t	ms_free;
 	uint64_t	ms_max;
-	uint64_t	ms_current;
+	uint64_t	ms_max_error;
+	uint64_t	ms_size_hist[MS_HIST_BUCKETS];
+	uint64_t	ms_life_hist[MS_HIST_BUCKETS];
 	struct timespec	ms_start;
 	struct timespec	ms_finish;
 } ms;
 
+/*
+ * Stats counters are kept in per-thread shards, each shard has its own
+ * cache line, so threads don't fight for single cache line. Threads get
+ * shards in round-robin fashion, threads share shards when there are more
+ * than MS_SHARDS threads. Shards are summed up when stats are saved.
+ *
+ * The current memory usage is global counter msc_current. Shard collects
+ * changes of memory usage in mss_pending and adds them to msc_current
+ * once they exceed MS_BATCH bytes either way, the peak (msc_max) is
+ * updated then. Memory released by other thread than one which allocated
+ * it is just negative change in another shard, so it is accounted for.
+ * msc_current differs from the real usage by at most MS_BATCH bytes for
+ * each shard, so the peak is within (shards used * MS_BATCH) bytes.
+ * With single thread the batch is 0, changes go to msc_current right
+ * away and the peak is exact.
+ *
+ * The peak of multi-threaded application can not be exact without
+ * reading single counter (or all shards at the same instant) on every
+ * operation, which is the cache line bouncing shards avoid.
+ */
+#define	MS_SHARDS	64
+#define	MS_BATCH	4096
+static struct memstats_shard {
+	uint64_t	mss_total_allocated;
+	uint64_t	mss_total_released;
+	uint64_t	mss_reallocs;
+	uint64_t	mss_allocs;
+	uint64_t	mss_free;
+	int64_t		mss_pending;
+	uint64_t	mss_size_hist[MS_HIST_BUCKETS];
+	uint64_t	mss_life_hist[MS_HIST_BUCKETS];
+} __attribute__ ((aligned(64))) ms_shards[MS_SHARDS];
+
+static struct memstats_current {
+	int64_t		msc_current;
+	uint64_t	msc_max;
+} __attribute__ ((aligned(64))) ms_current;
+
+static unsigned int ms_shards_used = 0;
+/* library is preloaded, so initial-exec TLS model is safe and cheap */
+static __thread struct memstats_shard *ms_shard
+    __attribute__ ((tls_model("initial-exec"))) = NULL;
+
 static pthread_key_t mp_pthrd_key;
 
 static FILE *out_file;
 
+/*
+ * Snapshot is written to MPROFILE_OUTF.<sec>.<nsec>. It is requested by
+ * mprofile_snapshot() or by SIGUSR2 when MPROFILE_SNAPSHOT_SIGNAL is
+ * set. Signal handler just posts snap_sem, snapshot is written by
+ * snap_thread.
+ */
+static char *out_fname;
+static int trace_mode = 0;
+static sem_t snap_sem;
+static pthread_t snap_thread;
+
+#ifdef _WITH_STACKTRACE
+#ifdef USE_FP_UNWIND
+static int unwind_fp = 1;
+#else
+static int unwind_fp = 0;
+#endif
+#endif
+
 static void __attribute__ ((constructor)) init(void);
 
 /* ARGSUSED */
@@ -78,32 +189,230 @@ merge_profile(void *void_mprof)
 	pthread_setspecific(mp_pthrd_key, NULL);
 }
 
+static unsigned long long
+ms_clock_res(void)
+{
+	struct timespec ts;
+
+	if (clock_getres(ms_clock, &ts) != 0)
+		return (0);
+
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * prints non-empty buckets only
+ */
+static void
+print_hist(FILE *f, const char *name, uint64_t *hist)
+{
+	unsigned int i;
+	int first = 1;
+
+	fprintf(f, "\t%s : [", name);
+	for (i = 0; i < MS_HIST_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+		fprintf(f, "%s\n\t\t{ \"min\" : %llu, \"max\" : %llu, "
+		    "\"count\" : %llu }", first ? "" : ",",
+		    (i == 0) ? 0ULL : 1ULL << (i - 1),
+		    (i == 0) ? 0ULL : (1ULL << i) - 1,
+		    (unsigned long long)hist[i]);
+		first = 0;
+	}
+	fprintf(f, "\n\t]");
+}
+
+static void
+print_stats(FILE *f, struct timespec *finish)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"annotation\" : \"%s\",\n", mprofile_get_annotation());
+	fprintf(f, "\t%s : %llu,\n", MS_TOTAL_ALLOCATED, ms.ms_total_allocated);
+	fprintf(f, "\t%s : %llu,\n", MS_TOTAL_RELEASED, ms.ms_total_released);
+	fprintf(f, "\t%s : %llu,\n", MS_ALLOCS, ms.ms_allocs);
+	fprintf(f, "\t%s : %llu,\n", MS_RELEASES, ms.ms_free);
+	fprintf(f, "\t%s : %llu,\n", MS_REALLOCS, ms.ms_reallocs);
+	fprintf(f, "\t%s : %llu,\n", MS_MAX, ms.ms_max);
+	fprintf(f, "\t%s : %llu,\n", MS_MAX_ERROR, ms.ms_max_error);
+	fprintf(f, "\t%s : {\n", MS_TSTART);
+	fprintf(f, "\t\t%s : %llu,\n", MS_SEC, ms.ms_start.tv_sec);
+	fprintf(f, "\t\t%s : %ld\n", MS_NSEC, ms.ms_start.tv_nsec);
+	fprintf(f, "\t},\n");
+	fprintf(f, "\t%s : {\n", MS_TFINISH);
+	fprintf(f, "\t\t%s : %llu,\n", MS_SEC, finish->tv_sec);
+	fprintf(f, "\t\t%s : %ld\n", MS_NSEC, finish->tv_nsec);
+	fprintf(f, "\t},\n");
+	fprintf(f, "\t%s : %llu,\n", MS_CLOCK_RES, ms_clock_res());
+	print_hist(f, MS_SIZE_HIST, ms.ms_size_hist);
+	fprintf(f, ",\n");
+	print_hist(f, (ms_clock == CLOCK_MONOTONIC) ?
+	    MS_LIFE_HIST : MS_LIFE_HIST_TICKS, ms.ms_life_hist);
+	fprintf(f, "\n}");
+}
+
+static void
+publish_current(int64_t delta)
+{
+	int64_t current;
+	uint64_t max;
+
+	current = __atomic_add_fetch(&ms_current.msc_current, delta,
+	    __ATOMIC_RELAXED);
+	if (delta <= 0 || current <= 0)
+		return;
+
+	max = __atomic_load_n(&ms_current.msc_max, __ATOMIC_RELAXED);
+	while ((uint64_t)current > max)
+		__atomic_compare_exchange_n(&ms_current.msc_max, &max, current,
+		    0 /* want strong */, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * sums all shards to ms
+ */
+static void
+sum_stats(void)
+{
+	struct memstats_shard *mss;
+	unsigned int i, j, n;
+
+	ms.ms_total_allocated = 0;
+	ms.ms_total_released = 0;
+	ms.ms_reallocs = 0;
+	ms.ms_allocs = 0;
+	ms.ms_free = 0;
+	memset(ms.ms_size_hist, 0, sizeof (ms.ms_size_hist));
+	memset(ms.ms_life_hist, 0, sizeof (ms.ms_life_hist));
+	for (i = 0; i < MS_SHARDS; i++) {
+		mss = &ms_shards[i];
+		publish_current(__atomic_exchange_n(&mss->mss_pending, 0,
+		    __ATOMIC_RELAXED));
+		ms.ms_total_allocated += __atomic_load_n(
+		    &mss->mss_total_allocated, __ATOMIC_RELAXED);
+		ms.ms_total_released += __atomic_load_n(
+		    &mss->mss_total_released, __ATOMIC_RELAXED);
+		ms.ms_reallocs += __atomic_load_n(&mss->mss_reallocs,
+		    __ATOMIC_RELAXED);
+		ms.ms_allocs += __atomic_load_n(&mss->mss_allocs,
+		    __ATOMIC_RELAXED);
+		ms.ms_free += __atomic_load_n(&mss->mss_free,
+		    __ATOMIC_RELAXED);
+		for (j = 0; j < MS_HIST_BUCKETS; j++) {
+			ms.ms_size_hist[j] += __atomic_load_n(
+			    &mss->mss_size_hist[j], __ATOMIC_RELAXED);
+			ms.ms_life_hist[j] += __atomic_load_n(
+			    &mss->mss_life_hist[j], __ATOMIC_RELAXED);
+		}
+	}
+	ms.ms_max = __atomic_load_n(&ms_current.msc_max, __ATOMIC_RELAXED);
+	n = __atomic_load_n(&ms_shards_used, __ATOMIC_RELAXED);
+	if (n > MS_SHARDS)
+		n = MS_SHARDS;
+	ms.ms_max_error = (n > 1) ? (uint64_t)n * MS_BATCH : 0;
+}
+
 static void
 save_stats(void)
 {
 	clock_gettime(CLOCK_REALTIME, &ms.ms_finish);
-
-	fprintf(out_file, "{\n");
-	fprintf(out_file, "\t\"annotation\" : \"%s\",\n", mprofile_get_annotation());
-	fprintf(out_file, "\t%s : %llu,\n", MS_TOTAL_ALLOCATED, ms.ms_total_allocated);
-	fprintf(out_file, "\t%s : %llu,\n", MS_TOTAL_RELEASED, ms.ms_total_released);
-	fprintf(out_file, "\t%s : %llu,\n", MS_ALLOCS, ms.ms_allocs);
-	fprintf(out_file, "\t%s : %llu,\n", MS_RELEASES, ms.ms_free);
-	fprintf(out_file, "\t%s : %llu,\n", MS_REALLOCS, ms.ms_reallocs);
-	fprintf(out_file, "\t%s : %llu,\n", MS_MAX, ms.ms_max);
-	fprintf(out_file, "\t%s : {\n", MS_TSTART);
-	fprintf(out_file, "\t\t%s : %llu,\n", MS_SEC, ms.ms_start.tv_sec);
-	fprintf(out_file, "\t\t%s : %ld,\n", MS_NSEC, ms.ms_start.tv_nsec);
-	fprintf(out_file, "\t},\n");
-	fprintf(out_file, "\t%s : {\n", MS_TFINISH);
-	fprintf(out_file, "\t\t%s : %llu,\n", MS_SEC, ms.ms_finish.tv_sec);
-	fprintf(out_file, "\t\t%s : %ld,\n", MS_NSEC, ms.ms_finish.tv_nsec);
-	fprintf(out_file, "\t}\n");
-	fprintf(out_file, "}");
+	sum_stats();
+	print_stats(out_file, &ms.ms_finish);
 
 	fclose(out_file);
 }
 
+/*
+ * Writes snapshot while application keeps running. In stats mode
+ * it is just the stats, trace modes write live buffers grouped
+ * by stack (see mprofile_save_snapshot()). Returns 0 on success.
+ */
+int
+mprofile_snapshot(void)
+{
+	static pthread_mutex_t snap_mtx = PTHREAD_MUTEX_INITIALIZER;
+	struct timespec ts;
+	char fname[PATH_MAX];
+	FILE *f;
+	int rv = 0;
+
+	if (out_fname == NULL)
+		return (-1);
+
+	pthread_mutex_lock(&snap_mtx);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(fname, sizeof (fname), "%s.%lld.%09ld", out_fname,
+	    (long long)ts.tv_sec, ts.tv_nsec);
+	f = fopen(fname, "w");
+	if (f == NULL) {
+		pthread_mutex_unlock(&snap_mtx);
+		return (-1);
+	}
+
+	if (trace_mode) {
+		rv = mprofile_save_snapshot(f, &ts);
+	} else {
+		sum_stats();
+		print_stats(f, &ts);
+	}
+
+	fclose(f);
+	if (rv != 0)
+		unlink(fname);
+	pthread_mutex_unlock(&snap_mtx);
+
+	return (rv);
+}
+
+/* ARGSUSED */
+static void
+snap_signal(int signum)
+{
+	(void)signum;
+	sem_post(&snap_sem);
+}
+
+/* ARGSUSED */
+static void *
+snap_loop(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		if (sem_wait(&snap_sem) == 0)
+			mprofile_snapshot();
+	}
+
+	return (NULL);
+}
+
+static void
+init_snapshot(void)
+{
+	struct sigaction sa;
+	sigset_t set, oset;
+
+	if (sem_init(&snap_sem, 0, 0) != 0)
+		return;
+
+	/* snapshot thread must not take SIGUSR2 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if (pthread_create(&snap_thread, NULL, snap_loop, NULL) != 0) {
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		return;
+	}
+	pthread_detach(snap_thread);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	memset(&sa, 0, sizeof (sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = snap_signal;
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
 static void
 save_profile_trace(void)
 {
@@ -158,6 +467,16 @@ get_mprofile(void)
 static void
 init_stats(void)
 {
+#ifdef CLOCK_MONOTONIC_COARSE
+	char *clock = getenv("MPROFILE_CLOCK");
+
+	if (clock != NULL && strcmp(clock, "coarse") == 0) {
+		ms_clock = CLOCK_MONOTONIC_COARSE;
+		ms_life_unit = ms_clock_res();
+		if (ms_life_unit == 0)
+			ms_life_unit = 1;
+	}
+#endif
 	clock_gettime(CLOCK_REALTIME, &ms.ms_start);
 	CRYPTO_set_mem_functions(mp_CRYPTO_malloc_stats,
 	    mp_CRYPTO_realloc_stats,
@@ -171,7 +490,8 @@ init_stats(void)
 static void
 init_trace(void)
 {
-	mprofile_init();
+	trace_mode = 1;
+	mprofile_init(out_file);
 	pthread_key_create(&mp_pthrd_key, merge_profile);
 	CRYPTO_set_mem_functions(mp_CRYPTO_malloc_trace,
 	    mp_CRYPTO_realloc_trace, mp_CRYPTO_free_trace);
@@ -181,7 +501,8 @@ init_trace(void)
 static void
 init_trace_with_chains(void)
 {
-	mprofile_init();
+	trace_mode = 1;
+	mprofile_init(out_file);
 	pthread_key_create(&mp_pthrd_key, merge_profile);
 	CRYPTO_set_mem_functions(mp_CRYPTO_malloc_trace,
 	    mp_CRYPTO_realloc_trace, mp_CRYPTO_free_trace);
@@ -196,7 +517,9 @@ init_trace_with_chains(void)
 static void
 init_trace_with_stacks(void)
 {
-	mprofile_init();
+	trace_mode = 1;
+	mprofile_init(out_file);
+	mprofile_init_stacks();
 	pthread_key_create(&mp_pthrd_key, merge_profile);
 	CRYPTO_set_mem_functions(mp_CRYPTO_malloc_trace_with_stack,
 	    mp_CRYPTO_realloc_trace_with_stack,
@@ -207,7 +530,9 @@ init_trace_with_stacks(void)
 static void
 init_trace_with_stacks_with_chains(void)
 {
-	mprofile_init();
+	trace_mode = 1;
+	mprofile_init(out_file);
+	mprofile_init_stacks();
 	pthread_key_create(&mp_pthrd_key, merge_profile);
 	CRYPTO_set_mem_functions(mp_CRYPTO_malloc_trace_with_stack,
 	    mp_CRYPTO_realloc_trace_with_stack,
@@ -223,6 +548,9 @@ mprofile_start(void)
 	char *mprofile_mode = getenv("MPROFILE_MODE");
 	char *fname = getenv("MPROFILE_OUTF");
 	char  default_mode[2] = { '1', 0 };
+#ifdef _WITH_STACKTRACE
+	char *unwind;
+#endif
 
 	if (mprofile_mode == NULL)
 		mprofile_mode = default_mode;
@@ -230,9 +558,19 @@ mprofile_start(void)
 	if (fname == NULL)
 		return;
 
+#ifdef _WITH_STACKTRACE
+	if ((unwind = getenv("MPROFILE_UNWIND")) != NULL) {
+		if (strcmp(unwind, "fp") == 0)
+			unwind_fp = 1;
+		else if (strcmp(unwind, "dwarf") == 0)
+			unwind_fp = 0;
+	}
+#endif
+
 	out_file = fopen(fname, "w");
 	if (out_file == NULL)
 		return;
+	out_fname = fname;
 
 	switch (*mprofile_mode) {
 	case '1':
@@ -257,6 +595,9 @@ mprofile_start(void)
 	default:
 		init_stats();
 	}
+
+	if (getenv("MPROFILE_SNAPSHOT_SIGNAL") != NULL)
+		init_snapshot();
 }
 
 static void
@@ -265,45 +606,117 @@ init(void)
 	mprofile_start();
 }
 
+static struct memstats_shard *
+get_shard(void)
+{
+	unsigned int i;
+
+	if (ms_shard == NULL) {
+		i = __atomic_fetch_add(&ms_shards_used, 1, __ATOMIC_RELAXED);
+		ms_shard = &ms_shards[i % MS_SHARDS];
+	}
+
+	return (ms_shard);
+}
+
+/*
+ * Shard may be shared by more threads, so we still need atomic
+ * operations. Those are cheap as long as cache line is not contended.
+ * Batch is 0 until second thread gets its shard.
+ */
 static void
-update_alloc(uint64_t delta)
+update_current(struct memstats_shard *mss, int64_t delta)
 {
-	uint64_t	current, max;
+	int64_t pending, batch;
+
+	batch = (__atomic_load_n(&ms_shards_used, __ATOMIC_RELAXED) > 1) ?
+	    MS_BATCH : 0;
+	pending = __atomic_add_fetch(&mss->mss_pending, delta,
+	    __ATOMIC_RELAXED);
+	if (pending > batch || pending < -batch)
+		publish_current(__atomic_exchange_n(&mss->mss_pending, 0,
+		    __ATOMIC_RELAXED));
+}
 
-	current = __atomic_add_fetch(&ms.ms_current, delta, __ATOMIC_ACQ_REL);
-	max = __atomic_load_n(&ms.ms_max, __ATOMIC_ACQUIRE);
-	while (current > max)
-		__atomic_compare_exchange_n(&ms.ms_max, &max, current,
-		    0 /* want strong */, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+static void
+update_alloc(struct memstats_shard *mss, uint64_t delta)
+{
+	update_current(mss, (int64_t)delta);
 }
 
 static void
-update_release(uint64_t delta)
+update_release(struct memstats_shard *mss, uint64_t delta)
+{
+	update_current(mss, -(int64_t)delta);
+}
+
+static unsigned int
+hist_bucket(uint64_t v)
 {
-	__atomic_sub_fetch(&ms.ms_current, delta, __ATOMIC_ACQ_REL);
+	unsigned int b;
+
+	if (v == 0)
+		return (0);
+
+	b = 64 - __builtin_clzll(v);
+
+	return ((b < MS_HIST_BUCKETS) ? b : MS_HIST_BUCKETS - 1);
+}
+
+static uint64_t
+ms_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(ms_clock, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+update_size_hist(struct memstats_shard *mss, uint64_t sz)
+{
+	__atomic_add_fetch(&mss->mss_size_hist[hist_bucket(sz)], 1,
+	    __ATOMIC_RELAXED);
+}
+
+static void
+update_life_hist(struct memstats_shard *mss, struct stats_memhdr *smh)
+{
+	uint64_t now = ms_now();
+	uint64_t life;
+
+	life = (now > smh->smh_time) ?
+	    (now - smh->smh_time) / ms_life_unit : 0;
+	__atomic_add_fetch(&mss->mss_life_hist[hist_bucket(life)], 1,
+	    __ATOMIC_RELAXED);
 }
 
 static void *
 mp_CRYPTO_malloc_stats(unsigned long sz, const char *f, int l)
 {
-	struct memhdr *mh;
+	struct memstats_shard *mss = get_shard();
+	struct stats_memhdr *smh;
 	void *rv;
 
-	mh = (struct memhdr *) malloc(sz + sizeof (struct memhdr));
-	if (mh != NULL) {
-		mh->mh_size = sz;
-		mh->mh_chk = (uint64_t)mh ^ sz;
-		rv = (void *)((char *)mh + sizeof (struct memhdr));
+	smh = (struct stats_memhdr *)malloc(sz +
+	    sizeof (struct stats_memhdr));
+	if (smh != NULL) {
+		smh->smh_size = sz;
+		smh->smh_chk = (uint64_t)smh ^ sz;
+		smh->smh_time = ms_now();
+		rv = (void *)((char *)smh + sizeof (struct stats_memhdr));
 	} else {
 		rv = NULL;
 	}
 
-	if (mh != NULL) {
+	if (smh != NULL) {
 		/* RELAXED should be OK as we don't care about result here */
-		__atomic_add_fetch(&ms.ms_allocs, 1, __ATOMIC_RELAXED);
-		__atomic_add_fetch(&ms.ms_total_allocated, sz,
+		__atomic_add_fetch(&mss->mss_allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mss->mss_total_allocated, sz,
 		    __ATOMIC_RELAXED);
-		update_alloc(sz);
+		update_alloc(mss, sz);
+		update_size_hist(mss, sz);
 	}
 
 	return (rv);
@@ -312,96 +725,107 @@ mp_CRYPTO_malloc_stats(unsigned long sz, const char *f, int l)
 static void
 mp_CRYPTO_free_stats(void *b, const char *f, int l)
 {
-	struct memhdr *mh = NULL;
+	struct memstats_shard *mss = get_shard();
+	struct stats_memhdr *smh = NULL;
 	uint64_t chk;
 
 	if (b != NULL) {
-		mh = (struct memhdr *)((char *)b - sizeof (struct memhdr));
-		chk = (uint64_t)mh ^ mh->mh_size;
-		if (chk != mh->mh_chk) {
+		smh = (struct stats_memhdr *)((char *)b -
+		    sizeof (struct stats_memhdr));
+		chk = (uint64_t)smh ^ smh->smh_size;
+		if (chk != smh->smh_chk) {
 			fprintf(stderr, "%p memory corruption detected in %s!",
 			    b, __func__);
 			abort();
 		}
 		/* RELAXED should be OK as we don't care about result here */
-		__atomic_add_fetch(&ms.ms_free, 1, __ATOMIC_RELAXED);
-		__atomic_add_fetch(&ms.ms_total_released, mh->mh_size,
+		__atomic_add_fetch(&mss->mss_free, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mss->mss_total_released, smh->smh_size,
 		    __ATOMIC_RELAXED);
-		update_release(mh->mh_size);
+		update_release(mss, smh->smh_size);
+		update_life_hist(mss, smh);
 	}
 
-	free(mh);
+	free(smh);
 }
 
 static void *
 mp_CRYPTO_realloc_stats(void *b, unsigned long sz, const char *f, int l)
 {
-	struct memhdr *mh;
-	struct memhdr save_mh;
+	struct memstats_shard *mss = get_shard();
+	struct stats_memhdr *smh;
+	struct stats_memhdr save_smh;
 	uint64_t chk, delta;
 	void *rv = NULL;
 
 	if (b != NULL) {
-		mh = (struct memhdr *)((char *)b - sizeof (struct memhdr));
-		chk = (uint64_t)mh ^ mh->mh_size;
-		if (chk != mh->mh_chk) {
+		smh = (struct stats_memhdr *)((char *)b -
+		    sizeof (struct stats_memhdr));
+		chk = (uint64_t)smh ^ smh->smh_size;
+		if (chk != smh->smh_chk) {
 			fprintf(stderr, "%p memory corruption detected in %s!",
 			    b, __func__);
 			abort();
 		}
-		save_mh = *mh;
+		save_smh = *smh;
 	} else {
-		mh = NULL;
+		smh = NULL;
 	}
 
 	if ((sz == 0) && (b != NULL)) {
 		/* this is realloc(x, 0); it's counted as free() */
 
 		/* RELAXED should be OK as we don't care about result here */
-		__atomic_add_fetch(&ms.ms_free, 1, __ATOMIC_RELAXED);
-		__atomic_add_fetch(&ms.ms_total_released, mh->mh_size,
+		__atomic_add_fetch(&mss->mss_free, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mss->mss_total_released, smh->smh_size,
 		    __ATOMIC_RELAXED);
-		update_release(mh->mh_size);
+		update_release(mss, smh->smh_size);
+		update_life_hist(mss, smh);
 	}
 
-	mh = (struct memhdr *)realloc(mh, (sz != 0) ?
-	    sz + sizeof (struct memhdr) : 0);
-	if (mh == NULL)
+	smh = (struct stats_memhdr *)realloc(smh, (sz != 0) ?
+	    sz + sizeof (struct stats_memhdr) : 0);
+	if (smh == NULL)
 		return (NULL);	/* consider recording failure */
 
 	if (sz == 0)
-		return ((mh == NULL) ?
-		    NULL : ((char *)mh) + sizeof (struct memhdr));
+		return ((smh == NULL) ?
+		    NULL : ((char *)smh) + sizeof (struct stats_memhdr));
 
-	rv = (void *)((char *)mh + sizeof (struct memhdr));
-	if (mh != NULL) {
-		mh->mh_size = sz;
-		mh->mh_chk = (uint64_t)mh ^ sz;
+	rv = (void *)((char *)smh + sizeof (struct stats_memhdr));
+	if (smh != NULL) {
+		smh->smh_size = sz;
+		smh->smh_chk = (uint64_t)smh ^ sz;
 		if (b == NULL) {
 			/* this is  realloc(NULL, n); it's counted as malloc() */
 
 			/* RELAXED should be OK as we don't care about result here */
-			__atomic_add_fetch(&ms.ms_allocs, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&mss->mss_allocs, 1,
+			    __ATOMIC_RELAXED);
 			/* RELAXED should be OK as we don't care about result here */
-			__atomic_add_fetch(&ms.ms_total_allocated, sz,
+			__atomic_add_fetch(&mss->mss_total_allocated, sz,
 			    __ATOMIC_RELAXED);
-			update_alloc(sz);
+			update_alloc(mss, sz);
+			smh->smh_time = ms_now();
 		} else {
-			__atomic_add_fetch(&ms.ms_reallocs, 1, __ATOMIC_RELAXED);
-			if (save_mh.mh_size > mh->mh_size) {
+			/* realloc() keeps the allocation time in header */
+			__atomic_add_fetch(&mss->mss_reallocs, 1,
+			    __ATOMIC_RELAXED);
+			if (save_smh.smh_size > smh->smh_size) {
 				/* memory is shrinking */
-				delta = save_mh.mh_size - mh->mh_size;
-				update_release(delta);
-				__atomic_add_fetch(&ms.ms_total_released, delta,
-				    __ATOMIC_RELAXED);
+				delta = save_smh.smh_size - smh->smh_size;
+				update_release(mss, delta);
+				__atomic_add_fetch(&mss->mss_total_released,
+				    delta, __ATOMIC_RELAXED);
 			} else {
 				/* memory is growing */
-				delta = mh->mh_size - save_mh.mh_size;
-				__atomic_add_fetch(&ms.ms_total_allocated, delta,
-				    __ATOMIC_RELAXED);
-				update_alloc(delta);
+				delta = smh->smh_size - save_smh.smh_size;
+				__atomic_add_fetch(&mss->mss_total_allocated,
+				    delta, __ATOMIC_RELAXED);
+				update_alloc(mss, delta);
 			}
 		}
+		update_size_hist(mss, sz);
 	}
 
 	return (rv);
@@ -537,6 +961,94 @@ collect_backtrace(struct _Unwind_Context *uw_context, void *cb_arg)
 }
 #endif	/* USE_LIBUNWIND */
 
+/*
+ * Frame pointer walker is much cheaper than DWARF unwinding, but it
+ * works only when code is compiled with -fno-omit-frame-pointer.
+ * Each frame starts with saved frame pointer of caller followed by
+ * return address. We stop as soon as frame pointer leaves the stack
+ * of current thread or does not move towards the stack bottom, so
+ * the walk never touches memory outside of the stack. Stack range
+ * is obtained once for every thread.
+ */
+static __thread uintptr_t fp_stack_lo;
+static __thread uintptr_t fp_stack_hi;
+
+static void
+fp_stack_range(void)
+{
+#ifdef __OpenBSD__
+	stack_t ss;
+
+	if (pthread_stackseg_np(pthread_self(), &ss) == 0) {
+		fp_stack_hi = (uintptr_t)ss.ss_sp;
+		fp_stack_lo = fp_stack_hi - ss.ss_size;
+	}
+#else
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_sz;
+
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		if (pthread_attr_getstack(&attr, &stack_addr, &stack_sz) == 0) {
+			fp_stack_lo = (uintptr_t)stack_addr;
+			fp_stack_hi = fp_stack_lo + stack_sz;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+}
+
+static void __attribute__ ((noinline))
+collect_backtrace_fp(mprofile_stack_t *mps)
+{
+	uintptr_t *fp = (uintptr_t *)__builtin_frame_address(0);
+	uintptr_t *next_fp;
+
+	if (fp_stack_hi == 0) {
+		fp_stack_range();
+		if (fp_stack_hi == 0)
+			return;
+	}
+
+	while ((uintptr_t)fp >= fp_stack_lo &&
+	    (uintptr_t)fp <= fp_stack_hi - 2 * sizeof (uintptr_t) &&
+	    ((uintptr_t)fp & (sizeof (uintptr_t) - 1)) == 0) {
+		if (fp[1] == 0)
+			break;
+		mprofile_push_frame(mps, (unsigned long long)fp[1]);
+		next_fp = (uintptr_t *)fp[0];
+		if (next_fp <= fp)
+			break;
+		fp = next_fp;
+	}
+}
+
+/*
+ * Collects stack only when operation is sampled, see mprofile_sample().
+ * Without MPROFILE_SAMPLE_BYTES/MPROFILE_SAMPLE_RATE all operations
+ * are sampled.
+ */
+static mprofile_stack_t *
+sample_backtrace(mprofile_t *mp, size_t sz, char *stack_buf, size_t buf_sz)
+{
+	mprofile_stack_t *mps;
+
+	if (mprofile_sample(mp, sz) == 0)
+		return (NULL);
+
+	mps = mprofile_init_stack(stack_buf, buf_sz);
+	if (unwind_fp)
+		collect_backtrace_fp(mps);
+	else
+#ifdef USE_LIBUNWIND
+		collect_backtrace(mps);
+#else
+		_Unwind_Backtrace(collect_backtrace, mps);
+#endif
+
+	return (mps);
+}
+
 static void *
 mp_CRYPTO_malloc_trace_with_stack(unsigned long sz, const char *f, int l)
 {
@@ -544,8 +1056,7 @@ mp_CRYPTO_malloc_trace_with_stack(unsigned long sz, const char *f, int l)
 	void *rv;
 	mprofile_t *mp = get_mprofile();
 	char stack_buf[512];
-	mprofile_stack_t *mps = mprofile_init_stack(stack_buf,
-	    sizeof (stack_buf));
+	mprofile_stack_t *mps;
 
 	mh = (struct memhdr *) malloc(sz + sizeof (struct memhdr));
 	if (mh != NULL) {
@@ -555,11 +1066,7 @@ mp_CRYPTO_malloc_trace_with_stack(unsigned long sz, const char *f, int l)
 	} else {
 		rv = NULL;
 	}
-#ifdef USE_LIBUNWIND
-	collect_backtrace(mps);
-#else
-	_Unwind_Backtrace(collect_backtrace, mps);
-#endif
+	mps = sample_backtrace(mp, sz, stack_buf, sizeof (stack_buf));
 	if (mp != NULL)
 		mprofile_record_alloc(mp, rv, sz, mps);
 
@@ -573,14 +1080,9 @@ mp_CRYPTO_free_trace_with_stack(void *b, const char *f, int l)
 	mprofile_t *mp = get_mprofile();
 	uint64_t chk;
 	char stack_buf[512];
-	mprofile_stack_t *mps = mprofile_init_stack(stack_buf,
-	    sizeof (stack_buf));
+	mprofile_stack_t *mps;
 
-#ifdef USE_LIBUNWIND
-	collect_backtrace(mps);
-#else
-	_Unwind_Backtrace(collect_backtrace, mps);
-#endif
+	mps = sample_backtrace(mp, 0, stack_buf, sizeof (stack_buf));
 
 	if (b != NULL) {
 		mh = (struct memhdr *)((char *)b - sizeof (struct memhdr));
@@ -607,8 +1109,7 @@ mp_CRYPTO_realloc_trace_with_stack(void *b, unsigned long sz, const char *f,
 	mprofile_t *mp = get_mprofile();
 	void *rv = NULL;
 	char stack_buf[512];
-	mprofile_stack_t *mps = mprofile_init_stack(stack_buf,
-	    sizeof (stack_buf));;
+	mprofile_stack_t *mps;
 
 	if (b != NULL) {
 		mh = (struct memhdr *)((char *)b - sizeof (struct memhdr));
@@ -623,6 +1124,8 @@ mp_CRYPTO_realloc_trace_with_stack(void *b, unsigned long sz, const char *f,
 		mh = NULL;
 	}
 
+	mps = sample_backtrace(mp, sz, stack_buf, sizeof (stack_buf));
+
 	if (sz == 0)
 		mprofile_record_free(mp, b, (b == NULL) ? 0 : mh->mh_size, mps);
 
@@ -634,11 +1137,6 @@ mp_CRYPTO_realloc_trace_with_stack(void *b, unsigned long sz, const char *f,
 	if (sz == 0)
 		return (b);
 
-#ifdef USE_LIBUNWIND
-	collect_backtrace(mps);
-#else
-	_Unwind_Backtrace(collect_backtrace, mps);
-#endif
 	rv = (void *)((char *)mh + sizeof (struct memhdr));
 	if (mp != NULL) {
 		mh->mh_size = sz;
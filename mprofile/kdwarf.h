@@ -0,0 +1,32 @@
+#ifndef	_KDWARF_H_
+#define	_KDWARF_H_
+
+/*
+ * Sections kdwarf_open() reads. Those which are missing have
+ * kds_data set to NULL.
+ */
+enum {
+	KD_INFO,
+	KD_ABBREV,
+	KD_LINE,
+	KD_STR,
+	KD_LINE_STR,
+	KD_RANGES,
+	KD_RNGLISTS,
+	KD_ADDR,
+	KD_STR_OFFSETS,
+	KD_NSECT
+};
+
+struct kd_sect {
+	const unsigned char	*kds_data;
+	size_t			 kds_len;
+};
+
+struct kdwarf;
+
+struct kdwarf *kdwarf_open(const struct kd_sect *);
+void kdwarf_close(struct kdwarf *);
+int kdwarf_snprintline(struct kdwarf *, char *, size_t, unsigned long);
+
+#endif
@@ -3,9 +3,15 @@
 
 struct syms;
 
+#define	KELF_LINES	0x1	/* add file:line from DWARF */
+
+struct syms *kelf_create(int);
 struct syms* kelf_open(const char *, struct syms *, unsigned long);
 void kelf_close(struct syms *);
 int kelf_snprintsym(struct syms *, char *, size_t, unsigned long,
     unsigned long);
+int kelf_snprintsyms(struct syms *, const unsigned long *, char **, size_t,
+    size_t);
+int kelf_build_id(const char *, unsigned char *, size_t);
 
 #endif
@@ -19,160 +19,608 @@
 #define _DYN_LOADER	/* needed for AuxInfo */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <elf.h>
 #include <err.h>
 #include <fcntl.h>
-#include <gelf.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+
+#include "kelf.h"
+#include "kdwarf.h"
+
+/*
+ * ELF files are read by hand, we only need section headers, symbol
+ * tables and few notes. Only native ELF class is supported.
+ */
+#if defined(__LP64__)
+#define	KELF_CLASS		ELFCLASS64
+#define	KELF(_t_)		Elf64_##_t_
+#define	KELF_ST_TYPE(_i_)	ELF64_ST_TYPE(_i_)
+#else
+#define	KELF_CLASS		ELFCLASS32
+#define	KELF(_t_)		Elf32_##_t_
+#define	KELF_ST_TYPE(_i_)	ELF32_ST_TYPE(_i_)
+#endif
+
+#define	DEBUG_DIR		"/usr/lib/debug"
 
 struct sym {
-	char *sym_name;
+	const char *sym_name;		/* points to string table in image */
 	unsigned long sym_value;	/* from st_value */
 	unsigned long sym_size;		/* from st_size */
 };
 
+/*
+ * Image is mmap()ed ELF file or buffer with decompressed .gnu_debugdata.
+ * Symbol names are not copied, they point to string tables in images,
+ * so images are kept until kelf_close().
+ */
+struct image {
+	void	*img_addr;
+	size_t	 img_len;
+	int	 img_mapped;
+};
+
+/*
+ * Each object has its own symbol table which covers addresses
+ * [symt_start, symt_end) where object is loaded. Tables are kept
+ * sorted by address, so lookup finds the object first and then
+ * searches its table only. Tables of objects loaded later are just
+ * inserted, symbols already loaded are not sorted again.
+ */
+struct symtab {
+	unsigned long symt_start;
+	unsigned long symt_end;
+	unsigned long symt_base;
+	struct sym *symt_table;
+	size_t symt_nsymb;
+	struct kdwarf *symt_dwarf;	/* with KELF_LINES only */
+};
+
 struct syms {
-	struct sym *table;
-	size_t nsymb;
+	struct symtab *tabs;
+	size_t ntabs;
+	struct image *images;
+	size_t nimages;
+	int flags;
 };
 
 int sym_compare_search(const void *, const void *);
 int sym_compare_sort(const void *, const void *);
+int symt_compare_search(const void *, const void *);
 
-struct syms *
-kelf_open(const char *filename, struct syms *syms, unsigned long base)
+static void
+free_image(void *addr, size_t len, int mapped)
 {
-	char *name;
-	Elf *elf;
-	Elf_Data *data = NULL;
-	Elf_Scn	*scn = NULL, *symtab = NULL;
-	GElf_Sym sym;
-	GElf_Shdr shdr;
-	size_t i, shstrndx, strtabndx = SIZE_MAX, symtab_size;
-	unsigned long diff;
-	struct sym *tmp;
-	int fd;
+	if (mapped)
+		munmap(addr, len);
+	else
+		free(addr);
+}
 
-	if (elf_version(EV_CURRENT) == EV_NONE)
-		errx(1, "elf_version: %s", elf_errmsg(-1));
+static void
+keep_image(struct syms *syms, void *addr, size_t len, int mapped)
+{
+	struct image *tmp;
+
+	tmp = reallocarray(syms->images, syms->nimages + 1, sizeof *tmp);
+	if (tmp == NULL)
+		err(1, NULL);
+	syms->images = tmp;
+	tmp[syms->nimages].img_addr = addr;
+	tmp[syms->nimages].img_len = len;
+	tmp[syms->nimages].img_mapped = mapped;
+	syms->nimages++;
+}
+
+static char *
+map_file(const char *filename, size_t *len, int quiet)
+{
+	struct stat st;
+	void *addr;
+	int fd;
 
 	fd = open(filename, O_RDONLY);
 	if (fd == -1) {
-		warn("open: %s", filename);
-		return syms;
+		if (!quiet)
+			warn("open: %s", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof (KELF(Ehdr))) {
+		close(fd);
+		return NULL;
 	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		warn("mmap: %s", filename);
+		return NULL;
+	}
+	*len = st.st_size;
+
+	return addr;
+}
+
+/*
+ * returns section headers of image after checking they fit to image.
+ */
+static const KELF(Shdr) *
+elf_sections(const char *img, size_t len, size_t *count)
+{
+	const KELF(Ehdr) *ehdr = (const KELF(Ehdr) *)img;
+
+	if (len < sizeof *ehdr || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr->e_ident[EI_CLASS] != KELF_CLASS ||
+	    ehdr->e_shentsize != sizeof (KELF(Shdr)) ||
+	    ehdr->e_shoff > len || ehdr->e_shnum >
+	    (len - ehdr->e_shoff) / sizeof (KELF(Shdr)) ||
+	    ehdr->e_shstrndx >= ehdr->e_shnum)
+		return NULL;
+
+	*count = ehdr->e_shnum;
+
+	return (const KELF(Shdr) *)(img + ehdr->e_shoff);
+}
+
+static int
+section_ok(const KELF(Shdr) *shdr, size_t len)
+{
+	return shdr->sh_type != SHT_NOBITS && shdr->sh_offset <= len &&
+	    shdr->sh_size <= len - shdr->sh_offset;
+}
 
-	if ((elf = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-		warnx("elf_begin: %s", elf_errmsg(-1));
-		goto bad;
+static const KELF(Shdr) *
+elf_section(const char *img, size_t len, const char *name, unsigned int type)
+{
+	const KELF(Ehdr) *ehdr = (const KELF(Ehdr) *)img;
+	const KELF(Shdr) *shdr, *shstr;
+	size_t i, count;
+
+	if ((shdr = elf_sections(img, len, &count)) == NULL)
+		return NULL;
+	shstr = &shdr[ehdr->e_shstrndx];
+	if (!section_ok(shstr, len))
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (shdr[i].sh_type != type || !section_ok(&shdr[i], len) ||
+		    shdr[i].sh_name >= shstr->sh_size)
+			continue;
+		if (strncmp(img + shstr->sh_offset + shdr[i].sh_name, name,
+		    shstr->sh_size - shdr[i].sh_name) == 0)
+			return &shdr[i];
 	}
 
-	if (elf_kind(elf) != ELF_K_ELF)
-		goto bad;
+	return NULL;
+}
 
-	if (elf_getshdrstrndx(elf, &shstrndx) != 0) {
-		warnx("elf_getshdrstrndx: %s", elf_errmsg(-1));
-		goto bad;
+/*
+ * adds STT_FUNC symbols found in symbol table section to symt,
+ * returns number of symbols added.
+ */
+static size_t
+elf_add_symbols(struct symtab *symt, const char *img, size_t len,
+    const char *name, unsigned int type, unsigned long base)
+{
+	const KELF(Shdr) *shdr, *strtab, *symtab;
+	const KELF(Sym) *sym;
+	struct sym *tmp;
+	size_t i, count, nsyms, added = 0;
+
+	symtab = elf_section(img, len, name, type);
+	if (symtab == NULL || symtab->sh_entsize != sizeof (KELF(Sym)))
+		return 0;
+	shdr = elf_sections(img, len, &count);
+	if (symtab->sh_link >= count)
+		return 0;
+	strtab = &shdr[symtab->sh_link];
+	if (strtab->sh_type != SHT_STRTAB || !section_ok(strtab, len) ||
+	    strtab->sh_size == 0 ||
+	    img[strtab->sh_offset + strtab->sh_size - 1] != '\0')
+		return 0;
+
+	nsyms = symtab->sh_size / sizeof (KELF(Sym));
+	tmp = reallocarray(symt->symt_table, symt->symt_nsymb + nsyms,
+	    sizeof *tmp);
+	if (tmp == NULL)
+		err(1, NULL);
+	symt->symt_table = tmp;
+
+	sym = (const KELF(Sym) *)(img + symtab->sh_offset);
+	for (i = 0; i < nsyms; i++) {
+		if (KELF_ST_TYPE(sym[i].st_info) != STT_FUNC ||
+		    sym[i].st_shndx == SHN_UNDEF ||
+		    sym[i].st_name >= strtab->sh_size)
+			continue;
+		tmp = &symt->symt_table[symt->symt_nsymb++];
+		tmp->sym_name = img + strtab->sh_offset + sym[i].st_name;
+		tmp->sym_value = sym[i].st_value + base;
+		tmp->sym_size = sym[i].st_size;
+		added++;
 	}
 
-	while ((scn = elf_nextscn(elf, scn)) != NULL) {
-		if (gelf_getshdr(scn, &shdr) != &shdr) {
-			warnx("elf_getshdr: %s", elf_errmsg(-1));
-			goto bad;
+	return added;
+}
+
+/*
+ * returns build-id found in .note.gnu.build-id or NULL.
+ */
+static const unsigned char *
+elf_build_id(const char *img, size_t len, size_t *id_len)
+{
+	const KELF(Shdr) *note;
+	const KELF(Nhdr) *nhdr;
+	const unsigned char *id;
+
+	note = elf_section(img, len, ".note.gnu.build-id", SHT_NOTE);
+	if (note == NULL || note->sh_size <= sizeof (KELF(Nhdr)))
+		return NULL;
+
+	nhdr = (const KELF(Nhdr) *)(img + note->sh_offset);
+	id = (const unsigned char *)(nhdr + 1) + ((nhdr->n_namesz + 3) & ~3U);
+	if (nhdr->n_type != NT_GNU_BUILD_ID || id + nhdr->n_descsz >
+	    (const unsigned char *)img + note->sh_offset + note->sh_size)
+		return NULL;
+	*id_len = nhdr->n_descsz;
+
+	return id;
+}
+
+/*
+ * Separate debug file is looked up by build-id first:
+ *	/usr/lib/debug/.build-id/ab/cdef....debug
+ * then by .gnu_debuglink:
+ *	/usr/lib/debug/path/to/dir/name.debug
+ *	/path/to/dir/.debug/name.debug
+ * Symbols are taken from its .symtab.
+ */
+static size_t
+load_debug_file(struct syms *syms, struct symtab *symt, const char *img,
+    size_t len, const char *filename, unsigned long base)
+{
+	const KELF(Shdr) *link;
+	const unsigned char *id;
+	const char *slash;
+	char path[1024], *dbg;
+	size_t i, l, dbg_len, added, id_len;
+	int n, try;
+
+	id = elf_build_id(img, len, &id_len);
+	link = elf_section(img, len, ".gnu_debuglink", SHT_PROGBITS);
+	slash = strrchr(filename, '/');
+
+	for (try = 0; try < 3; try++) {
+		n = -1;
+		if (try == 0 && id != NULL) {
+			if (id_len < 2)
+				continue;
+			n = snprintf(path, sizeof (path), "%s/.build-id/%02x/",
+			    DEBUG_DIR, id[0]);
+			for (i = 1; i < id_len && n > 0 &&
+			    (size_t)n < sizeof (path); i++)
+				n += snprintf(path + n, sizeof (path) - n,
+				    "%02x", id[i]);
+			if (n > 0 && (size_t)n < sizeof (path))
+				n += snprintf(path + n, sizeof (path) - n,
+				    ".debug");
+		} else if (try > 0 && link != NULL && slash != NULL &&
+		    memchr(img + link->sh_offset, '\0', link->sh_size) !=
+		    NULL) {
+			l = slash - filename;
+			if (try == 1)
+				n = snprintf(path, sizeof (path), "%s%.*s/%s",
+				    DEBUG_DIR, (int)l, filename,
+				    img + link->sh_offset);
+			else
+				n = snprintf(path, sizeof (path),
+				    "%.*s/.debug/%s", (int)l, filename,
+				    img + link->sh_offset);
 		}
-		if ((name = elf_strptr(elf, shstrndx, shdr.sh_name)) == NULL) {
-			warnx("elf_strptr: %s", elf_errmsg(-1));
-			goto bad;
+		if (n < 0 || (size_t)n >= sizeof (path))
+			continue;
+
+		if ((dbg = map_file(path, &dbg_len, 1)) == NULL)
+			continue;
+		added = elf_add_symbols(symt, dbg, dbg_len, ".symtab",
+		    SHT_SYMTAB, base);
+		if (added != 0) {
+			keep_image(syms, dbg, dbg_len, 1);
+			return added;
 		}
-		if (strcmp(name, ".symtab") == 0 &&
-		    shdr.sh_type == SHT_SYMTAB && shdr.sh_entsize != 0) {
-			symtab = scn;
-			symtab_size = shdr.sh_size / shdr.sh_entsize;
+		free_image(dbg, dbg_len, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * .gnu_debugdata (MiniDebugInfo) is xz compressed ELF image which
+ * holds .symtab with functions not found in .dynsym. It needs liblzma,
+ * build with -DUSE_LZMA and link with -llzma.
+ */
+static size_t
+load_debugdata(struct syms *syms, struct symtab *symt, const char *img,
+    size_t len, unsigned long base)
+{
+#ifdef USE_LZMA
+	const KELF(Shdr) *dd;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_ret ret;
+	unsigned char *buf = NULL, *tmp;
+	size_t buf_len = 0, added = 0;
+
+	dd = elf_section(img, len, ".gnu_debugdata", SHT_PROGBITS);
+	if (dd == NULL ||
+	    lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+		return 0;
+
+	strm.next_in = (const uint8_t *)img + dd->sh_offset;
+	strm.avail_in = dd->sh_size;
+	do {
+		if (strm.avail_out == 0) {
+			tmp = realloc(buf, buf_len + dd->sh_size * 4);
+			if (tmp == NULL)
+				break;
+			buf = tmp;
+			strm.next_out = buf + buf_len;
+			strm.avail_out = dd->sh_size * 4;
+			buf_len += dd->sh_size * 4;
 		}
-		if (strcmp(name, ".strtab") == 0 &&
-		    shdr.sh_type == SHT_STRTAB) {
-			strtabndx = elf_ndxscn(scn);
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+
+	if (ret == LZMA_STREAM_END)
+		added = elf_add_symbols(symt, (const char *)buf,
+		    buf_len - strm.avail_out, ".symtab", SHT_SYMTAB, base);
+	lzma_end(&strm);
+	if (added != 0)
+		keep_image(syms, buf, buf_len, 0);
+	else
+		free(buf);
+
+	return added;
+#else
+	(void)syms;
+	(void)symt;
+	(void)img;
+	(void)len;
+	(void)base;
+
+	return 0;
+#endif
+}
+
+/*
+ * Line tables are found in the same file as .symtab, which is either
+ * object itself or its debug file. We try all images of object.
+ */
+static struct kdwarf *
+load_dwarf(struct syms *syms, size_t first_image)
+{
+	static const char *names[KD_NSECT] = {
+		[KD_INFO] = ".debug_info",
+		[KD_ABBREV] = ".debug_abbrev",
+		[KD_LINE] = ".debug_line",
+		[KD_STR] = ".debug_str",
+		[KD_LINE_STR] = ".debug_line_str",
+		[KD_RANGES] = ".debug_ranges",
+		[KD_RNGLISTS] = ".debug_rnglists",
+		[KD_ADDR] = ".debug_addr",
+		[KD_STR_OFFSETS] = ".debug_str_offsets"
+	};
+	struct kd_sect sect[KD_NSECT];
+	const KELF(Shdr) *shdr;
+	struct kdwarf *kd;
+	struct image *img;
+	size_t i, j;
+
+	for (i = first_image; i < syms->nimages; i++) {
+		img = &syms->images[i];
+		if (!img->img_mapped)
+			continue;
+		for (j = 0; j < KD_NSECT; j++) {
+			shdr = elf_section(img->img_addr, img->img_len,
+			    names[j], SHT_PROGBITS);
+			/* compressed sections are not supported */
+			if (shdr == NULL || (shdr->sh_flags & SHF_COMPRESSED)) {
+				sect[j].kds_data = NULL;
+				sect[j].kds_len = 0;
+				continue;
+			}
+			sect[j].kds_data = (const unsigned char *)img->img_addr +
+			    shdr->sh_offset;
+			sect[j].kds_len = shdr->sh_size;
 		}
+		if ((kd = kdwarf_open(sect)) != NULL)
+			return kd;
 	}
-	if (symtab == NULL) {
-		warnx("%s: %s: section not found", filename, ".symtab");
-		goto bad;
+
+	return NULL;
+}
+
+/*
+ * Address range of object is given by its PT_LOAD segments. When
+ * there are none the range spans the symbols found.
+ */
+static void
+elf_range(struct symtab *symt, const char *img, size_t len,
+    unsigned long base)
+{
+	const KELF(Ehdr) *ehdr = (const KELF(Ehdr) *)img;
+	const KELF(Phdr) *phdr;
+	struct sym *last;
+	size_t i;
+
+	symt->symt_start = ~0UL;
+	symt->symt_end = 0;
+	if (ehdr->e_phentsize == sizeof (KELF(Phdr)) && ehdr->e_phoff <= len &&
+	    ehdr->e_phnum <= (len - ehdr->e_phoff) / sizeof (KELF(Phdr))) {
+		phdr = (const KELF(Phdr) *)(img + ehdr->e_phoff);
+		for (i = 0; i < ehdr->e_phnum; i++) {
+			if (phdr[i].p_type != PT_LOAD)
+				continue;
+			if (phdr[i].p_vaddr + base < symt->symt_start)
+				symt->symt_start = phdr[i].p_vaddr + base;
+			if (phdr[i].p_vaddr + phdr[i].p_memsz + base >
+			    symt->symt_end)
+				symt->symt_end = phdr[i].p_vaddr +
+				    phdr[i].p_memsz + base;
+		}
 	}
-	if (strtabndx == SIZE_MAX) {
-		warnx("%s: %s: section not found", filename, ".strtab");
-		goto bad;
+
+	if (symt->symt_start >= symt->symt_end) {
+		last = &symt->symt_table[symt->symt_nsymb - 1];
+		symt->symt_start = symt->symt_table[0].sym_value;
+		symt->symt_end = last->sym_value + last->sym_size + 1;
 	}
+}
 
-	data = elf_rawdata(symtab, data);
-	if (data == NULL) {
-		warnx("%s elf_rwadata() unable to read syms from: %s\n",
-		    __func__, filename);
-		goto bad;
+/*
+ * creates empty set of symbols, objects are added by kelf_open().
+ * With KELF_LINES kelf_snprintsyms() adds source lines found in DWARF.
+ */
+struct syms *
+kelf_create(int flags)
+{
+	struct syms *syms;
+
+	if ((syms = calloc(1, sizeof *syms)) == NULL)
+		err(1, NULL);
+	syms->flags = flags;
+
+	return syms;
+}
+
+/*
+ * Functions are taken from .symtab. When object is stripped they are
+ * taken from separate debug file, if there is none, then .dynsym and
+ * .gnu_debugdata are used.
+ */
+struct syms *
+kelf_open(const char *filename, struct syms *syms, unsigned long base)
+{
+	struct symtab symt = { 0 }, *tmp;
+	unsigned long diff;
+	char *img;
+	size_t len, i, first_image;
+
+	if (syms == NULL)
+		syms = kelf_create(0);
+	first_image = syms->nimages;
+
+	if ((img = map_file(filename, &len, 0)) == NULL)
+		return syms;
+	if (elf_sections(img, len, &i) == NULL) {
+		warnx("%s: not an ELF file", filename);
+		free_image(img, len, 1);
+		return syms;
 	}
 
-	if (syms == NULL) {
-		if ((syms = calloc(1, sizeof *syms)) == NULL)
-			err(1, NULL);
-		syms->table = calloc(symtab_size, sizeof *syms->table);
-		if (syms->table == NULL)
-			err(1, NULL);
-	} else {
-		tmp = reallocarray(syms->table, syms->nsymb + symtab_size,
-		    sizeof *syms->table);
-		if (tmp == NULL)
-			err(1, NULL);
-		syms->table = tmp;
-		symtab_size += syms->nsymb;
+	if (elf_add_symbols(&symt, img, len, ".symtab", SHT_SYMTAB, base) == 0 &&
+	    load_debug_file(syms, &symt, img, len, filename, base) == 0) {
+		elf_add_symbols(&symt, img, len, ".dynsym", SHT_DYNSYM, base);
+		load_debugdata(syms, &symt, img, len, base);
 	}
 
-	for (i = syms->nsymb; i < symtab_size; i++) {
-		if (gelf_getsym(data, i, &sym) == NULL)
-			continue;
-		if (GELF_ST_TYPE(sym.st_info) != STT_FUNC)
-			continue;
-		name = elf_strptr(elf, strtabndx, sym.st_name);
-		if (name == NULL)
-			continue;
-		syms->table[syms->nsymb].sym_name = strdup(name);
-		if (syms->table[syms->nsymb].sym_name == NULL)
-			err(1, NULL);
-		syms->table[syms->nsymb].sym_value = sym.st_value + base;
-		syms->table[syms->nsymb].sym_size = sym.st_size;
-		syms->nsymb++;
-	}
-	tmp = reallocarray(syms->table, syms->nsymb, sizeof *syms->table);
-	if (tmp == NULL)
-		err(1, NULL);
-	syms->table = tmp;
+	if (symt.symt_nsymb == 0) {
+		warnx("%s: no symbols found", filename);
+		free(symt.symt_table);
+		free_image(img, len, 1);
+		return syms;
+	}
 
 	/* Sort symbols in ascending order by address. */
-	qsort(syms->table, syms->nsymb, sizeof *syms->table, sym_compare_sort);
+	qsort(symt.symt_table, symt.symt_nsymb, sizeof *symt.symt_table,
+	    sym_compare_sort);
 
 	/*
 	 * Some functions, particularly those written in assembly, have an
 	 * st_size of zero.  We can approximate a size for these by assuming
 	 * that they extend from their st_value to that of the next function.
 	 */
-	for (i = 0; i < syms->nsymb; i++) {
-		if (syms->table[i].sym_size != 0)
+	for (i = 0; i < symt.symt_nsymb; i++) {
+		if (symt.symt_table[i].sym_size != 0)
 			continue;
 		/* Can't do anything for the last symbol. */
-		if (i + 1 == syms->nsymb)
+		if (i + 1 == symt.symt_nsymb)
 			continue;
-		diff = syms->table[i + 1].sym_value - syms->table[i].sym_value;
-		syms->table[i].sym_size = diff;
+		diff = symt.symt_table[i + 1].sym_value -
+		    symt.symt_table[i].sym_value;
+		symt.symt_table[i].sym_size = diff;
 	}
 
-bad:
-	elf_end(elf);
-	close(fd);
+	elf_range(&symt, img, len, base);
+	keep_image(syms, img, len, 1);
+	symt.symt_base = base;
+	if (syms->flags & KELF_LINES)
+		symt.symt_dwarf = load_dwarf(syms, first_image);
+
+	tmp = reallocarray(syms->tabs, syms->ntabs + 1, sizeof *tmp);
+	if (tmp == NULL)
+		err(1, NULL);
+	syms->tabs = tmp;
+	for (i = syms->ntabs; i > 0; i--) {
+		if (tmp[i - 1].symt_start < symt.symt_start)
+			break;
+		tmp[i] = tmp[i - 1];
+	}
+	tmp[i] = symt;
+	syms->ntabs++;
+
 	return syms;
 }
 
+/*
+ * copies build-id of file to id, returns its length, 0 when file has
+ * no build-id or -1 when file can not be read.
+ */
+int
+kelf_build_id(const char *filename, unsigned char *id, size_t size)
+{
+	const unsigned char *note_id;
+	char *img;
+	size_t len, id_len = 0;
+
+	if ((img = map_file(filename, &len, 1)) == NULL)
+		return -1;
+	note_id = elf_build_id(img, len, &id_len);
+	if (note_id != NULL && id_len <= size)
+		memcpy(id, note_id, id_len);
+	else
+		id_len = 0;
+	free_image(img, len, 1);
+
+	return id_len;
+}
+
+/*
+ * returns symbol which covers pc or NULL. The object is found first,
+ * then its symbol table is searched.
+ */
+static struct sym *
+kelf_lookup(struct syms *syms, unsigned long pc)
+{
+	struct symtab *symt;
+	struct sym key = { .sym_value = pc };
+
+	symt = bsearch(&pc, syms->tabs, syms->ntabs, sizeof *syms->tabs,
+	    symt_compare_search);
+	if (symt == NULL)
+		return NULL;
+
+	return bsearch(&key, symt->symt_table, symt->symt_nsymb,
+	    sizeof *symt->symt_table, sym_compare_search);
+}
+
 void
 kelf_close(struct syms *syms)
 {
@@ -181,9 +629,15 @@ kelf_close(struct syms *syms)
 	if (syms == NULL)
 		return;
 
-	for (i = 0; i < syms->nsymb; i++)
-		free(syms->table[i].sym_name);
-	free(syms->table);
+	for (i = 0; i < syms->nimages; i++)
+		free_image(syms->images[i].img_addr, syms->images[i].img_len,
+		    syms->images[i].img_mapped);
+	for (i = 0; i < syms->ntabs; i++) {
+		free(syms->tabs[i].symt_table);
+		kdwarf_close(syms->tabs[i].symt_dwarf);
+	}
+	free(syms->images);
+	free(syms->tabs);
 	free(syms);
 }
 
@@ -191,15 +645,13 @@ int
 kelf_snprintsym(struct syms *syms, char *str, size_t size, unsigned long pc,
     unsigned long off)
 {
-	struct sym key = { .sym_value = pc + off };
 	struct sym *entry;
-	GElf_Addr offset;
+	unsigned long offset;
 
 	if (syms == NULL)
 		goto fallback;
 
-	entry = bsearch(&key, syms->table, syms->nsymb, sizeof *syms->table,
-	    sym_compare_search);
+	entry = kelf_lookup(syms, pc + off);
 	if (entry == NULL)
 		goto fallback;
 
@@ -215,6 +667,87 @@ fallback:
 	return snprintf(str, size, "0x%lx", pc);
 }
 
+/*
+ * Resolves n addresses sorted in ascending order. Objects and their
+ * symbol tables are sorted too, so all addresses are resolved in single
+ * pass through the tables. names[i] gets string kelf_snprintsym() would
+ * produce for pcs[i], at most size - 1 characters long. With KELF_LINES
+ * source location is appended (see kdwarf_snprintline()). Addresses
+ * are return addresses, the line is looked up for pc - 1 so it points
+ * to the call instruction rather than to the one which follows it (it
+ * may belong to the next line or even to other inlined function).
+ * Returns -1 when there is no memory.
+ */
+int
+kelf_snprintsyms(struct syms *syms, const unsigned long *pcs, char **names,
+    size_t n, size_t size)
+{
+	struct symtab *symt = NULL;
+	struct sym *entry;
+	char *buf;
+	size_t i, j = 0, t = 0, ntabs = 0;
+	int len;
+
+	if ((buf = malloc(size)) == NULL)
+		return -1;
+
+	if (syms != NULL)
+		ntabs = syms->ntabs;
+
+	for (i = 0; i < n; i++) {
+		/* find object which may cover pc */
+		while (t < ntabs && syms->tabs[t].symt_end <= pcs[i]) {
+			t++;
+			j = 0;
+		}
+		symt = (t < ntabs) ? &syms->tabs[t] : NULL;
+		if (symt != NULL && pcs[i] < symt->symt_start)
+			symt = NULL;
+
+		/* find the last symbol which starts at or below pc */
+		entry = NULL;
+		if (symt != NULL) {
+			while (j < symt->symt_nsymb &&
+			    symt->symt_table[j].sym_value <= pcs[i])
+				j++;
+			if (j > 0)
+				entry = &symt->symt_table[j - 1];
+		}
+		/* step back over aliases, first one wins */
+		while (entry != NULL && entry != symt->symt_table &&
+		    entry[-1].sym_value == entry->sym_value)
+			entry--;
+
+		if (entry != NULL &&
+		    pcs[i] < entry->sym_value + entry->sym_size) {
+			if (pcs[i] != entry->sym_value)
+				len = snprintf(buf, size, "%s+0x%llx",
+				    entry->sym_name, (unsigned long long)
+				    (pcs[i] - entry->sym_value));
+			else
+				len = snprintf(buf, size, "%s",
+				    entry->sym_name);
+		} else
+			len = snprintf(buf, size, "0x%lx", pcs[i]);
+
+		/* source line and inlined functions of call instruction */
+		if (symt != NULL && symt->symt_dwarf != NULL && len >= 0 &&
+		    (size_t)len < size && pcs[i] > symt->symt_base)
+			kdwarf_snprintline(symt->symt_dwarf, buf + len,
+			    size - len, pcs[i] - 1 - symt->symt_base);
+
+		if ((names[i] = strdup(buf)) == NULL) {
+			while (i-- > 0)
+				free(names[i]);
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
 int
 sym_compare_sort(const void *ap, const void *bp)
 {
@@ -234,3 +767,14 @@ sym_compare_search(const void *keyp, const void *entryp)
 		return -1;
 	return key->sym_value >= entry->sym_value + entry->sym_size;
 }
+
+int
+symt_compare_search(const void *keyp, const void *entryp)
+{
+	const struct symtab *entry = entryp;
+	const unsigned long *pc = keyp;
+
+	if (*pc < entry->symt_start)
+		return -1;
+	return *pc >= entry->symt_end;
+}
@@ -16,17 +16,21 @@
 #ifndef _MPROFILE_H_
 #define	_MPROFILE_H_
 #include <stdio.h>
+#include <time.h>
 
 typedef struct mprofile_stack mprofile_stack_t;
 typedef struct mprofile_stack_set mprofile_stset_t;
 typedef struct mprofile mprofile_t;
 
 #ifdef _WITH_STACKTRACE
-mprofile_stset_t *mprofile_create_stset();
+mprofile_stset_t *mprofile_create_stset(unsigned int, unsigned int);
 void mprofile_destroy_stset(mprofile_stset_t *);
+unsigned int mprofile_get_stset_count(mprofile_stset_t *);
+unsigned int mprofile_get_stset_dropped(mprofile_stset_t *);
 mprofile_stack_t * mprofile_add_stack(mprofile_stset_t *, mprofile_stack_t *);
 mprofile_stack_t *mprofile_get_next_stack(mprofile_stset_t *,
     mprofile_stack_t *);
+mprofile_stack_t *mprofile_find_stack(mprofile_stset_t *, unsigned int);
 mprofile_stack_t *mprofile_init_stack(char *, size_t);
 mprofile_stack_t *mprofile_copy_stack(mprofile_stack_t *);
 void mprofile_walk_stack(mprofile_stack_t *,
@@ -34,10 +38,10 @@ void mprofile_walk_stack(mprofile_stack_t *,
 void mprofile_destroy_stack(mprofile_stack_t *);
 void mprofile_push_frame(mprofile_stack_t *, unsigned long long);
 unsigned int mprofile_get_stack_count(mprofile_stack_t *);
+unsigned int mprofile_get_stack_depth(mprofile_stack_t *);
 unsigned int mprofile_get_stack_id(mprofile_stack_t *);
 unsigned long long mprofile_get_thread_id(mprofile_stack_t *);
-mprofile_stack_t *mprofile_merge_stack(mprofile_stset_t *, mprofile_stset_t *,
-    unsigned int);
+void mprofile_init_stacks(void);
 #endif
 
 void mprofile_record_alloc(mprofile_t *, void *, size_t, mprofile_stack_t *);
@@ -45,11 +49,15 @@ void mprofile_record_free(mprofile_t *,void *, size_t, mprofile_stack_t *);
 void mprofile_record_realloc(mprofile_t *, void *, size_t, size_t, void *,
     mprofile_stack_t *);
 
+int mprofile_sample(mprofile_t *, size_t);
+
 mprofile_t *mprofile_create(void);
 void mprofile_destroy(mprofile_t *);
 void mprofile_add(mprofile_t *);
 void mprofile_save(FILE*, int);
-void mprofile_init(void);
+int mprofile_save_snapshot(FILE *, struct timespec *);
+int mprofile_snapshot(void);
+void mprofile_init(FILE *);
 void mprofile_done(void);
 const char *mprofile_get_annotation(void);
 #endif
@@ -18,10 +18,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
-#include <dlfcn.h>
+#include <limits.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <endian.h>
 #include <sys/atomic.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 #include "utils/queue.h"
 #include "utils/tree.h"
@@ -42,133 +52,469 @@ enum {
 #define	MPROFILE_REC_STATE	"\"state\""
 #define	MPROFILE_REC_STACK_ID	"\"stack_id\""
 #define	MPROFILE_REC_NEXT_ID	"\"next_id\""
+#define	MPROFILE_REC_WEIGHT	"\"weight\""
 #define	MPROFILE_REC_PREV_ID	"\"prev_id\""
 #define	MPROFILE_TIMESTAMP	"\"time\""
 #define	MPROFILE_TIME_S		"\"s\""
 #define	MPROFILE_TIME_NS	"\"ns\""
+/*
+ * Record is 32 bytes, it keeps only what is needed for every operation.
+ * Less common data live in aux slot which follows the record in chunk
+ * when mpr_aux is set. Aux slot is used when:
+ *	- record comes from realloc(), it keeps old address
+ *	- delta does not fit to mpr_delta
+ *	- weight differs from default, which is 1 for record with stack
+ *	  and 0 for record without stack (see mprofile_sample())
+ * Aux slot then holds delta and weight too. Use record_realloc(),
+ * record_delta() and record_weight() to read them.
+ *
+ * Links between records in allocation chain are not kept in records,
+ * those are built to side array at exit when chains are requested
+ * (see build_chains()).
+ */
 struct mprofile_record {
-	uint64_t			 mpr_id;
-	void				*mpr_mem;
-	void				*mpr_realloc;
-					    /* returned by realloc() */
-	ssize_t				 mpr_delta;
-	char				 mpr_state;
-	unsigned int			 mpr_stack_id;
-	uint64_t			 mpr_prev_id;
-	uint64_t			 mpr_next_id;
-	struct timespec			 mpr_ts;
-	TAILQ_ENTRY(mprofile_record)	 mpr_tqe;
-	/*
-	 * note: mpr_rbe is dual purposed. The first we use it
-	 * is to sort records by mpr_id when we merge per-thread
-	 * instances. On its second use we use it for construction
-	 * of allocation chains. Those two processing never happens
-	 * simultaneously, therefore we can have just one mpr_rbe.
-	 */
-	RB_ENTRY(mprofile_record)	 mpr_rbe;
+	uint64_t	 mpr_id;
+	void		*mpr_mem;
+	uint64_t	 mpr_ticks;	/* see get_ticks */
+	int32_t		 mpr_delta;
+	unsigned int	 mpr_state:2;
+	unsigned int	 mpr_aux:1;
+	unsigned int	 mpr_stack_id:29;
+};
+
+/* stack ids must fit to mpr_stack_id */
+#define	MPR_STACK_ID_MAX	((1U << 29) - 1)
+
+struct mprofile_aux {
+	void		*mpa_realloc;	/* returned by realloc() */
+	int64_t		 mpa_delta;
+	unsigned int	 mpa_weight;
+	unsigned int	 mpa_pad;
+	uint64_t	 mpa_pad2;
+};
+
+union mprofile_slot {
+	struct mprofile_record	mps_rec;
+	struct mprofile_aux	mps_aux;
+};
+
+#define	MPR_AUX(_mpr_)		(&((union mprofile_slot *)(_mpr_) + 1)->mps_aux)
+#define	MPR_SLOTS(_mpr_)	(1 + (_mpr_)->mpr_aux)
+
+/*
+ * prev/next ids of record in allocation chain, see build_chains()
+ */
+struct chain_link {
+	uint64_t	cl_prev_id;
+	uint64_t	cl_next_id;
+};
+
+/*
+ * Records are not allocated one by one. Each thread owns a list of
+ * chunks, record is taken from the last chunk by bumping mpc_used.
+ * New chunk is allocated when the last one has no room for record
+ * and its aux slot. Chunks are released all at once when profile is
+ * destroyed.
+ *
+ * mpc_published is the number of records which are completely written,
+ * it is updated with release semantics, so snapshot can read records
+ * while thread keeps adding new ones. mp_mtx protects mp_chunks list
+ * against snapshot, it is taken only when thread adds a new chunk
+ * (and removes full chunk handed to stream writer).
+ */
+#define	MPR_CHUNK_RECORDS	1024
+struct mprofile_chunk {
+	TAILQ_ENTRY(mprofile_chunk)	 mpc_tqe;
+	struct mprofile_chunk		*mpc_next;	/* stream queue */
+	unsigned int			 mpc_used;
+	unsigned int			 mpc_published;
+	union mprofile_slot		 mpc_slots[MPR_CHUNK_RECORDS];
 };
 
 struct mprofile {
-	TAILQ_HEAD(mp_list, mprofile_record)	 mp_tqhead;
-	mprofile_stset_t			*mp_stset;
+	TAILQ_HEAD(mp_chunks, mprofile_chunk)	 mp_chunks;
+	unsigned int				 mp_chunk_count;
+	uint64_t				 mp_record_count;
+	unsigned int				 mp_index;
+	int64_t					 mp_sample_bytes;
+	uint64_t				 mp_rand;
+	unsigned int				 mp_weight;
+	pthread_mutex_t				 mp_mtx;
 	TAILQ_ENTRY(mprofile)			 mp_tqe;
 };
 
+/*
+ * Loaded objects are found by dl_iterate_phdr(), see find_shlibs().
+ * Table is sorted by shl_start. [shl_start, shl_end) covers all PT_LOAD
+ * segments of object. Symbols are loaded only for objects some frame
+ * falls to (see load_shlibs()). Objects are also looked up before
+ * dlclose(), so frames in objects which are gone can be resolved too.
+ * Such objects are kept in table, shl_gone is set to the find_shlibs()
+ * pass which did not see them. Entry is found by address range and
+ * build-id, path is resolved only for objects which are new or which
+ * come back after dlclose(), dlopen() may put another object to the
+ * same addresses. See shlib_usable() for how overlapping entries are
+ * resolved. Entries which are gone and not usable are dropped, at most
+ * SHL_GONE_MAX gone entries are kept, the oldest ones go first. Frames
+ * in objects which were dropped are printed as addresses. shlib_mtx
+ * protects the table against threads calling dlclose().
+ */
+#define	SHL_BUILD_ID_MAX	32
+#define	SHL_GONE_MAX		256
+
 struct shlib {
 	char		*shl_name;
-	unsigned long	 shl_base;
+	unsigned long	 shl_base;	/* dlpi_addr */
+	unsigned long	 shl_start;
+	unsigned long	 shl_end;
+	int		 shl_loaded;
+	unsigned int	 shl_seen;	/* last pass which found object */
+	unsigned int	 shl_gone;	/* pass which did not, 0 if loaded */
+	unsigned int	 shl_build_id_len;
+	unsigned char	 shl_build_id[SHL_BUILD_ID_MAX];
 };
 
-#define	MAX_SHLIBS	32
-static struct shlib shlibs[MAX_SHLIBS];
+static struct shlib *shlibs = NULL;
+static unsigned int shlib_count = 0;
+static unsigned int shlib_size = 0;
+static unsigned int shlib_sorted = 0;	/* entries sorted by shl_start */
+static unsigned int shlib_pass = 0;
+static pthread_mutex_t shlib_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* we keep symbols global */
 #ifdef	_WITH_STACKTRACE
 static struct syms *syms = NULL;
+
+/*
+ * MPROFILE_LINES adds source file:line and inlined functions found
+ * in DWARF to frame names, see dwarf.c.
+ */
+static int sym_lines = 0;
+
+/*
+ * MPROFILE_SYMBOLIZE=offline leaves symbols alone. Frames are written
+ * as addresses together with table of loaded objects ("modules"),
+ * mprofile-symbolize resolves them later.
+ */
+static int sym_offline = 0;
+
+/*
+ * Stack set is shared by all threads, see stack.c. It grows, number
+ * of slots it starts with can be changed by MPROFILE_STACK_SLOTS.
+ */
+#define	MP_STACK_SLOTS		65536
+static mprofile_stset_t *stset = NULL;
+
+static int shlib_usable(unsigned int);
+static void load_shlibs(unsigned long *, size_t);
+static void print_modules(FILE *);
 #endif
 
 static uint64_t mpr_id = 0;
 
-static struct timespec start_time_tv;
+static int bin_format = 0;
 
-static pthread_mutex_t mtx;
+static uint64_t merge_usec = 0;
 
-static TAILQ_HEAD(profiles, mprofile)	profiles;
+static uint64_t chains_usec = 0;
+
+static uint64_t record_count = 0;
+
+/*
+ * Records of all threads sorted by id, built by mprofile_save().
+ * chain_links are indexed the same way, those are present only
+ * when chains are requested.
+ */
+static struct mprofile_record **merged_records = NULL;
+static struct chain_link *chain_links = NULL;
+static unsigned int merged_chunks = 0;
+
+/*
+ * Allocation chains are built using hash table keyed by address by
+ * default. MPROFILE_CHAINS=tree selects the RB-tree which is kept
+ * for comparison.
+ */
+static int chains_tree = 0;
+
+/*
+ * Stack sampling, set by MPROFILE_SAMPLE_BYTES or MPROFILE_SAMPLE_RATE,
+ * see mprofile_sample().
+ */
+static uint64_t sample_bytes = 0;
+static uint64_t sample_rate = 0;
+
+/*
+ * Streaming mode (MPROFILE_STREAM_CHUNKS=n) does not keep records
+ * until exit. Thread hands its full chunk over to stream_head
+ * queue and takes a new one. Writer thread appends queued chunks
+ * to output file and frees them. Thread waits when there are more
+ * than stream_limit chunks queued, so the memory taken by records
+ * is bounded by (number of threads + stream_limit) chunks.
+ *
+ * Records are not sorted in streaming mode and allocation chains
+ * are not built.
+ */
+static unsigned int stream_limit = 0;
+static unsigned int stream_queued = 0;
+static int stream_stop = 0;
+static struct mprofile_chunk *stream_head = NULL;
+static pthread_t stream_thread;
+static FILE *stream_file = NULL;
+static unsigned int profile_count = 0;
+
+static struct timespec start_time_tv;
 
-static mprofile_t *master = NULL;
+/*
+ * Records keep raw ticks of clock selected by MPROFILE_CLOCK:
+ *	mono	CLOCK_MONOTONIC (default)
+ *	coarse	CLOCK_MONOTONIC_COARSE, cheaper but resolution is in ms
+ *	tsc	rdtsc (x86 with invariant TSC only), calibrated against
+ *		CLOCK_MONOTONIC in mprofile_init()
+ * Ticks are converted to wall clock time when records are saved.
+ * start_ticks is the tick count taken together with start_time_tv.
+ */
+static uint64_t ticks_mono(void);
+static uint64_t (*get_ticks)(void) = ticks_mono;
+static uint64_t start_ticks;
+static double tick_ns = 1.0;
 
-RB_HEAD(mprofile_record_sort, mprofile_record);
+static pthread_mutex_t mtx;
 
-RB_HEAD(mprofile_record_mem, mprofile_record);
+/*
+ * snapshot must not run while records are merged at exit
+ */
+static pthread_mutex_t snap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int saved = 0;
 
-static int record_id_compare(struct mprofile_record *,
-    struct mprofile_record *);
+static TAILQ_HEAD(profiles, mprofile)	profiles;
 
-static int record_mem_compare(struct mprofile_record *,
-    struct mprofile_record *);
+/*
+ * Node of RB-tree used by build_chains_tree(), nodes are allocated
+ * in array at exit, one for each record.
+ */
+struct chain_node {
+	RB_ENTRY(chain_node)	 cn_rbe;
+	void			*cn_mem;
+	uint64_t		 cn_idx;
+};
 
-static struct mprofile_record_sort sorter;
+RB_HEAD(chain_tree, chain_node);
 
-RB_GENERATE_STATIC(mprofile_record_sort, mprofile_record, mpr_rbe,
-    record_id_compare);
+static int chain_node_compare(struct chain_node *, struct chain_node *);
 
-RB_GENERATE_STATIC(mprofile_record_mem, mprofile_record, mpr_rbe,
-    record_mem_compare);
+RB_GENERATE_STATIC(chain_tree, chain_node, cn_rbe, chain_node_compare);
 
 
 static int 
-record_id_compare(struct mprofile_record *a_mpr, struct mprofile_record *b_mpr)
+chain_node_compare(struct chain_node *a_cn, struct chain_node *b_cn)
 {
-	if (a_mpr->mpr_id < b_mpr->mpr_id)
+	if (a_cn->cn_mem < b_cn->cn_mem)
 		return (-1);
-	else if (a_mpr->mpr_id > b_mpr->mpr_id)
+	else if (a_cn->cn_mem > b_cn->cn_mem)
 		return (1);
 	else
 		return (0);
 }
 
-static int 
-record_mem_compare(struct mprofile_record *a_mpr, struct mprofile_record *b_mpr)
+static void *
+record_realloc(struct mprofile_record *mpr)
 {
-	if (a_mpr->mpr_mem < b_mpr->mpr_mem)
-		return (-1);
-	else if (a_mpr->mpr_mem > b_mpr->mpr_mem)
-		return (1);
-	else
-		return (0);
+	return ((mpr->mpr_aux) ? MPR_AUX(mpr)->mpa_realloc : NULL);
 }
 
-static int 
-record_addr_compare(struct mprofile_record *a_mpr, struct mprofile_record *b_mpr)
+static int64_t
+record_delta(struct mprofile_record *mpr)
 {
-	if (a_mpr->mpr_id < b_mpr->mpr_id)
-		return (-1);
-	else if (a_mpr->mpr_id > b_mpr->mpr_id)
-		return (1);
-	else
-		return (0);
+	return ((mpr->mpr_aux) ? MPR_AUX(mpr)->mpa_delta : mpr->mpr_delta);
+}
+
+static unsigned int
+record_weight(struct mprofile_record *mpr)
+{
+	if (mpr->mpr_aux)
+		return (MPR_AUX(mpr)->mpa_weight);
+
+	return ((mpr->mpr_stack_id != 0) ? 1 : 0);
+}
+
+/*
+ * Lock-free queue, threads push chunks at head using CAS, writer
+ * takes the whole list at once.
+ */
+static void
+stream_push(struct mprofile_chunk *mpc)
+{
+	struct mprofile_chunk *head;
+	struct timespec ts = { 0, 1000000 };
+
+	head = __atomic_load_n(&stream_head, __ATOMIC_ACQUIRE);
+	do {
+		mpc->mpc_next = head;
+	} while (__atomic_compare_exchange_n(&stream_head, &head, mpc,
+	    0 /* want strong */, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) == 0);
+
+	/* wait for writer to catch up */
+	if (__atomic_add_fetch(&stream_queued, 1, __ATOMIC_ACQ_REL) >
+	    stream_limit) {
+		while (__atomic_load_n(&stream_queued, __ATOMIC_ACQUIRE) >
+		    stream_limit &&
+		    __atomic_load_n(&stream_stop, __ATOMIC_ACQUIRE) == 0)
+			nanosleep(&ts, NULL);
+	}
 }
 
+/*
+ * chunk comes from calloc() so records are zeroed already, there
+ * is no need to memset() them one by one.
+ */
 static struct mprofile_record *
-create_mprofile_record(void)
+create_mprofile_record(mprofile_t *mp, unsigned int slots)
 {
 	struct mprofile_record *mpr;
+	struct mprofile_chunk *mpc, *full;
+
+	mpc = TAILQ_LAST(&mp->mp_chunks, mp_chunks);
+	if (mpc == NULL || mpc->mpc_used + slots > MPR_CHUNK_RECORDS) {
+		full = mpc;
+		mpc = (struct mprofile_chunk *)calloc(1,
+		    sizeof (struct mprofile_chunk));
+		if (mpc == NULL)
+			return (NULL);
+		pthread_mutex_lock(&mp->mp_mtx);
+		if (full != NULL && stream_limit != 0)
+			TAILQ_REMOVE(&mp->mp_chunks, full, mpc_tqe);
+		else
+			full = NULL;
+		TAILQ_INSERT_TAIL(&mp->mp_chunks, mpc, mpc_tqe);
+		pthread_mutex_unlock(&mp->mp_mtx);
+		mp->mp_chunk_count++;
+		if (full != NULL)
+			stream_push(full);
+	}
 
-	mpr = (struct mprofile_record *)malloc(
-	    sizeof (struct mprofile_record));
-	if (mpr == NULL)
-		return (NULL);
-	memset(mpr, 0, sizeof (struct mprofile_record));
+	mpr = &mpc->mpc_slots[mpc->mpc_used].mps_rec;
+	mpc->mpc_used += slots;
+	mp->mp_record_count++;
 
-	clock_gettime(CLOCK_REALTIME, &mpr->mpr_ts);
+	mpr->mpr_ticks = get_ticks();
 
 	return (mpr);
 }
 
+/*
+ * makes the last record created by thread visible to snapshot
+ */
+static void
+publish_mprofile_record(mprofile_t *mp)
+{
+	struct mprofile_chunk *mpc;
+
+	mpc = TAILQ_LAST(&mp->mp_chunks, mp_chunks);
+	__atomic_store_n(&mpc->mpc_published, mpc->mpc_used,
+	    __ATOMIC_RELEASE);
+}
+
+static uint64_t
+ticks_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#ifdef CLOCK_MONOTONIC_COARSE
+static uint64_t
+ticks_coarse(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t
+ticks_tsc(void)
+{
+	return (__rdtsc());
+}
+
+/*
+ * TSC is usable only when it ticks at constant rate regardless
+ * of CPU frequency and sleep states (invariant TSC).
+ */
+static int
+calibrate_tsc(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	struct timespec ts = { 0, 10000000 };
+	uint64_t ns, tsc;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & (1 << 8)) == 0)
+		return (-1);
+
+	ns = ticks_mono();
+	tsc = __rdtsc();
+	nanosleep(&ts, NULL);
+	ns = ticks_mono() - ns;
+	tsc = __rdtsc() - tsc;
+	if (tsc == 0)
+		return (-1);
+
+	tick_ns = (double)ns / (double)tsc;
+	get_ticks = ticks_tsc;
+
+	return (0);
+}
+#endif
+
+static void
+init_clock(const char *clock)
+{
+	if (clock == NULL || strcmp(clock, "mono") == 0) {
+		get_ticks = ticks_mono;
+#ifdef CLOCK_MONOTONIC_COARSE
+	} else if (strcmp(clock, "coarse") == 0) {
+		get_ticks = ticks_coarse;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	} else if (strcmp(clock, "tsc") == 0) {
+		if (calibrate_tsc() != 0)
+			fprintf(stderr, "%s no invariant TSC, using "
+			    "CLOCK_MONOTONIC\n", __func__);
+#endif
+	} else {
+		fprintf(stderr, "%s unknown clock %s, using "
+		    "CLOCK_MONOTONIC\n", __func__, clock);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &start_time_tv);
+	start_ticks = get_ticks();
+}
+
+/*
+ * converts ticks to ns since epoch
+ */
+static uint64_t
+ticks_to_ns(uint64_t ticks)
+{
+	int64_t d = (int64_t)(ticks - start_ticks);
+
+	return ((uint64_t)start_time_tv.tv_sec * 1000000000ULL +
+	    start_time_tv.tv_nsec + (int64_t)((double)d * tick_ns));
+}
+
 static void
-print_mprofile_record(FILE *f, struct mprofile_record *mpr)
+print_mprofile_record(FILE *f, struct mprofile_record *mpr,
+    struct chain_link *cl)
 {
 	const char *state;
+	uint64_t ns = ticks_to_ns(mpr->mpr_ticks);
 
 	switch (mpr->mpr_state) {
 	case ALLOC:
@@ -188,51 +534,271 @@ print_mprofile_record(FILE *f, struct mprofile_record *mpr)
 	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_MEM,
 	    (unsigned long long)mpr->mpr_mem);
 	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_REALLOC,
-	    (unsigned long long)mpr->mpr_realloc);
-	fprintf(f, "\t\t%s : %zd,\n", MPROFILE_REC_DELTA, mpr->mpr_delta);
+	    (unsigned long long)record_realloc(mpr));
+	fprintf(f, "\t\t%s : %lld,\n", MPROFILE_REC_DELTA,
+	    (long long)record_delta(mpr));
 	fprintf(f, "\t\t%s : %s,\n", MPROFILE_REC_STATE, state);
-	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_NEXT_ID, mpr->mpr_next_id);
-	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_PREV_ID, mpr->mpr_prev_id);
+	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_NEXT_ID,
+	    (cl != NULL) ? (unsigned long long)cl->cl_next_id : 0ULL);
+	fprintf(f, "\t\t%s : %llu,\n", MPROFILE_REC_PREV_ID,
+	    (cl != NULL) ? (unsigned long long)cl->cl_prev_id : 0ULL);
 	fprintf(f, "\t\t%s : %u,\n", MPROFILE_REC_STACK_ID,
-	    mpr->mpr_stack_id);
+	    (unsigned int)mpr->mpr_stack_id);
+	fprintf(f, "\t\t%s : %u,\n", MPROFILE_REC_WEIGHT, record_weight(mpr));
 	fprintf(f, "\t\t%s : {\n", MPROFILE_TIMESTAMP);
 	fprintf(f, "\t\t\t%s : %lld,\n", MPROFILE_TIME_S,
-	    (long long)mpr->mpr_ts.tv_sec);
+	    (long long)(ns / 1000000000ULL));
 	fprintf(f, "\t\t\t%s : %lu\n", MPROFILE_TIME_NS,
-	    mpr->mpr_ts.tv_nsec);
+	    (unsigned long)(ns % 1000000000ULL));
 	fprintf(f, "\t\t}\n");
 }
 
+/*
+ * xorshift64* gives us uniformly distributed number from (0, 1).
+ */
+static double
+sample_rand(mprofile_t *mp)
+{
+	uint64_t x = mp->mp_rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	mp->mp_rand = x;
+	x *= 0x2545f4914f6cdd1dULL;
+
+	return (((x >> 11) + 0.5) / 9007199254740992.0);
+}
+
+/*
+ * Distance to the next sample is drawn from exponential distribution,
+ * so sampled allocations form a Poisson process. The same is done by
+ * tcmalloc. In rate mode the distance is counted in allocations, in
+ * bytes mode the distance is counted in bytes.
+ */
+static int64_t
+sample_next(mprofile_t *mp)
+{
+	uint64_t mean;
+
+	if (sample_bytes != 0)
+		mean = sample_bytes;
+	else if (sample_rate != 0)
+		mean = sample_rate;
+	else
+		return (0);
+
+	return ((int64_t)(-log(sample_rand(mp)) * (double)mean) + 1);
+}
+
+/*
+ * Tells if stack should be collected for operation which allocates sz
+ * bytes. It returns 0 when stack should not be collected, otherwise it
+ * returns 1. Frees (sz == 0) are not sampled when sampling is enabled.
+ *
+ * The weight of sampled operation is kept in mp and it is recorded with
+ * the next operation which comes with stack. The weight is the expected
+ * number of operations the sample stands for. In rate mode it is just
+ * the rate. In bytes mode allocation of sz bytes gets sampled with
+ * probability p = 1 - exp(-sz/sample_bytes), so weight is 1/p.
+ */
+int
+mprofile_sample(mprofile_t *mp, size_t sz)
+{
+	double p;
+
+	if (mp == NULL)
+		return (0);
+
+	if (sample_bytes == 0 && sample_rate == 0)
+		return (1);
+
+	if (sz == 0)
+		return (0);
+
+	if (sample_bytes != 0)
+		mp->mp_sample_bytes -= (int64_t)sz;
+	else
+		mp->mp_sample_bytes--;
+
+	if (mp->mp_sample_bytes > 0)
+		return (0);
+
+	mp->mp_sample_bytes = sample_next(mp);
+	if (sample_bytes != 0) {
+		p = 1.0 - exp(-(double)sz / (double)sample_bytes);
+		mp->mp_weight = (p > 0) ? (unsigned int)(1.0 / p + 0.5) : 1;
+	} else {
+		mp->mp_weight = sample_rate;
+	}
+	if (mp->mp_weight == 0)
+		mp->mp_weight = 1;
+
+	return (1);
+}
+
 mprofile_t *
 mprofile_create(void)
 {
 	mprofile_t *mp;
 
-	if (start_time_tv.tv_sec == 0)
-		clock_gettime(CLOCK_REALTIME, &start_time_tv);
-
 	mp = (mprofile_t *) malloc(sizeof (mprofile_t));
 	if (mp == NULL)
 		return (NULL);
 
-	TAILQ_INIT(&mp->mp_tqhead);
-
-#ifdef _WITH_STACKTRACE
-	mp->mp_stset = mprofile_create_stset();
-#endif
+	TAILQ_INIT(&mp->mp_chunks);
+	mp->mp_chunk_count = 0;
+	mp->mp_record_count = 0;
+	mp->mp_weight = 1;
+	mp->mp_rand = (uint64_t)(uintptr_t)mp ^
+	    (uint64_t)start_time_tv.tv_nsec;
+	if (mp->mp_rand == 0)
+		mp->mp_rand = 1;
+	mp->mp_sample_bytes = sample_next(mp);
+	pthread_mutex_init(&mp->mp_mtx, NULL);
 
 	return (mp);
 }
 
 #ifdef _WITH_STACKTRACE
+/*
+ * The same return address repeats in many stacks. So before stacks are
+ * written, unique frame addresses are collected, sorted and resolved
+ * in single pass through symbol table (kelf_snprintsyms()). Writers
+ * then look names up in sym_pcs/sym_names. Address which is not found
+ * in cache (stack added after cache was built) is resolved directly.
+ */
+#define	SYM_NAME_LEN	90
+#define	SYM_LINE_LEN	512	/* with MPROFILE_LINES */
+
+static unsigned long *sym_pcs = NULL;
+static char **sym_names = NULL;
+static size_t sym_count = 0;
+
+struct sym_collect {
+	unsigned long	*sc_pcs;
+	size_t		 sc_count;
+	size_t		 sc_size;
+};
+
+static void
+sym_cache_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < sym_count; i++)
+		free(sym_names[i]);
+	free(sym_names);
+	free(sym_pcs);
+	sym_names = NULL;
+	sym_pcs = NULL;
+	sym_count = 0;
+}
+
+static void
+collect_frame(unsigned long long frame, void *arg)
+{
+	struct sym_collect *sc = (struct sym_collect *)arg;
+	unsigned long *tmp;
+
+	if (sc->sc_pcs == NULL)
+		return;
+
+	if (sc->sc_count == sc->sc_size) {
+		sc->sc_size = (sc->sc_size == 0) ? 1024 : sc->sc_size * 2;
+		tmp = (unsigned long *)realloc(sc->sc_pcs,
+		    sizeof (unsigned long) * sc->sc_size);
+		if (tmp == NULL) {
+			free(sc->sc_pcs);
+			sc->sc_pcs = NULL;
+			return;
+		}
+		sc->sc_pcs = tmp;
+	}
+	sc->sc_pcs[sc->sc_count++] = (unsigned long)frame;
+}
+
+static int
+pc_compare(const void *a, const void *b)
+{
+	unsigned long a_pc = *(const unsigned long *)a;
+	unsigned long b_pc = *(const unsigned long *)b;
+
+	return ((a_pc < b_pc) ? -1 : (a_pc > b_pc));
+}
+
+/*
+ * builds cache for all stacks found in stack set. Cache stays empty
+ * if we run out of memory, names are resolved one by one then.
+ */
+static void
+sym_cache_build(void)
+{
+	struct sym_collect sc;
+	mprofile_stack_t *stack;
+	size_t i, n = 0;
+
+	sym_cache_free();
+
+	sc.sc_size = 1024;
+	sc.sc_count = 0;
+	sc.sc_pcs = (unsigned long *)malloc(sizeof (unsigned long) *
+	    sc.sc_size);
+	stack = mprofile_get_next_stack(stset, NULL);
+	while (stack != NULL && sc.sc_pcs != NULL) {
+		mprofile_walk_stack(stack, collect_frame, &sc);
+		stack = mprofile_get_next_stack(stset, stack);
+	}
+	if (sc.sc_pcs == NULL)
+		return;
+
+	qsort(sc.sc_pcs, sc.sc_count, sizeof (unsigned long), pc_compare);
+	for (i = 0; i < sc.sc_count; i++) {
+		if (n == 0 || sc.sc_pcs[n - 1] != sc.sc_pcs[i])
+			sc.sc_pcs[n++] = sc.sc_pcs[i];
+	}
+	load_shlibs(sc.sc_pcs, n);
+
+	sym_names = (char **)malloc(sizeof (char *) * (n + 1));
+	if (sym_names == NULL ||
+	    kelf_snprintsyms(syms, sc.sc_pcs, sym_names, n,
+	    sym_lines ? SYM_LINE_LEN : SYM_NAME_LEN) != 0) {
+		free(sym_names);
+		sym_names = NULL;
+		free(sc.sc_pcs);
+		return;
+	}
+	sym_pcs = sc.sc_pcs;
+	sym_count = n;
+}
+
+/*
+ * returns name of frame, buf is used when frame is not found in cache.
+ */
+static const char *
+sym_lookup(unsigned long long frame, char *buf, size_t len)
+{
+	unsigned long pc = (unsigned long)frame;
+	unsigned long *found;
+
+	if (sym_count != 0) {
+		found = (unsigned long *)bsearch(&pc, sym_pcs, sym_count,
+		    sizeof (unsigned long), pc_compare);
+		if (found != NULL)
+			return (sym_names[found - sym_pcs]);
+	}
+	kelf_snprintsym(syms, buf, len, frame, 0);
+
+	return (buf);
+}
+
 static void
 print_trace(unsigned long long frame, void *f_arg)
 {
 	FILE *f = (FILE *)f_arg;
-	char buf[90];
+	char buf[SYM_NAME_LEN];
 
-	kelf_snprintsym(syms, buf, sizeof (buf), frame, 0);
-	fprintf(f, "\"%s\", ", buf);
+	fprintf(f, "\"%s\", ", sym_lookup(frame, buf, sizeof (buf)));
 }
 
 static void
@@ -252,12 +818,12 @@ print_stack(FILE *f, mprofile_stack_t *stack)
 #endif
 
 static void
-profile_save(FILE *f, mprofile_t *mp)
+profile_save(FILE *f)
 {
 #ifdef	_WITH_STACKTRACE
 	mprofile_stack_t *stack;
 #endif
-	struct mprofile_record *mpr;
+	uint64_t i;
 	int first = 1;
 
 	if (f == NULL)
@@ -269,13 +835,26 @@ profile_save(FILE *f, mprofile_t *mp)
 	fprintf(f, "\t%s : %lu\n", MPROFILE_TIME_NS, start_time_tv.tv_nsec);
 	fprintf(f, "  },\n");
 	fprintf(f, "\t\"annotation\" : \"%s\",\n", mprofile_get_annotation());
+	fprintf(f, "\t\"chunks\" : %u,\n", merged_chunks);
+	fprintf(f, "\t\"chunk_records\" : %u,\n", MPR_CHUNK_RECORDS);
+	fprintf(f, "\t\"merge_usec\" : %llu,\n",
+	    (unsigned long long)merge_usec);
+	fprintf(f, "\t\"chains_usec\" : %llu,\n",
+	    (unsigned long long)chains_usec);
+#ifdef _WITH_STACKTRACE
+	fprintf(f, "\t\"stacks_dropped\" : %u,\n",
+	    mprofile_get_stset_dropped(stset));
+	if (sym_offline)
+		print_modules(f);
+#endif
 	fprintf(f, "  \"allocations\" : [\n");
-	TAILQ_FOREACH(mpr, &mp->mp_tqhead, mpr_tqe) {
+	for (i = 0; i < record_count; i++) {
 		if (first == 0)
 			fprintf(f, "\t},\n");
 		else
 			first = 0;
-		print_mprofile_record(f, mpr);
+		print_mprofile_record(f, merged_records[i],
+		    (chain_links != NULL) ? &chain_links[i] : NULL);
 	}
 	if (first == 0)
 		fprintf(f, "\t}\n");
@@ -283,10 +862,10 @@ profile_save(FILE *f, mprofile_t *mp)
 
 #ifdef _WITH_STACKTRACE
 	fprintf(f, " \"stacks\" : [\n");
-	stack = mprofile_get_next_stack(mp->mp_stset, NULL);
+	stack = mprofile_get_next_stack(stset, NULL);
 	while (stack != NULL) {
 		print_stack(f, stack);
-		stack = mprofile_get_next_stack(mp->mp_stset, stack);
+		stack = mprofile_get_next_stack(stset, stack);
 		if (stack != NULL)
 			fprintf(f, ",\n");
 	}
@@ -297,232 +876,960 @@ profile_save(FILE *f, mprofile_t *mp)
 #endif
 }
 
-void
-mprofile_destroy(mprofile_t *mp)
+/*
+ * Binary trace format, selected by MPROFILE_FORMAT=bin. All numbers
+ * are little-endian. The file starts with header:
+ *	char	magic[4]	"MPRB"
+ *	u32	version
+ *	u32	record size
+ *	u32	flags		(MPB_F_* below)
+ *	i64	start time seconds
+ *	u32	start time nanoseconds
+ *	u32	number of chunks used
+ *	u32	records per chunk
+ *	u32	reserved
+ * Header is followed by sections. Each section starts with u32 type
+ * and u32 count:
+ *	MPB_ANNOTATION	count is length of annotation string which follows
+ *	MPB_RECORDS	count records follow, each record is MPB_RECORD_SZ
+ *			bytes long. There can be any number of MPB_RECORDS
+ *			sections, writer emits one section per batch.
+ *	MPB_STACKS	count stacks follow. Stack is u32 id, u32 stack_count,
+ *			u64 thread_id, u32 depth followed by depth frames.
+ *			Frame is u16 length followed by symbol name.
+ *	MPB_MERGE_TIME	count is time in microseconds it took to merge
+ *			records from all threads. No data follow.
+ *	MPB_CHAINS_TIME	count is time in microseconds it took to build
+ *			allocation chains. No data follow.
+ *	MPB_MODULES	count objects loaded to process follow, written
+ *			with MPROFILE_SYMBOLIZE=offline only. Object is
+ *			u64 base, u64 start, u64 end, u16 build-id length,
+ *			build-id, u16 path length, path.
+ *	MPB_STACKS_DROPPED count is number of stacks which did not fit
+ *			to stack set. No data follow.
+ *	MPB_END		count is 0, this is the last section in file.
+ * Records come sorted by id unless MPB_F_UNSORTED flag is set.
+ * Record is:
+ *	u64 id, u64 addr, u64 realloc, i64 delta_sz, u64 next_id,
+ *	u64 prev_id, u64 time (nanoseconds), u32 stack_id, u8 state,
+ *	u8 pad[3], u32 weight, u32 pad
+ * scripts/mprofile_bin.py converts binary trace to .json.
+ */
+#define	MPB_MAGIC		"MPRB"
+#define	MPB_VERSION		2
+#define	MPB_HDR_SZ		40
+#define	MPB_RECORD_SZ		72
+#define	MPB_BATCH		256
+
+#define	MPB_F_CHAINS		1
+#define	MPB_F_STACKS		2
+#define	MPB_F_UNSORTED		4	/* streaming mode */
+
+enum {
+	MPB_END = 0,
+	MPB_ANNOTATION = 1,
+	MPB_RECORDS = 2,
+	MPB_STACKS = 3,
+	MPB_MERGE_TIME = 4,
+	MPB_CHAINS_TIME = 5,
+	MPB_MODULES = 6,
+	MPB_STACKS_DROPPED = 7
+};
+
+struct mpb_writer {
+	FILE		*mpw_f;
+	unsigned int	 mpw_count;
+	unsigned char	 mpw_buf[MPB_RECORD_SZ * MPB_BATCH];
+};
+
+static unsigned char *
+mpb_put16(unsigned char *p, uint16_t v)
 {
-	struct mprofile_record *mpr, *walk;
+	v = htole16(v);
+	memcpy(p, &v, sizeof (v));
 
-	TAILQ_FOREACH_SAFE(mpr, &mp->mp_tqhead, mpr_tqe, walk) {
-		TAILQ_REMOVE(&mp->mp_tqhead, mpr, mpr_tqe);
-		free(mpr);
-	}
-#ifdef _WITH_STACKTRACE
-	mprofile_destroy_stset(mp->mp_stset);
-#endif
-	free(mp);
+	return (p + sizeof (v));
 }
 
-void
-mprofile_record_alloc(mprofile_t *mp, void *buf, size_t buf_sz,
-    mprofile_stack_t *mps)
+static unsigned char *
+mpb_put32(unsigned char *p, uint32_t v)
 {
-	struct mprofile_record *mpr;
+	v = htole32(v);
+	memcpy(p, &v, sizeof (v));
 
-	mpr = create_mprofile_record();
-	if (mpr == NULL) {
-		fprintf(stderr, "%s create_mprofile_record() failed\n", __func__);
-		return;
-	}
+	return (p + sizeof (v));
+}
 
-	mpr->mpr_mem = buf;
-	mpr->mpr_delta = (ssize_t)buf_sz;
-	mpr->mpr_state = ALLOC;
-	mpr->mpr_id = atomic_add_long_nv((unsigned long *)&mpr_id, 1);
-	TAILQ_INSERT_TAIL(&mp->mp_tqhead, mpr, mpr_tqe);
+static unsigned char *
+mpb_put64(unsigned char *p, uint64_t v)
+{
+	v = htole64(v);
+	memcpy(p, &v, sizeof (v));
 
-#ifdef _WITH_STACKTRACE
-	if (mps != NULL) {
-		mps = mprofile_add_stack(mp->mp_stset, mps);
-		mpr->mpr_stack_id = mprofile_get_stack_id(mps);
-	} else {
-		mpr->mpr_stack_id = 0;
+	return (p + sizeof (v));
+}
+
+static void
+mpb_section(FILE *f, uint32_t type, uint32_t count)
+{
+	unsigned char sect[8], *p;
+
+	p = mpb_put32(sect, type);
+	mpb_put32(p, count);
+	fwrite(sect, sizeof (sect), 1, f);
+}
+
+static void
+mpb_write_header(FILE *f, unsigned int chunk_count, uint32_t flags)
+{
+	unsigned char hdr[MPB_HDR_SZ], *p;
+
+	memset(hdr, 0, sizeof (hdr));
+	memcpy(hdr, MPB_MAGIC, 4);
+	p = mpb_put32(hdr + 4, MPB_VERSION);
+	p = mpb_put32(p, MPB_RECORD_SZ);
+	p = mpb_put32(p, flags);
+	p = mpb_put64(p, (uint64_t)start_time_tv.tv_sec);
+	p = mpb_put32(p, (uint32_t)start_time_tv.tv_nsec);
+	p = mpb_put32(p, chunk_count);
+	mpb_put32(p, MPR_CHUNK_RECORDS);
+	fwrite(hdr, sizeof (hdr), 1, f);
+}
+
+static void
+mpb_write_annotation(FILE *f)
+{
+	const char *annotation = mprofile_get_annotation();
+
+	mpb_section(f, MPB_ANNOTATION, strlen(annotation));
+	fwrite(annotation, strlen(annotation), 1, f);
+}
+
+static void
+mpb_flush(struct mpb_writer *mpw)
+{
+	if (mpw->mpw_count == 0)
+		return;
+
+	mpb_section(mpw->mpw_f, MPB_RECORDS, mpw->mpw_count);
+	fwrite(mpw->mpw_buf, MPB_RECORD_SZ, mpw->mpw_count, mpw->mpw_f);
+	mpw->mpw_count = 0;
+}
+
+static void
+mpb_write_record(struct mpb_writer *mpw, struct mprofile_record *mpr,
+    struct chain_link *cl)
+{
+	unsigned char *p;
+
+	p = &mpw->mpw_buf[mpw->mpw_count * MPB_RECORD_SZ];
+	memset(p, 0, MPB_RECORD_SZ);
+	p = mpb_put64(p, mpr->mpr_id);
+	p = mpb_put64(p, (uint64_t)(uintptr_t)mpr->mpr_mem);
+	p = mpb_put64(p, (uint64_t)(uintptr_t)record_realloc(mpr));
+	p = mpb_put64(p, (uint64_t)record_delta(mpr));
+	p = mpb_put64(p, (cl != NULL) ? cl->cl_next_id : 0);
+	p = mpb_put64(p, (cl != NULL) ? cl->cl_prev_id : 0);
+	p = mpb_put64(p, ticks_to_ns(mpr->mpr_ticks));
+	p = mpb_put32(p, mpr->mpr_stack_id);
+	*p = (unsigned char)mpr->mpr_state;
+	mpb_put32(p + 4, record_weight(mpr));
+
+	mpw->mpw_count++;
+	if (mpw->mpw_count == MPB_BATCH)
+		mpb_flush(mpw);
+}
+
+#ifdef _WITH_STACKTRACE
+static void
+mpb_write_frame(unsigned long long frame, void *f_arg)
+{
+	FILE *f = (FILE *)f_arg;
+	char buf[SYM_NAME_LEN];
+	const char *name;
+	unsigned char len[2];
+	size_t l;
+
+	name = sym_lookup(frame, buf, sizeof (buf));
+	l = strlen(name);
+	mpb_put16(len, (uint16_t)l);
+	fwrite(len, sizeof (len), 1, f);
+	fwrite(name, l, 1, f);
+}
+
+static void
+mpb_write_stack(FILE *f, mprofile_stack_t *stack)
+{
+	unsigned char st[20], *p;
+
+	p = mpb_put32(st, mprofile_get_stack_id(stack));
+	p = mpb_put32(p, mprofile_get_stack_count(stack));
+	p = mpb_put64(p, mprofile_get_thread_id(stack));
+	mpb_put32(p, mprofile_get_stack_depth(stack));
+	fwrite(st, sizeof (st), 1, f);
+	mprofile_walk_stack(stack, mpb_write_frame, f);
+}
+
+static void
+mpb_write_modules(FILE *f)
+{
+	unsigned char mod[26], *p;
+	unsigned int i, n = 0;
+	size_t l;
+
+	pthread_mutex_lock(&shlib_mtx);
+	for (i = 0; i < shlib_count; i++)
+		n += shlib_usable(i);
+	mpb_section(f, MPB_MODULES, n);
+	for (i = 0; i < shlib_count; i++) {
+		if (!shlib_usable(i))
+			continue;
+		p = mpb_put64(mod, shlibs[i].shl_base);
+		p = mpb_put64(p, shlibs[i].shl_start);
+		p = mpb_put64(p, shlibs[i].shl_end);
+		mpb_put16(p, shlibs[i].shl_build_id_len);
+		fwrite(mod, sizeof (mod), 1, f);
+		fwrite(shlibs[i].shl_build_id, shlibs[i].shl_build_id_len, 1,
+		    f);
+		l = strlen(shlibs[i].shl_name);
+		mpb_put16(mod, (uint16_t)l);
+		fwrite(mod, 2, 1, f);
+		fwrite(shlibs[i].shl_name, l, 1, f);
 	}
-#endif
+	pthread_mutex_unlock(&shlib_mtx);
 }
 
-void
-mprofile_record_free(mprofile_t *mp, void *buf, size_t sz, mprofile_stack_t *mps)
+/*
+ * writes stacks section. Stacks are counted first, we write exactly
+ * that many stacks even if some thread still adds a new stack.
+ */
+static void
+mpb_write_stacks(FILE *f)
 {
-	struct mprofile_record *mpr;
+	mprofile_stack_t *stack;
+	uint32_t stack_count = 0, i;
 
-	mpr = create_mprofile_record();
-	if (mpr == NULL) {
-		fprintf(stderr, "%s create_mprofile_record() failed\n", __func__);
+	if (sym_offline)
+		mpb_write_modules(f);
+
+	mpb_section(f, MPB_STACKS_DROPPED, mprofile_get_stset_dropped(stset));
+	stack = mprofile_get_next_stack(stset, NULL);
+	while (stack != NULL) {
+		stack_count++;
+		stack = mprofile_get_next_stack(stset, stack);
+	}
+	mpb_section(f, MPB_STACKS, stack_count);
+	stack = mprofile_get_next_stack(stset, NULL);
+	for (i = 0; i < stack_count && stack != NULL; i++) {
+		mpb_write_stack(f, stack);
+		stack = mprofile_get_next_stack(stset, stack);
+	}
+}
+#endif
+
+static void
+profile_save_bin(FILE *f, int link_chains)
+{
+	struct mpb_writer *mpw;
+	uint32_t flags = 0;
+	uint64_t i;
+
+	if (f == NULL)
+		return;
+
+	mpw = (struct mpb_writer *)malloc(sizeof (struct mpb_writer));
+	if (mpw == NULL) {
+		fprintf(stderr, "%s no memory for writer\n", __func__);
 		return;
 	}
+	mpw->mpw_f = f;
+	mpw->mpw_count = 0;
 
-	mpr->mpr_mem = buf;
-	mpr->mpr_state = FREE;
-	mpr->mpr_delta = sz * -1;
-	mpr->mpr_id = atomic_add_long_nv((unsigned long *)&mpr_id, 1);
-	TAILQ_INSERT_TAIL(&mp->mp_tqhead, mpr, mpr_tqe);
+	if (link_chains)
+		flags |= MPB_F_CHAINS;
+#ifdef	_WITH_STACKTRACE
+	flags |= MPB_F_STACKS;
+#endif
+	mpb_write_header(f, merged_chunks, flags);
+	mpb_write_annotation(f);
+	mpb_section(f, MPB_MERGE_TIME, (uint32_t)merge_usec);
+	mpb_section(f, MPB_CHAINS_TIME, (uint32_t)chains_usec);
+
+	for (i = 0; i < record_count; i++)
+		mpb_write_record(mpw, merged_records[i],
+		    (chain_links != NULL) ? &chain_links[i] : NULL);
+	mpb_flush(mpw);
+	free(mpw);
 
 #ifdef _WITH_STACKTRACE
-	if (mps != NULL) {
-		mps = mprofile_add_stack(mp->mp_stset, mps);
-		mpr->mpr_stack_id = mprofile_get_stack_id(mps);
-	} else {
-		mpr->mpr_stack_id = 0;
-	}
+	mpb_write_stacks(f);
 #endif
+	mpb_section(f, MPB_END, 0);
 }
 
 void
-mprofile_record_realloc(mprofile_t *mp, void *buf, size_t buf_sz,
-    size_t orig_sz, void *old_buf, mprofile_stack_t *mps)
+mprofile_destroy(mprofile_t *mp)
+{
+	struct mprofile_chunk *mpc, *walk;
+
+	/* records live in chunks, we just drop them all */
+	TAILQ_FOREACH_SAFE(mpc, &mp->mp_chunks, mpc_tqe, walk) {
+		TAILQ_REMOVE(&mp->mp_chunks, mpc, mpc_tqe);
+		free(mpc);
+	}
+	pthread_mutex_destroy(&mp->mp_mtx);
+	free(mp);
+}
+
+static void
+add_record(mprofile_t *mp, unsigned int state, void *buf, int64_t delta,
+    void *old_buf, mprofile_stack_t *mps)
 {
 	struct mprofile_record *mpr;
+	struct mprofile_aux *mpa;
+	unsigned int stack_id = 0, weight = 0;
+	int aux;
 
-	mpr = create_mprofile_record();
+#ifdef _WITH_STACKTRACE
+	if (mps != NULL) {
+		mps = mprofile_add_stack(stset, mps);
+		stack_id = mprofile_get_stack_id(mps);
+		weight = mp->mp_weight;
+		mp->mp_weight = 1;
+	}
+#endif
+	aux = (state == REALLOC || delta != (int32_t)delta ||
+	    weight != ((stack_id != 0) ? 1 : 0));
+
+	mpr = create_mprofile_record(mp, aux ? 2 : 1);
 	if (mpr == NULL) {
 		fprintf(stderr, "%s create_mprofile_record() failed\n", __func__);
 		return;
 	}
 
 	mpr->mpr_mem = buf;
-	mpr->mpr_delta = buf_sz - orig_sz;
-	mpr->mpr_realloc = old_buf;
-	mpr->mpr_state = REALLOC;
-	mpr->mpr_id = atomic_add_long_nv((unsigned long *)&mpr_id, 1);
-	TAILQ_INSERT_TAIL(&mp->mp_tqhead, mpr, mpr_tqe);
-
-#ifdef _WITH_STACKTRACE
-	if (mps != NULL) {
-		mps = mprofile_add_stack(mp->mp_stset, mps);
-		mpr->mpr_stack_id = mprofile_get_stack_id(mps);
+	mpr->mpr_state = state;
+	mpr->mpr_stack_id = stack_id;
+	mpr->mpr_aux = aux;
+	if (aux) {
+		mpa = MPR_AUX(mpr);
+		mpa->mpa_realloc = old_buf;
+		mpa->mpa_delta = delta;
+		mpa->mpa_weight = weight;
 	} else {
-		mpr->mpr_stack_id = 0;
+		mpr->mpr_delta = (int32_t)delta;
 	}
-#endif
+	mpr->mpr_id = atomic_add_long_nv((unsigned long *)&mpr_id, 1);
+
+	publish_mprofile_record(mp);
+}
+
+void
+mprofile_record_alloc(mprofile_t *mp, void *buf, size_t buf_sz,
+    mprofile_stack_t *mps)
+{
+	add_record(mp, ALLOC, buf, (int64_t)buf_sz, NULL, mps);
+}
+
+void
+mprofile_record_free(mprofile_t *mp, void *buf, size_t sz, mprofile_stack_t *mps)
+{
+	add_record(mp, FREE, buf, -(int64_t)sz, NULL, mps);
+}
+
+void
+mprofile_record_realloc(mprofile_t *mp, void *buf, size_t buf_sz,
+    size_t orig_sz, void *old_buf, mprofile_stack_t *mps)
+{
+	add_record(mp, REALLOC, buf, (int64_t)buf_sz - (int64_t)orig_sz,
+	    old_buf, mps);
 }
 
 #ifdef	_WITH_STACKTRACE
+static int
+shlib_compare(const void *a, const void *b)
+{
+	const struct shlib *a_shl = a, *b_shl = b;
+
+	return ((a_shl->shl_start < b_shl->shl_start) ? -1 :
+	    (a_shl->shl_start > b_shl->shl_start));
+}
+
+/*
+ * Addresses in stacks do not tell which of the objects which occupied
+ * the same range they belong to. Entry is used only if there is no
+ * overlapping entry which was unloaded later or which is still loaded,
+ * so each address is resolved by exactly one object.
+ */
+static int
+shlib_usable(unsigned int i)
+{
+	unsigned int j, rank_i, rank_j;
+
+	rank_i = (shlibs[i].shl_gone == 0) ? UINT_MAX : shlibs[i].shl_gone;
+	for (j = 0; j < shlib_count; j++) {
+		if (j == i || shlibs[j].shl_start >= shlibs[i].shl_end ||
+		    shlibs[j].shl_end <= shlibs[i].shl_start)
+			continue;
+		rank_j = (shlibs[j].shl_gone == 0) ?
+		    UINT_MAX : shlibs[j].shl_gone;
+		if (rank_j > rank_i)
+			return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * build-id is found in PT_NOTE segment of loaded object, so we don't
+ * need to read the file.
+ */
 static void
-add_shlib(Dl_info *dli)
+shlib_build_id(struct shlib *shl, struct dl_phdr_info *dlpi)
 {
-	unsigned int i = 0;
+	const ElfW(Nhdr) *nhdr;
+	const char *note, *end;
+	unsigned int i;
+
+	shl->shl_build_id_len = 0;
+	for (i = 0; i < dlpi->dlpi_phnum; i++) {
+		if (dlpi->dlpi_phdr[i].p_type != PT_NOTE)
+			continue;
+		note = (const char *)(dlpi->dlpi_addr +
+		    dlpi->dlpi_phdr[i].p_vaddr);
+		end = note + dlpi->dlpi_phdr[i].p_memsz;
+		while (note + sizeof (ElfW(Nhdr)) <= end) {
+			nhdr = (const ElfW(Nhdr) *)note;
+			note += sizeof (ElfW(Nhdr)) +
+			    ((nhdr->n_namesz + 3) & ~3U);
+			if (nhdr->n_type == NT_GNU_BUILD_ID &&
+			    nhdr->n_descsz <= SHL_BUILD_ID_MAX &&
+			    note + nhdr->n_descsz <= end) {
+				memcpy(shl->shl_build_id, note,
+				    nhdr->n_descsz);
+				shl->shl_build_id_len = nhdr->n_descsz;
+				return;
+			}
+			note += (nhdr->n_descsz + 3) & ~3U;
+		}
+	}
+}
 
-	while (shlibs[i].shl_name != NULL && i < MAX_SHLIBS) {
-		if (strcmp(shlibs[i].shl_name, dli->dli_fname) == 0)
-			return;
-		i++; }
+/*
+ * Returns index of the first sorted entry which starts at start,
+ * shlib_sorted if there is none.
+ */
+static unsigned int
+shlib_find(unsigned long start)
+{
+	unsigned int lo = 0, hi = shlib_sorted, mid;
 
-	if (i == MAX_SHLIBS)
-		return;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (shlibs[mid].shl_start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return ((lo < shlib_sorted && shlibs[lo].shl_start == start) ?
+	    lo : shlib_sorted);
+}
 
-	shlibs[i].shl_name = strdup(dli->dli_fname);
-	shlibs[i].shl_base = (uintptr_t)dli->dli_fbase;
+static void
+shlib_drop(unsigned int i)
+{
+	free(shlibs[i].shl_name);
+	memmove(&shlibs[i], &shlibs[i + 1],
+	    sizeof (struct shlib) * (shlib_count - i - 1));
+	shlib_count--;
 }
 
+/*
+ * Drops entries which can not be used any more, then the oldest gone
+ * entries if there are more than SHL_GONE_MAX of them. Table stays
+ * sorted.
+ */
 static void
-walk_stack(unsigned long long frame, void *arg)
+prune_shlibs(void)
 {
-	Dl_info dli;
+	unsigned int i, gone = 0, oldest;
+
+	i = 0;
+	while (i < shlib_count) {
+		if (shlibs[i].shl_gone != 0 && !shlib_usable(i)) {
+			shlib_drop(i);
+			continue;
+		}
+		gone += (shlibs[i].shl_gone != 0);
+		i++;
+	}
 
-	if (dladdr((uintptr_t *)frame, &dli) != 0)
-		add_shlib(&dli);
+	while (gone > SHL_GONE_MAX) {
+		oldest = shlib_count;
+		for (i = 0; i < shlib_count; i++) {
+			if (shlibs[i].shl_gone != 0 && (oldest == shlib_count ||
+			    shlibs[i].shl_gone < shlibs[oldest].shl_gone))
+				oldest = i;
+		}
+		shlib_drop(oldest);
+		gone--;
+	}
+}
+
+static int
+add_shlib(struct dl_phdr_info *dlpi, size_t sz, void *arg)
+{
+	struct shlib *shl, tmp;
+	unsigned long start = ~0UL, end = 0, a;
+	unsigned int i;
+	int *changed = arg;
+	const char *name;
+	char path[PATH_MAX];
+
+	(void)sz;
+
+	for (i = 0; i < dlpi->dlpi_phnum; i++) {
+		if (dlpi->dlpi_phdr[i].p_type != PT_LOAD)
+			continue;
+		a = dlpi->dlpi_addr + dlpi->dlpi_phdr[i].p_vaddr;
+		if (a < start)
+			start = a;
+		a += dlpi->dlpi_phdr[i].p_memsz;
+		if (a > end)
+			end = a;
+	}
+	if (start >= end)
+		return (0);
+
+	/*
+	 * Loaded entry at the same place with the same build-id is the
+	 * same object, no need to look at path. Objects never overlap
+	 * while loaded.
+	 */
+	shlib_build_id(&tmp, dlpi);
+	for (i = shlib_find(start);
+	    i < shlib_sorted && shlibs[i].shl_start == start; i++) {
+		if (shlibs[i].shl_gone == 0 && shlibs[i].shl_end == end &&
+		    shlibs[i].shl_base == dlpi->dlpi_addr &&
+		    shlibs[i].shl_build_id_len == tmp.shl_build_id_len &&
+		    memcmp(shlibs[i].shl_build_id, tmp.shl_build_id,
+		    tmp.shl_build_id_len) == 0) {
+			shlibs[i].shl_seen = shlib_pass;
+			return (0);
+		}
+	}
+
+	/*
+	 * main program comes with empty name, other objects come with
+	 * path given to dlopen() or LD_PRELOAD which can be relative.
+	 * Absolute path is needed when symbols are resolved by another
+	 * process.
+	 */
+	name = dlpi->dlpi_name;
+	if (name == NULL || *name == '\0')
+		name = "/proc/self/exe";
+	if (realpath(name, path) != NULL)
+		name = path;
+
+	*changed = 1;
+
+	/* object which comes back to where it was gets its entry back */
+	for (i = shlib_find(start);
+	    i < shlib_sorted && shlibs[i].shl_start == start; i++) {
+		if (shlibs[i].shl_end == end &&
+		    shlibs[i].shl_base == dlpi->dlpi_addr &&
+		    shlibs[i].shl_build_id_len == tmp.shl_build_id_len &&
+		    memcmp(shlibs[i].shl_build_id, tmp.shl_build_id,
+		    tmp.shl_build_id_len) == 0 &&
+		    strcmp(shlibs[i].shl_name, name) == 0) {
+			shlibs[i].shl_seen = shlib_pass;
+			shlibs[i].shl_gone = 0;
+			return (0);
+		}
+	}
+
+	if (shlib_count == shlib_size) {
+		shl = (struct shlib *)realloc(shlibs, sizeof (struct shlib) *
+		    ((shlib_size == 0) ? 32 : shlib_size * 2));
+		if (shl == NULL)
+			return (1);
+		shlibs = shl;
+		shlib_size = (shlib_size == 0) ? 32 : shlib_size * 2;
+	}
+	shl = &shlibs[shlib_count];
+	if ((shl->shl_name = strdup(name)) == NULL)
+		return (1);
+	shl->shl_base = dlpi->dlpi_addr;
+	shl->shl_start = start;
+	shl->shl_end = end;
+	shl->shl_loaded = 0;
+	shl->shl_seen = shlib_pass;
+	shl->shl_gone = 0;
+	shl->shl_build_id_len = tmp.shl_build_id_len;
+	memcpy(shl->shl_build_id, tmp.shl_build_id, tmp.shl_build_id_len);
+	shlib_count++;
+
+	return (0);
+}
+
+/*
+ * pcs are sorted, so we walk them together with sorted table of
+ * objects. Symbols of object are loaded when first frame falls
+ * to it. Objects without a file (vdso) never get loaded, because
+ * kelf_open() fails for them.
+ */
+static void
+load_shlibs(unsigned long *pcs, size_t n)
+{
+	size_t i = 0;
+	unsigned int j = 0;
+
+	if (syms == NULL)
+		syms = kelf_create(sym_lines ? KELF_LINES : 0);
+
+	pthread_mutex_lock(&shlib_mtx);
+	for (j = 0; j < shlib_count; j++) {
+		if (shlibs[j].shl_loaded || !shlib_usable(j))
+			continue;
+		/* first address at or above start must be below end */
+		while (i < n && pcs[i] < shlibs[j].shl_start)
+			i++;
+		if (i == n)
+			break;
+		if (pcs[i] >= shlibs[j].shl_end)
+			continue;
+		syms = kelf_open(shlibs[j].shl_name, syms, shlibs[j].shl_base);
+		shlibs[j].shl_loaded = 1;
+	}
+	pthread_mutex_unlock(&shlib_mtx);
 }
 #endif
 
 /*
- * This is expensive, we walk trhough all stacks
- * to find list of shared libraries. There must
- * better way to obtain the list of shared libraries.
+ * Finds objects loaded to process. It is called before stacks are
+ * written, so it also sees objects loaded by dlopen() at run time.
+ * Objects which are not found any more are marked as gone. Pass
+ * which finds nothing new (typically the one before dlclose()) only
+ * looks up known entries.
  */
 static void
-load_syms(mprofile_t *mp)
+find_shlibs(void)
 {
 #ifdef _WITH_STACKTRACE
-	unsigned int	i;
-	mprofile_stack_t *stack;
+	unsigned int i;
+	int changed = 0;
+
+	pthread_mutex_lock(&shlib_mtx);
+	shlib_pass++;
+	dl_iterate_phdr(add_shlib, &changed);
+	for (i = 0; i < shlib_count; i++) {
+		if (shlibs[i].shl_gone == 0 &&
+		    shlibs[i].shl_seen != shlib_pass) {
+			shlibs[i].shl_gone = shlib_pass;
+			changed = 1;
+		}
+	}
+	if (changed) {
+		qsort(shlibs, shlib_count, sizeof (struct shlib),
+		    shlib_compare);
+		prune_shlibs();
+	}
+	shlib_sorted = shlib_count;
+	pthread_mutex_unlock(&shlib_mtx);
+#endif
+}
 
-	stack = mprofile_get_next_stack(mp->mp_stset, NULL);
-	while (stack != NULL) {
-		mprofile_walk_stack(stack, walk_stack, NULL);
-		stack = mprofile_get_next_stack(mp->mp_stset, stack);
+static void
+load_syms(void)
+{
+#ifdef _WITH_STACKTRACE
+	if (sym_offline == 0)
+		sym_cache_build();
+#endif
+}
+
+#ifdef _WITH_STACKTRACE
+/*
+ * Object is recorded before it gets unloaded, so we know where it
+ * was when stacks are resolved. Table is updated again once handle
+ * is closed to mark objects which are gone. It is needed only when
+ * stacks are collected, stack set is created by mprofile_init_stacks()
+ * for such modes only.
+ */
+int
+dlclose(void *handle)
+{
+	static int (*real_dlclose)(void *) = NULL;
+	int rv;
+
+	if (real_dlclose == NULL) {
+		real_dlclose = (int (*)(void *))dlsym(RTLD_NEXT, "dlclose");
+		if (real_dlclose == NULL)
+			return (-1);
 	}
 
-	for (i = 0; i < MAX_SHLIBS; i++) {
-		if (shlibs[i].shl_name != NULL)
-			syms = kelf_open(shlibs[i].shl_name, syms,
-			    shlibs[i].shl_base);
+	if (stset != NULL)
+		find_shlibs();
+
+	rv = real_dlclose(handle);
+
+	if (stset != NULL)
+		find_shlibs();
+
+	return (rv);
+}
+
+static void
+print_modules(FILE *f)
+{
+	unsigned int i, j;
+	const char *sep = "";
+
+	pthread_mutex_lock(&shlib_mtx);
+	fprintf(f, "\t\"modules\" : [\n");
+	for (i = 0; i < shlib_count; i++) {
+		if (!shlib_usable(i))
+			continue;
+		fprintf(f, "%s\t\t{ \"path\" : \"%s\", \"build_id\" : \"",
+		    sep, shlibs[i].shl_name);
+		for (j = 0; j < shlibs[i].shl_build_id_len; j++)
+			fprintf(f, "%02x", shlibs[i].shl_build_id[j]);
+		fprintf(f, "\", \"base\" : %lu, \"start\" : %lu, "
+		    "\"end\" : %lu }", shlibs[i].shl_base,
+		    shlibs[i].shl_start, shlibs[i].shl_end);
+		sep = ",\n";
 	}
-#endif
+	fprintf(f, "\n\t],\n");
+	pthread_mutex_unlock(&shlib_mtx);
 }
+#endif
 
 void
 mprofile_add(mprofile_t *mp)
 {
 	pthread_mutex_lock(&mtx);
+	mp->mp_index = profile_count++;
 	TAILQ_INSERT_TAIL(&profiles, mp, mp_tqe);
 	pthread_mutex_unlock(&mtx);
 }
 
 static void
-build_chains(mprofile_t *mp)
+stream_write_chunk(struct mpb_writer *mpw, struct mprofile_chunk *mpc)
 {
-	struct mprofile_record key_mpr;
-	struct mprofile_record *mpr, *tree_mpr;
-	struct mprofile_record_mem memtree;
+	struct mprofile_record *mpr;
+	unsigned int i;
+
+	for (i = 0; i < mpc->mpc_used; i += MPR_SLOTS(mpr)) {
+		mpr = &mpc->mpc_slots[i].mps_rec;
+		mpb_write_record(mpw, mpr, NULL);
+	}
+}
+
+static void *
+stream_writer(void *arg)
+{
+	struct mpb_writer *mpw = (struct mpb_writer *)arg;
+	struct mprofile_chunk *mpc, *list, *next;
+	struct timespec ts = { 0, 1000000 };
+	int stop;
+
+	do {
+		stop = __atomic_load_n(&stream_stop, __ATOMIC_ACQUIRE);
+		list = __atomic_exchange_n(&stream_head, NULL,
+		    __ATOMIC_ACQ_REL);
+		if (list == NULL) {
+			if (stop == 0)
+				nanosleep(&ts, NULL);
+			continue;
+		}
+
+		/* queue is LIFO, reverse it to write oldest chunk first */
+		mpc = NULL;
+		while (list != NULL) {
+			next = list->mpc_next;
+			list->mpc_next = mpc;
+			mpc = list;
+			list = next;
+		}
+
+		while (mpc != NULL) {
+			next = mpc->mpc_next;
+			stream_write_chunk(mpw, mpc);
+			free(mpc);
+			__atomic_sub_fetch(&stream_queued, 1, __ATOMIC_ACQ_REL);
+			mpc = next;
+		}
+		mpb_flush(mpw);
+	} while (stop == 0 || list != NULL);
+
+	return (NULL);
+}
+
+static void
+stream_start(FILE *f, unsigned int limit)
+{
+	struct mpb_writer *mpw;
+	uint32_t flags = MPB_F_UNSORTED;
+
+	mpw = (struct mpb_writer *)malloc(sizeof (struct mpb_writer));
+	if (mpw == NULL) {
+		fprintf(stderr, "%s no memory for writer\n", __func__);
+		return;
+	}
+	mpw->mpw_f = f;
+	mpw->mpw_count = 0;
+
+#ifdef	_WITH_STACKTRACE
+	flags |= MPB_F_STACKS;
+#endif
+	mpb_write_header(f, 0, flags);
+	mpb_write_annotation(f);
+
+	stream_file = f;
+	stream_limit = limit;
+	if ((errno = pthread_create(&stream_thread, NULL, stream_writer,
+	    mpw)) != 0) {
+		perror(__func__);
+		stream_limit = 0;
+		free(mpw);
+	}
+}
+
+/*
+ * Writer is stopped first, then we write remaining records which are
+ * still found in chunks owned by threads. Stack tables of all threads
+ * are written at the end. Chunk count in header is updated when file
+ * is seekable.
+ */
+static void
+stream_save(FILE *f)
+{
+	struct mprofile		*mp, *walk;
+	struct mprofile_chunk	*mpc, *next;
+	struct mpb_writer	*mpw;
+	unsigned int		 chunk_count = 0;
+	uint32_t		 flags = MPB_F_UNSORTED;
+
+	__atomic_store_n(&stream_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(stream_thread, NULL);
+
+	mpw = (struct mpb_writer *)malloc(sizeof (struct mpb_writer));
+	if (mpw == NULL) {
+		fprintf(stderr, "%s no memory for writer\n", __func__);
+		return;
+	}
+	mpw->mpw_f = f;
+	mpw->mpw_count = 0;
+
+	/* chunks which got queued after writer has finished */
+	mpc = __atomic_exchange_n(&stream_head, NULL, __ATOMIC_ACQ_REL);
+	while (mpc != NULL) {
+		next = mpc->mpc_next;
+		stream_write_chunk(mpw, mpc);
+		free(mpc);
+		mpc = next;
+	}
+
+	TAILQ_FOREACH(mp, &profiles, mp_tqe) {
+		TAILQ_FOREACH(mpc, &mp->mp_chunks, mpc_tqe)
+			stream_write_chunk(mpw, mpc);
+		chunk_count += mp->mp_chunk_count;
+	}
+	find_shlibs();
+	mpb_flush(mpw);
+	free(mpw);
+
+#ifdef	_WITH_STACKTRACE
+	load_syms();
+	flags |= MPB_F_STACKS;
+	mpb_write_stacks(f);
+#endif
+	mpb_section(f, MPB_END, 0);
+
+	if (fseek(f, 0, SEEK_SET) == 0)
+		mpb_write_header(f, chunk_count, flags);
+
+	TAILQ_FOREACH_SAFE(mp, &profiles, mp_tqe, walk) {
+		TAILQ_REMOVE(&profiles, mp, mp_tqe);
+		mprofile_destroy(mp);
+	}
+}
 
+static void
+build_chains_tree(void)
+{
+	struct chain_node *nodes, *cn, *tree_cn, key_cn;
+	struct mprofile_record *mpr, *tree_mpr;
+	struct chain_tree memtree;
+	uint64_t i;
+
+	nodes = (struct chain_node *)malloc(sizeof (struct chain_node) *
+	    (record_count + 1));
+	if (nodes == NULL) {
+		perror("No memory");
+		abort();
+	}
 	RB_INIT(&memtree);
-	memset(&key_mpr, 0, sizeof (struct mprofile_record));
+	memset(&key_cn, 0, sizeof (struct chain_node));
 
-	TAILQ_FOREACH(mpr, &mp->mp_tqhead, mpr_tqe) {
+	for (i = 0; i < record_count; i++) {
+		mpr = merged_records[i];
+		cn = &nodes[i];
+		cn->cn_mem = mpr->mpr_mem;
+		cn->cn_idx = i;
 		switch (mpr->mpr_state) {
 		case ALLOC:
-			tree_mpr = RB_INSERT(mprofile_record_mem, &memtree,
-			    mpr);
-			if (tree_mpr != NULL) {
+			tree_cn = RB_INSERT(chain_tree, &memtree, cn);
+			if (tree_cn != NULL) {
 				fprintf(stderr,
 				    "%s 0x%p (alloc) already found in "
 				    "tree %p %p\n", __func__, mpr->mpr_mem,
-				    mpr, tree_mpr);
+				    mpr, merged_records[tree_cn->cn_idx]);
 				abort();
 			}
 			break;
 		case FREE:
 			if (mpr->mpr_mem == NULL)
 				continue;
-			key_mpr.mpr_mem = mpr->mpr_mem;
-			tree_mpr = RB_FIND(mprofile_record_mem, &memtree,
-			    &key_mpr);
-			if (tree_mpr == NULL) {
+			key_cn.cn_mem = mpr->mpr_mem;
+			tree_cn = RB_FIND(chain_tree, &memtree, &key_cn);
+			if (tree_cn == NULL) {
 				fprintf(stderr, "%s %p (free) address was not "
 				    "allocated\n", __func__, mpr->mpr_mem);
 				abort();
 			}
-			RB_REMOVE(mprofile_record_mem, &memtree, tree_mpr);
-			assert(tree_mpr->mpr_next_id == 0);
-			tree_mpr->mpr_next_id = mpr->mpr_id;
-			assert(mpr->mpr_prev_id == 0);
-			mpr->mpr_prev_id = tree_mpr->mpr_id;
+			RB_REMOVE(chain_tree, &memtree, tree_cn);
+			tree_mpr = merged_records[tree_cn->cn_idx];
+			assert(chain_links[tree_cn->cn_idx].cl_next_id == 0);
+			chain_links[tree_cn->cn_idx].cl_next_id = mpr->mpr_id;
+			assert(chain_links[i].cl_prev_id == 0);
+			chain_links[i].cl_prev_id = tree_mpr->mpr_id;
 			break;
 		case REALLOC:
-			key_mpr.mpr_mem = mpr->mpr_realloc;
-			tree_mpr = RB_FIND(mprofile_record_mem, &memtree,
-			    &key_mpr);
-			if (tree_mpr == NULL) {
+			key_cn.cn_mem = record_realloc(mpr);
+			tree_cn = RB_FIND(chain_tree, &memtree, &key_cn);
+			if (tree_cn == NULL) {
 				fprintf(stderr,
 				    "%s %p (realloc) address was not "
 				    "allocated\n", __func__, mpr->mpr_mem);
 				abort();
 			}
-			RB_REMOVE(mprofile_record_mem, &memtree, tree_mpr);
-			assert(tree_mpr->mpr_next_id == 0);
-			tree_mpr->mpr_next_id = mpr->mpr_id;
-			assert(mpr->mpr_prev_id == 0);
-			mpr->mpr_prev_id = tree_mpr->mpr_id;
+			RB_REMOVE(chain_tree, &memtree, tree_cn);
+			tree_mpr = merged_records[tree_cn->cn_idx];
+			assert(chain_links[tree_cn->cn_idx].cl_next_id == 0);
+			chain_links[tree_cn->cn_idx].cl_next_id = mpr->mpr_id;
+			assert(chain_links[i].cl_prev_id == 0);
+			chain_links[i].cl_prev_id = tree_mpr->mpr_id;
 			/*
 			 * insert realloc record to tree.
 			 */
-			tree_mpr = RB_INSERT(mprofile_record_mem, &memtree,
-			    mpr);
-			if (tree_mpr != NULL) {
+			tree_cn = RB_INSERT(chain_tree, &memtree, cn);
+			if (tree_cn != NULL) {
 				fprintf(stderr,
 				    "%s 0x%p (realloc) already found in "
 				    "tree %p %p\n", __func__, mpr->mpr_mem,
-				    mpr, tree_mpr);
+				    mpr, merged_records[tree_cn->cn_idx]);
 				abort();
 			}
 		}
@@ -532,81 +1839,699 @@ build_chains(mprofile_t *mp)
 	 * tree should be empty, if not then there must be leaks
 	 * We don't bother to report those leaks (at least now).
 	 */
+	free(nodes);
+}
+
+/*
+ * Open addressing hash table with linear probing. It holds the last
+ * record in chain for each live address. Table size is power of two
+ * at least twice the number of records, so it never gets full.
+ * cs_val is index of record in merged_records when chains are built,
+ * snapshot keeps size of live buffer there.
+ */
+struct chain_slot {
+	struct mprofile_record	*cs_mpr;
+	uint64_t		 cs_val;
+};
+
+struct chain_table {
+	struct chain_slot	*ct_slots;
+	uint64_t		 ct_mask;
+};
+
+static uint64_t
+chain_hash(struct chain_table *ct, void *mem)
+{
+	uint64_t h = (uint64_t)(uintptr_t)mem;
+
+	/* low bits are zero due to alignment */
+	h = (h >> 4) * 0x9e3779b97f4a7c15ULL;
+
+	return ((h >> 32) & ct->ct_mask);
+}
+
+static struct chain_slot *
+chain_insert(struct chain_table *ct, struct mprofile_record *mpr,
+    uint64_t val)
+{
+	uint64_t i = chain_hash(ct, mpr->mpr_mem);
+
+	while (ct->ct_slots[i].cs_mpr != NULL) {
+		if (ct->ct_slots[i].cs_mpr->mpr_mem == mpr->mpr_mem)
+			return (&ct->ct_slots[i]);
+		i = (i + 1) & ct->ct_mask;
+	}
+	ct->ct_slots[i].cs_mpr = mpr;
+	ct->ct_slots[i].cs_val = val;
+
+	return (NULL);
+}
+
+/*
+ * finds and removes record for address mem, the slot content is
+ * copied to cs. Removal shifts following entries back, so there is
+ * no need for tombstones.
+ */
+static int
+chain_remove(struct chain_table *ct, void *mem, struct chain_slot *cs)
+{
+	uint64_t i, j, h;
+
+	i = chain_hash(ct, mem);
+	while (ct->ct_slots[i].cs_mpr != NULL &&
+	    ct->ct_slots[i].cs_mpr->mpr_mem != mem)
+		i = (i + 1) & ct->ct_mask;
+
+	if (ct->ct_slots[i].cs_mpr == NULL)
+		return (0);
+	*cs = ct->ct_slots[i];
+
+	j = i;
+	for (;;) {
+		ct->ct_slots[i].cs_mpr = NULL;
+		do {
+			j = (j + 1) & ct->ct_mask;
+			if (ct->ct_slots[j].cs_mpr == NULL)
+				return (1);
+			h = chain_hash(ct, ct->ct_slots[j].cs_mpr->mpr_mem);
+			/* entry at j may stay if h lies cyclically in (i, j] */
+		} while ((i <= j) ? ((i < h) && (h <= j)) :
+		    ((i < h) || (h <= j)));
+		ct->ct_slots[i] = ct->ct_slots[j];
+		i = j;
+	}
+}
+
+static void
+build_chains_hash(void)
+{
+	struct chain_table ct;
+	struct chain_slot *tbl_cs, cs;
+	struct mprofile_record *mpr;
+	uint64_t i, sz = 16;
+
+	while (sz < record_count * 2)
+		sz <<= 1;
+	ct.ct_mask = sz - 1;
+	ct.ct_slots = (struct chain_slot *)calloc(sz,
+	    sizeof (struct chain_slot));
+	if (ct.ct_slots == NULL) {
+		perror("No memory");
+		abort();
+	}
+
+	for (i = 0; i < record_count; i++) {
+		mpr = merged_records[i];
+		switch (mpr->mpr_state) {
+		case ALLOC:
+			tbl_cs = chain_insert(&ct, mpr, i);
+			if (tbl_cs != NULL) {
+				fprintf(stderr,
+				    "%s 0x%p (alloc) already found in "
+				    "table %p %p\n", __func__, mpr->mpr_mem,
+				    mpr, tbl_cs->cs_mpr);
+				abort();
+			}
+			break;
+		case FREE:
+			if (mpr->mpr_mem == NULL)
+				continue;
+			if (chain_remove(&ct, mpr->mpr_mem, &cs) == 0) {
+				fprintf(stderr, "%s %p (free) address was not "
+				    "allocated\n", __func__, mpr->mpr_mem);
+				abort();
+			}
+			assert(chain_links[cs.cs_val].cl_next_id == 0);
+			chain_links[cs.cs_val].cl_next_id = mpr->mpr_id;
+			assert(chain_links[i].cl_prev_id == 0);
+			chain_links[i].cl_prev_id = cs.cs_mpr->mpr_id;
+			break;
+		case REALLOC:
+			if (chain_remove(&ct, record_realloc(mpr), &cs) == 0) {
+				fprintf(stderr,
+				    "%s %p (realloc) address was not "
+				    "allocated\n", __func__, mpr->mpr_mem);
+				abort();
+			}
+			assert(chain_links[cs.cs_val].cl_next_id == 0);
+			chain_links[cs.cs_val].cl_next_id = mpr->mpr_id;
+			assert(chain_links[i].cl_prev_id == 0);
+			chain_links[i].cl_prev_id = cs.cs_mpr->mpr_id;
+			tbl_cs = chain_insert(&ct, mpr, i);
+			if (tbl_cs != NULL) {
+				fprintf(stderr,
+				    "%s 0x%p (realloc) already found in "
+				    "table %p %p\n", __func__, mpr->mpr_mem,
+				    mpr, tbl_cs->cs_mpr);
+				abort();
+			}
+		}
+	}
+
+	free(ct.ct_slots);
+}
+
+static void
+build_chains(void)
+{
+	struct timespec ts_start, ts_end;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	chain_links = (struct chain_link *)calloc(record_count + 1,
+	    sizeof (struct chain_link));
+	if (chain_links == NULL) {
+		perror("No memory");
+		abort();
+	}
+	if (chains_tree)
+		build_chains_tree();
+	else
+		build_chains_hash();
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	chains_usec = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 +
+	    (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+}
+
+/*
+ * Records in chunks of each thread are sorted by mpr_id already, because
+ * ids come from atomic counter. So we just do k-way merge of per-thread
+ * chunk lists using a min-heap which holds the current record of each
+ * thread. Pointers to records are stored to merged_records.
+ */
+struct merge_head {
+	struct mprofile_record	*mgh_mpr;
+	struct mprofile_chunk	*mgh_mpc;
+	unsigned int		 mgh_i;
+};
+
+static struct mprofile_record *
+merge_next(struct merge_head *mgh)
+{
+	if (mgh->mgh_mpr != NULL)
+		mgh->mgh_i += MPR_SLOTS(mgh->mgh_mpr);
+	while (mgh->mgh_mpc != NULL && mgh->mgh_i >= mgh->mgh_mpc->mpc_used) {
+		mgh->mgh_mpc = TAILQ_NEXT(mgh->mgh_mpc, mpc_tqe);
+		mgh->mgh_i = 0;
+	}
+	mgh->mgh_mpr = (mgh->mgh_mpc != NULL) ?
+	    &mgh->mgh_mpc->mpc_slots[mgh->mgh_i].mps_rec : NULL;
+
+	return (mgh->mgh_mpr);
+}
+
+static void
+merge_heap_down(struct merge_head *heap, unsigned int n, unsigned int i)
+{
+	struct merge_head tmp;
+	unsigned int min, l, r;
+
+	for (;;) {
+		min = i;
+		l = 2 * i + 1;
+		r = l + 1;
+		if (l < n &&
+		    heap[l].mgh_mpr->mpr_id < heap[min].mgh_mpr->mpr_id)
+			min = l;
+		if (r < n &&
+		    heap[r].mgh_mpr->mpr_id < heap[min].mgh_mpr->mpr_id)
+			min = r;
+		if (min == i)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static uint64_t
+merge_records(struct mprofile_record **dst)
+{
+	struct merge_head *heap;
+	struct mprofile *mp;
+	unsigned int i, heap_sz = 0;
+	uint64_t count = 0;
+
+	heap = (struct merge_head *)malloc(sizeof (struct merge_head) *
+	    (profile_count + 1));
+	if (heap == NULL) {
+		perror("No memory");
+		abort();
+	}
+
+	TAILQ_FOREACH(mp, &profiles, mp_tqe) {
+		assert(heap_sz <= profile_count);
+		heap[heap_sz].mgh_mpr = NULL;
+		heap[heap_sz].mgh_mpc = TAILQ_FIRST(&mp->mp_chunks);
+		heap[heap_sz].mgh_i = 0;
+		if (merge_next(&heap[heap_sz]) != NULL)
+			heap_sz++;
+	}
+
+	i = heap_sz / 2;
+	while (i-- > 0)
+		merge_heap_down(heap, heap_sz, i);
+
+	while (heap_sz > 0) {
+		dst[count++] = heap[0].mgh_mpr;
+		if (merge_next(&heap[0]) == NULL) {
+			heap_sz--;
+			heap[0] = heap[heap_sz];
+		}
+		merge_heap_down(heap, heap_sz, 0);
+	}
+
+	free(heap);
+
+	return (count);
 }
 
 void
 mprofile_save(FILE *f, int link_chains)
 {
 	struct mprofile		*mp, *walk;
-#ifdef	_WITH_STACKTRACE
-	mprofile_stack_t	*st;
-#endif
-	struct mprofile_record	*mpr;
+	struct timespec		 ts_start, ts_end;
+	uint64_t		 count = 0;
+
+	/* wait for snapshot to finish, no more snapshots after this */
+	pthread_mutex_lock(&snap_mtx);
+	saved = 1;
+	pthread_mutex_unlock(&snap_mtx);
+
+	if (stream_limit != 0) {
+		stream_save(f);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+	TAILQ_FOREACH(mp, &profiles, mp_tqe) {
+		count += mp->mp_record_count;
+		merged_chunks += mp->mp_chunk_count;
+	}
+
+	merged_records = (struct mprofile_record **)malloc(
+	    sizeof (struct mprofile_record *) * (count + 1));
+	if (merged_records == NULL) {
+		perror("No memory");
+		abort();
+	}
+	record_count = merge_records(merged_records);
+	assert(record_count == count);
 
-	RB_INIT(&sorter);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	merge_usec = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 +
+	    (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+
+	if (link_chains == 1)
+		build_chains();
+
+	find_shlibs();
+	load_syms();
+	if (bin_format)
+		profile_save_bin(f, link_chains);
+	else
+		profile_save(f);
+
+	free(chain_links);
+	chain_links = NULL;
+	free(merged_records);
+	merged_records = NULL;
 
 	TAILQ_FOREACH_SAFE(mp, &profiles, mp_tqe, walk) {
 		TAILQ_REMOVE(&profiles, mp, mp_tqe);
-		if (master == NULL)
-			master = mp;
+		mprofile_destroy(mp);
+	}
+}
 
-		while ((mpr = TAILQ_FIRST(&mp->mp_tqhead)) != NULL) {
-			TAILQ_REMOVE(&mp->mp_tqhead, mpr, mpr_tqe);
-#ifdef	NDEBUG
-			RB_INSERT(mprofile_record_sort, &sorter, mpr);
-#else
-			assert(RB_INSERT(mprofile_record_sort, &sorter,
-			    mpr) == NULL);
-#endif
+/*
+ * Snapshot reads records from chunks while threads keep adding new ones.
+ * Only records published before snapshot started are taken, the cut is
+ * given by record id. Records are sorted by id and replayed to find
+ * live buffers. Live buffers are reported grouped by stack id.
+ */
+struct snap_live {
+	unsigned int	sl_stack_id;
+	unsigned int	sl_weight;
+	size_t		sl_size;
+};
 
-#ifdef	_WITH_STACKTRACE
-			if (mpr->mpr_stack_id != 0) {
-				st = mprofile_merge_stack(
-				    master->mp_stset, mp->mp_stset,
-				    mpr->mpr_stack_id);
-				mpr->mpr_stack_id = mprofile_get_stack_id(st);
+struct snap_stats {
+	uint64_t	ss_total_allocated;
+	uint64_t	ss_total_released;
+	uint64_t	ss_allocs;
+	uint64_t	ss_free;
+	uint64_t	ss_reallocs;
+	uint64_t	ss_current;
+	uint64_t	ss_max;
+};
+
+static int
+snap_id_compare(const void *a, const void *b)
+{
+	const struct mprofile_record *a_mpr, *b_mpr;
+
+	a_mpr = *(const struct mprofile_record * const *)a;
+	b_mpr = *(const struct mprofile_record * const *)b;
+
+	return ((a_mpr->mpr_id < b_mpr->mpr_id) ? -1 :
+	    (a_mpr->mpr_id > b_mpr->mpr_id));
+}
+
+static int
+snap_stack_compare(const void *a, const void *b)
+{
+	const struct snap_live *a_sl = a, *b_sl = b;
+
+	return ((a_sl->sl_stack_id < b_sl->sl_stack_id) ? -1 :
+	    (a_sl->sl_stack_id > b_sl->sl_stack_id));
+}
+
+/*
+ * collects published records with id up to cut from all threads.
+ */
+static struct mprofile_record **
+snap_collect(uint64_t cut, uint64_t *count)
+{
+	struct mprofile_record **snap = NULL, **tmp, *mpr;
+	struct mprofile_chunk *mpc;
+	struct mprofile *mp;
+	uint64_t n = 0, sz = 0;
+	unsigned int i, published;
+
+	pthread_mutex_lock(&mtx);
+	TAILQ_FOREACH(mp, &profiles, mp_tqe) {
+		pthread_mutex_lock(&mp->mp_mtx);
+		TAILQ_FOREACH(mpc, &mp->mp_chunks, mpc_tqe) {
+			published = __atomic_load_n(&mpc->mpc_published,
+			    __ATOMIC_ACQUIRE);
+			if (n + published > sz) {
+				sz = (sz == 0) ? MPR_CHUNK_RECORDS * 16 : sz * 2;
+				while (n + published > sz)
+					sz *= 2;
+				tmp = (struct mprofile_record **)realloc(snap,
+				    sizeof (struct mprofile_record *) * sz);
+				if (tmp == NULL) {
+					pthread_mutex_unlock(&mp->mp_mtx);
+					pthread_mutex_unlock(&mtx);
+					free(snap);
+					return (NULL);
+				}
+				snap = tmp;
+			}
+			for (i = 0; i < published; i += MPR_SLOTS(mpr)) {
+				mpr = &mpc->mpc_slots[i].mps_rec;
+				if (mpr->mpr_id <= cut)
+					snap[n++] = mpr;
 			}
-#endif
 		}
+		pthread_mutex_unlock(&mp->mp_mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	qsort(snap, n, sizeof (struct mprofile_record *), snap_id_compare);
+	*count = n;
 
-		/*
-		 * we want to keep master
-		 */
-		if (master != mp)
-			mprofile_destroy(mp);
+	return (snap);
+}
 
+/*
+ * replays records and returns live buffers. Records which refer to
+ * buffers not found in table are skipped, those come from operations
+ * which were still in progress when snapshot started.
+ */
+static struct snap_live *
+snap_replay(struct mprofile_record **snap, uint64_t count,
+    struct snap_stats *ss, uint64_t *live_count)
+{
+	struct chain_table ct;
+	struct chain_slot cs;
+	struct mprofile_record *mpr;
+	struct snap_live *live;
+	uint64_t i, n = 0, sz = 16;
+	int64_t delta;
+
+	while (sz < count * 2)
+		sz <<= 1;
+	ct.ct_mask = sz - 1;
+	ct.ct_slots = (struct chain_slot *)calloc(sz,
+	    sizeof (struct chain_slot));
+	if (ct.ct_slots == NULL)
+		return (NULL);
+
+	for (i = 0; i < count; i++) {
+		mpr = snap[i];
+		delta = record_delta(mpr);
+		switch (mpr->mpr_state) {
+		case ALLOC:
+			if (chain_insert(&ct, mpr, delta) != NULL)
+				continue;
+			ss->ss_allocs++;
+			ss->ss_total_allocated += delta;
+			ss->ss_current += delta;
+			break;
+		case FREE:
+			if (mpr->mpr_mem == NULL ||
+			    chain_remove(&ct, mpr->mpr_mem, &cs) == 0)
+				continue;
+			ss->ss_free++;
+			ss->ss_total_released += cs.cs_val;
+			ss->ss_current -= cs.cs_val;
+			break;
+		case REALLOC:
+			if (chain_remove(&ct, record_realloc(mpr), &cs) == 0)
+				continue;
+			chain_insert(&ct, mpr, cs.cs_val + delta);
+			ss->ss_reallocs++;
+			if (delta > 0)
+				ss->ss_total_allocated += delta;
+			else
+				ss->ss_total_released -= delta;
+			ss->ss_current += delta;
+			break;
+		}
+		if (ss->ss_current > ss->ss_max)
+			ss->ss_max = ss->ss_current;
 	}
 
-	while (!RB_EMPTY(&sorter)) {
-		mpr = RB_MIN(mprofile_record_sort, &sorter);
-		RB_REMOVE(mprofile_record_sort, &sorter, mpr);
-		TAILQ_INSERT_TAIL(&master->mp_tqhead, mpr, mpr_tqe);
+	live = (struct snap_live *)malloc(sizeof (struct snap_live) *
+	    (count + 1));
+	if (live != NULL) {
+		for (i = 0; i < sz; i++) {
+			if (ct.ct_slots[i].cs_mpr == NULL)
+				continue;
+			live[n].sl_stack_id = ct.ct_slots[i].cs_mpr->mpr_stack_id;
+			live[n].sl_weight = record_weight(ct.ct_slots[i].cs_mpr);
+			live[n].sl_size = ct.ct_slots[i].cs_val;
+			n++;
+		}
+		qsort(live, n, sizeof (struct snap_live), snap_stack_compare);
 	}
+	free(ct.ct_slots);
+	*live_count = n;
 
-	if (link_chains == 1)
-		build_chains(master);
+	return (live);
+}
+
+static void
+snap_print_stats(FILE *f, struct snap_stats *ss)
+{
+	fprintf(f, "\t\"stats\" : {\n");
+	fprintf(f, "\t\t\"total_allocated_sz\" : %llu,\n",
+	    (unsigned long long)ss->ss_total_allocated);
+	fprintf(f, "\t\t\"total_released_sz\" : %llu,\n",
+	    (unsigned long long)ss->ss_total_released);
+	fprintf(f, "\t\t\"allocs\" : %llu,\n",
+	    (unsigned long long)ss->ss_allocs);
+	fprintf(f, "\t\t\"releases\" : %llu,\n",
+	    (unsigned long long)ss->ss_free);
+	fprintf(f, "\t\t\"reallocs\" : %llu,\n",
+	    (unsigned long long)ss->ss_reallocs);
+	fprintf(f, "\t\t\"max\" : %llu,\n", (unsigned long long)ss->ss_max);
+	fprintf(f, "\t\t\"current\" : %llu\n",
+	    (unsigned long long)ss->ss_current);
+	fprintf(f, "\t},\n");
+}
+
+/*
+ * Writes live buffers grouped by stack id. Each group tells number of
+ * buffers, their total size and the sum of weights (estimate of number
+ * of buffers when stacks are sampled).
+ */
+static void
+snap_print_live(FILE *f, struct snap_live *live, uint64_t n)
+{
+	uint64_t i, count = 0, weight = 0, sz = 0;
+	int first = 1;
 
-	load_syms(master);
-	profile_save(f, master);
+	fprintf(f, "\t\"live\" : [\n");
+	for (i = 0; i < n; i++) {
+		count++;
+		weight += (live[i].sl_weight == 0) ? 1 : live[i].sl_weight;
+		sz += live[i].sl_size;
+		if (i + 1 < n && live[i + 1].sl_stack_id == live[i].sl_stack_id)
+			continue;
+		fprintf(f, "%s\t\t{ \"stack_id\" : %u, \"count\" : %llu, "
+		    "\"size\" : %llu, \"weight\" : %llu }", first ? "" : ",\n",
+		    live[i].sl_stack_id, (unsigned long long)count,
+		    (unsigned long long)sz, (unsigned long long)weight);
+		first = 0;
+		count = weight = sz = 0;
+	}
+	fprintf(f, "\n\t],\n");
+}
+
+int
+mprofile_save_snapshot(FILE *f, struct timespec *ts)
+{
+	struct mprofile_record **snap;
+	struct snap_live *live;
+	struct snap_stats ss = { 0 };
+	uint64_t cut, count, live_count = 0;
+#ifdef	_WITH_STACKTRACE
+	mprofile_stack_t *stack;
+	uint64_t i;
+	int first = 1;
+#endif
+
+	if (stream_limit != 0) {
+		fprintf(stderr, "%s snapshot is not supported in streaming "
+		    "mode\n", __func__);
+		return (-1);
+	}
+
+	pthread_mutex_lock(&snap_mtx);
+	if (saved) {
+		pthread_mutex_unlock(&snap_mtx);
+		return (-1);
+	}
+
+	cut = __atomic_load_n(&mpr_id, __ATOMIC_ACQUIRE);
+	snap = snap_collect(cut, &count);
+	if (snap == NULL) {
+		pthread_mutex_unlock(&snap_mtx);
+		return (-1);
+	}
+	live = snap_replay(snap, count, &ss, &live_count);
+	free(snap);
+	if (live == NULL) {
+		pthread_mutex_unlock(&snap_mtx);
+		return (-1);
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"snapshot_time\" : { %s : %lld, %s : %ld },\n",
+	    MPROFILE_TIME_S, (long long)ts->tv_sec, MPROFILE_TIME_NS,
+	    ts->tv_nsec);
+	fprintf(f, "\t\"annotation\" : \"%s\",\n", mprofile_get_annotation());
+	fprintf(f, "\t\"record_id\" : %llu,\n", (unsigned long long)cut);
+	snap_print_stats(f, &ss);
+	snap_print_live(f, live, live_count);
+
+#ifdef	_WITH_STACKTRACE
+	find_shlibs();
+	load_syms();
+	if (sym_offline)
+		print_modules(f);
+#endif
+	fprintf(f, "\t\"stacks\" : [\n");
+#ifdef	_WITH_STACKTRACE
+	for (i = 0; i < live_count; i++) {
+		if (live[i].sl_stack_id == 0 || (i + 1 < live_count &&
+		    live[i + 1].sl_stack_id == live[i].sl_stack_id))
+			continue;
+		stack = mprofile_find_stack(stset, live[i].sl_stack_id);
+		if (stack == NULL)
+			continue;
+		if (first == 0)
+			fprintf(f, ",\n");
+		first = 0;
+		print_stack(f, stack);
+	}
+#endif
+	fprintf(f, "\n\t]\n}\n");
+
+	pthread_mutex_unlock(&snap_mtx);
+	free(live);
+
+	return (0);
 }
 
 void
-mprofile_init(void)
+mprofile_init(FILE *f)
 {
+	char *format = getenv("MPROFILE_FORMAT");
+	char *stream = getenv("MPROFILE_STREAM_CHUNKS");
+	char *chains = getenv("MPROFILE_CHAINS");
+	char *env;
+
+	if (format != NULL && strcmp(format, "bin") == 0)
+		bin_format = 1;
+
+	if (chains != NULL && strcmp(chains, "tree") == 0)
+		chains_tree = 1;
+
+	init_clock(getenv("MPROFILE_CLOCK"));
+
+	if ((env = getenv("MPROFILE_SAMPLE_BYTES")) != NULL)
+		sample_bytes = strtoull(env, NULL, 10);
+	else if ((env = getenv("MPROFILE_SAMPLE_RATE")) != NULL)
+		sample_rate = strtoull(env, NULL, 10);
+
 	pthread_mutex_init(&mtx, NULL);
 	TAILQ_INIT(&profiles);
+
+#ifdef	_WITH_STACKTRACE
+	if (getenv("MPROFILE_LINES") != NULL)
+		sym_lines = 1;
+	if ((env = getenv("MPROFILE_SYMBOLIZE")) != NULL &&
+	    strcmp(env, "offline") == 0)
+		sym_offline = 1;
+#endif
+
+	/* streaming always uses binary format */
+	if (stream != NULL && atoi(stream) > 0) {
+		bin_format = 1;
+		stream_start(f, atoi(stream));
+	}
+}
+
+#ifdef	_WITH_STACKTRACE
+/*
+ * Called by modes which collect stacks, other modes run without stack
+ * set and without looking at objects on dlclose().
+ */
+void
+mprofile_init_stacks(void)
+{
+	char *env;
+
+	if ((env = getenv("MPROFILE_STACK_SLOTS")) != NULL)
+		stset = mprofile_create_stset(strtoul(env, NULL, 10),
+		    MPR_STACK_ID_MAX);
+	else
+		stset = mprofile_create_stset(MP_STACK_SLOTS, MPR_STACK_ID_MAX);
 }
+#endif
 
 void
 mprofile_done(void)
 {
 	unsigned int	i;
 
-	for (i = 0; i < MAX_SHLIBS; i++)
+	pthread_mutex_lock(&shlib_mtx);
+	for (i = 0; i < shlib_count; i++)
 		free(shlibs[i].shl_name);
+	free(shlibs);
+	shlibs = NULL;
+	shlib_count = shlib_size = shlib_sorted = 0;
+	pthread_mutex_unlock(&shlib_mtx);
 
 #ifdef	_WITH_STACKTRACE
+	sym_cache_free();
 	kelf_close(syms);
+	mprofile_destroy_stset(stset);
+	stset = NULL;
 #endif
 
 	pthread_mutex_destroy(&mtx);
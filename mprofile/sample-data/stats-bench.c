@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2025 <sashan@openssl.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Multi-threaded benchmark of OPENSSL_malloc()/OPENSSL_realloc()/
+ * OPENSSL_free(). Each thread keeps a small working set of buffers and
+ * replaces them in a loop. It prints number of ns per operation, run it
+ * with and without libmprofile.so preloaded to see the overhead.
+ *
+ *	stats-bench [threads] [operations per thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+
+#define	WORKING_SET	64
+
+static unsigned long ops = 1000000;
+
+static void *
+bench_thread(void *arg)
+{
+	void *bufs[WORKING_SET] = { 0 };
+	unsigned int seed = (unsigned int)(unsigned long)arg;
+	unsigned long i;
+	unsigned int j;
+
+	for (i = 0; i < ops; i++) {
+		j = rand_r(&seed) % WORKING_SET;
+		if (bufs[j] == NULL) {
+			bufs[j] = OPENSSL_malloc(16 + rand_r(&seed) % 512);
+		} else if ((i & 3) == 0) {
+			bufs[j] = OPENSSL_realloc(bufs[j],
+			    16 + rand_r(&seed) % 1024);
+		} else {
+			OPENSSL_free(bufs[j]);
+			bufs[j] = NULL;
+		}
+	}
+
+	for (j = 0; j < WORKING_SET; j++)
+		OPENSSL_free(bufs[j]);
+
+	return (NULL);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	pthread_t *threads;
+	struct timespec start, end;
+	unsigned int i, n = 4;
+	double ns;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		ops = strtoul(argv[2], NULL, 10);
+	if (n == 0)
+		n = 1;
+
+	threads = malloc(sizeof (pthread_t) * n);
+	if (threads == NULL)
+		return (1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		pthread_create(&threads[i], NULL, bench_thread,
+		    (void *)(unsigned long)(i + 1));
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("threads %u ops %lu: %.1f ns/op\n", n, ops * n,
+	    ns / (double)(ops * n));
+
+	free(threads);
+
+	return (0);
+}
@@ -16,8 +16,12 @@
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #
 
-import json
+import re
+import array
 import argparse
+import numpy
+import mprofile_bin
+import mprofile_stream
 from jinja2 import Environment, FileSystemLoader
 
 #
@@ -63,6 +67,16 @@ def get_operation(mr):
 def get_stackid(mr):
 	return mr["stack_id"]
 
+#
+# weight tells how many operations the record stands for when
+# stacks were sampled (MPROFILE_SAMPLE_BYTES, MPROFILE_SAMPLE_RATE).
+# It is 0 for records without stack. Older logs come without weight.
+#
+def get_weight(mr):
+	if "weight" in mr:
+		return mr["weight"]
+	return 0 if mr["stack_id"] == 0 else 1
+
 def get_nextid(mr):
 	return mr["next_id"]
 
@@ -84,6 +98,32 @@ def get_trace(st):
 	#
 	return st["stack_trace"][:-1]
 
+#
+# frames which belong to libmprofile.so and to libcrypto allocator,
+# those are skipped when we look for function which allocates memory.
+#
+ALLOC_FRAMES = re.compile(r"^(sample_backtrace|mp_\w+|CRYPTO_(malloc|zalloc|"
+    r"realloc|clear_realloc|free|clear_free|memdup|strdup|strndup|"
+    r"secure_\w+))$")
+
+#
+# returns name of function without offset and source line
+# ("EVP_MD_fetch+0x2a (evp_fetch.c:400)" -> "EVP_MD_fetch")
+#
+def get_function(frame):
+	return frame.split(" ", 1)[0].split("+", 1)[0]
+
+#
+# returns the first function in stack trace which is not part of
+# memory allocator.
+#
+def get_leaf(trace):
+	for frame in trace:
+		fn = get_function(frame)
+		if fn != "" and not ALLOC_FRAMES.match(fn):
+			return fn
+	return "(unknown)"
+
 def time_to_float(tr):
 	return float(tr["s"]) + float(tr["ns"]/1000000000)
 
@@ -129,33 +169,363 @@ class MR:
 	def get_operation(self):
 		return get_operation(self._mr)
 
-class MProfile:
+#
+# records are kept in columns, one numpy array for each field.
+# Column index is record id - 1 once columns are sorted by id.
+#
+STATE_CODES = { "allocated" : 1, "free" : 2, "realloc" : 3 }
+ALLOC = STATE_CODES["allocated"]
+FREE = STATE_CODES["free"]
+REALLOC = STATE_CODES["realloc"]
+
+COLUMNS = [ ("id", "u8"), ("addr", "u8"), ("realloc", "u8"),
+    ("delta", "i8"), ("next_id", "u8"), ("prev_id", "u8"), ("t_ns", "u8"),
+    ("stack_id", "u4"), ("state", "u1"), ("weight", "u4") ]
+
+#
+# numpy view of binary record, see MPB_RECORD in mprofile_bin.py
+#
+MPB_RECORD_DTYPE = numpy.dtype({
+	"names" : [ c for (c, _) in COLUMNS ],
+	"formats" : [ "<" + t for (_, t) in COLUMNS ],
+	"offsets" : [ 0, 8, 16, 24, 32, 40, 48, 56, 60, 64 ],
+	"itemsize" : mprofile_bin.MPB_RECORD.size
+})
+
+class Columns:
+	def __init__(self):
+		self.stacks = {}
+		self.start_time = { "s" : 0, "ns" : 0 }
+		self.annotation = ""
+		for (c, t) in COLUMNS:
+			setattr(self, c, numpy.zeros(0, dtype = t))
+
+	def __len__(self):
+		return len(self.id)
+
+	def sort(self):
+		if len(self.id) == 0 or numpy.all(self.id[1:] > self.id[:-1]):
+			return
+		order = numpy.argsort(self.id, kind = "stable")
+		for (c, _) in COLUMNS:
+			setattr(self, c, getattr(self, c)[order])
+
+#
+# record sections of binary trace are read to numpy directly.
+#
+def load_bin_columns(fname):
+	cols = Columns()
+	chunks = []
+	with open(fname, "rb") as f:
+		bt = mprofile_bin.BinTrace(f)
+		for (sect, it) in bt.sections(raw = True):
+			if sect == mprofile_bin.MPB_RECORDS:
+				chunks.append(numpy.frombuffer(it,
+				    dtype = MPB_RECORD_DTYPE))
+			elif sect == mprofile_bin.MPB_STACKS:
+				for st in it:
+					cols.stacks[st["id"]] = st
+		cols.start_time = bt.start_time
+		cols.annotation = bt.annotation
+	if len(chunks) != 0:
+		recs = numpy.concatenate(chunks)
+		for (c, t) in COLUMNS:
+			setattr(cols, c, recs[c].astype(t))
+	cols.sort()
+	return cols
+
+#
+# .json records are read one by one (see mprofile_stream.py) and
+# appended to compact arrays.
+#
+def load_json_columns(fname):
+	cols = Columns()
+	ts = mprofile_stream.TraceStream(fname)
+	arrays = dict((c, array.array("q")) for (c, _) in COLUMNS)
+	for mr in ts.records():
+		arrays["id"].append(get_id(mr))
+		arrays["addr"].append(get_addr(mr))
+		arrays["realloc"].append(get_realloc(mr))
+		arrays["delta"].append(get_delta_sz(mr))
+		arrays["next_id"].append(get_nextid(mr))
+		arrays["prev_id"].append(get_previd(mr))
+		arrays["t_ns"].append(mr["time"]["s"] * 1000000000 +
+		    mr["time"]["ns"])
+		arrays["stack_id"].append(get_stackid(mr))
+		arrays["state"].append(STATE_CODES.get(get_operation(mr), 0))
+		arrays["weight"].append(get_weight(mr))
+	for (c, t) in COLUMNS:
+		setattr(cols, c, numpy.frombuffer(arrays[c],
+		    dtype = "i8").astype(t))
+	cols.stacks = ts.stacks
+	cols.start_time = ts.start_time
+	cols.annotation = ts.annotation
+	cols.sort()
+	return cols
+
+def load_columns(fname):
+	if mprofile_bin.is_bin_trace(fname):
+		return load_bin_columns(fname)
+	else:
+		return load_json_columns(fname)
+
+#
+# buffers which are allocated at the moment, keyed by address. Each
+# buffer remembers operation which allocated it (origin), its current
+# size and operations done on it (chain). Operation is anything caller
+# uses to identify record (record dictionary, column index). Operations
+# must be added in order of their ids, buffers which remain at the end
+# are leaks. It does not need chains (next_id, prev_id) from trace, so
+# it works for all modes.
+#
+class LiveSet:
+	def __init__(self, keep_chains = False):
+		self._live = {}
+		self._keep_chains = keep_chains
+		self._count = 0
+
+	def add(self, op, state, addr, realloc, delta_sz):
+		if state == ALLOC:
+			if addr != 0:
+				self._live[addr] = [ op, delta_sz,
+				    [ op ] if self._keep_chains else None,
+				    self._count ]
+		elif state == FREE:
+			self._live.pop(addr, None)
+		elif state == REALLOC:
+			buf = self._live.pop(realloc, None)
+			if buf == None:
+				#
+				# buffer allocated before profiling started
+				#
+				buf = [ op, 0, [] if self._keep_chains else None,
+				    self._count ]
+			buf[1] = buf[1] + delta_sz
+			if self._keep_chains:
+				buf[2].append(op)
+			self._live[addr] = buf
+		self._count = self._count + 1
+
 	#
-	# traverse allocation chain back to the first operation
-	# in chain which causes the leak.
+	# returns list of [ origin, size, chain ] sorted by origin.
 	#
-	def __add_leak(self, mr):
-		leak = mr
-		while mr != None:
-			leak = mr
-			mr = self.get_prev(mr)
-		self._leaks.append(leak)
+	def buffers(self):
+		return [ buf[:3] for buf in sorted(self._live.values(),
+		    key = lambda buf : buf[3]) ]
 
-	def __calc_current(self):
-		mem_current = 0
-		index = 0
-		for mr in self._mem_records:
-			mem_current = mem_current + get_delta_sz(mr)
-			set_mem_current(mr, mem_current)
+#
+# allocation site, it is either stack or leaf function (see get_leaf())
+# Values are scaled by weights when stacks are sampled.
+#	allocs	number of operations which allocate memory
+#	total	number of bytes allocated
+#	leaked	bytes still allocated at the end of trace
+#	peak	bytes allocated at the moment when process used the most
+#		memory
+#
+class Site:
+	def __init__(self, name, stack_id, trace):
+		self.name = name
+		self.stack_id = stack_id
+		self.trace = trace
+		self.allocs = 0
+		self.total = 0
+		self.leaked = 0
+		self.peak = 0
+
+	def add(self, site):
+		self.allocs = self.allocs + site.allocs
+		self.total = self.total + site.total
+		self.leaked = self.leaked + site.leaked
+		self.peak = self.peak + site.peak
 
-				
-	def __create_profile(self):
-		return list(map(get_mem_current, self._mem_records))
+#
+# aggregates operations by stack in single pass. Buffer belongs to the
+# stack which allocated it last (realloc moves it to its own stack).
+# Bytes each stack holds at peak are remembered lazily: when global
+# peak moves, epoch is bumped. The first time a stack changes after
+# that (or at the end) its bytes are still the same as they were at
+# the peak.
+#
+class SiteStats:
+	def __init__(self):
+		self._live = {}
+		# stack_id -> [ allocs, total, live, at_peak, epoch ]
+		self._stacks = {}
+		self._current = 0
+		self._peak = None
+		self._epoch = 0
+
+	def __stack(self, stack_id):
+		st = self._stacks.get(stack_id)
+		if st == None:
+			st = [ 0, 0, 0, 0, self._epoch ]
+			self._stacks[stack_id] = st
+		elif st[4] != self._epoch:
+			st[3] = st[2]
+			st[4] = self._epoch
+		return st
+
+	def __release(self, addr):
+		buf = self._live.pop(addr, None)
+		if buf == None:
+			return 0
+		(sz, stack_id, weight) = buf
+		st = self.__stack(stack_id)
+		st[2] = st[2] - sz * weight
+		return sz
+
+	def add(self, state, addr, realloc, delta_sz, stack_id, weight):
+		if state == FREE:
+			self.__release(addr)
+		elif state == ALLOC or state == REALLOC:
+			sz = delta_sz
+			if state == REALLOC:
+				sz = sz + self.__release(realloc)
+			st = self.__stack(stack_id)
+			if addr != 0:
+				self._live[addr] = (sz, stack_id, weight)
+				st[2] = st[2] + sz * weight
+			if delta_sz > 0:
+				st[0] = st[0] + weight
+				st[1] = st[1] + delta_sz * weight
+
+		self._current = self._current + delta_sz
+		if self._peak == None or self._current > self._peak:
+			self._peak = self._current
+			self._epoch = self._epoch + 1
 
 	#
-	# retrieve a record chain for allocation record ar.
+	# returns sites for stacks, get_trace_by_id(stack_id) returns
+	# trace for stack.
+	#
+	def sites(self, get_trace_by_id):
+		sites = []
+		for (stack_id, st) in self._stacks.items():
+			if st[4] != self._epoch:
+				st[3] = st[2]
+			if stack_id == 0 or st[0] == 0 and st[2] == 0 and \
+			    st[3] == 0:
+				continue
+			trace = get_trace_by_id(stack_id)
+			site = Site("{0} (stack {1})".format(get_leaf(trace),
+			    stack_id), stack_id, trace)
+			(site.allocs, site.total, site.leaked, site.peak) = \
+			    st[0:4]
+			sites.append(site)
+		return sites
+
+#
+# sums sites by leaf function.
+#
+def leaf_sites(sites):
+	leaves = {}
+	for site in sites:
+		leaf = get_leaf(site.trace)
+		if leaf not in leaves:
+			leaves[leaf] = Site(leaf, 0, [])
+		leaves[leaf].add(site)
+	return list(leaves.values())
+
+SITE_KEYS = [ "leaked", "total", "allocs", "peak" ]
+
+#
+# returns n sites with highest value of key, the other keys break ties.
+#
+def top_sites(sites, key, n):
+	keys = [ key ] + [ k for k in SITE_KEYS if k != key ]
+	return sorted(sites, key = lambda site :
+	    [ getattr(site, k) for k in keys ], reverse = True)[:n]
+
+FOLDED_WEIGHTS = SITE_KEYS + [ "count" ]
+
+#
+# returns folded stacks (frames from root to leaf separated by ';')
+# and their weights. Weight is one of site values (see Site) or
+# "count", which is stack_count found in stacks table. Frames are
+# function names without offsets. Frames of allocator and end of trace
+# marker are left out, so stacks which differ there only are merged.
+#
+def folded_stacks(mp, weight):
+	values = []
+	if weight == "count":
+		for st in mp.get_stacks():
+			values.append((get_trace(st), st["stack_count"]))
+	else:
+		for site in mp.sites():
+			values.append((site.trace, getattr(site, weight)))
+
+	folded = {}
+	for (trace, value) in values:
+		if value <= 0:
+			continue
+		frames = list(trace)
+		while len(frames) > 0 and ALLOC_FRAMES.match(
+		    get_function(frames[0])):
+			frames.pop(0)
+		while len(frames) > 0 and frames[-1] in [ "", "0x0" ]:
+			frames.pop()
+		if len(frames) == 0:
+			frames = [ "(unknown)" ]
+		line = ";".join(map(lambda fr :
+		    get_function(fr).replace(";", ":"), reversed(frames)))
+		folded[line] = folded.get(line, 0) + value
+	return folded
+
+#
+# lays out flame graph from folded stacks. Returns list of frames
+# (x, depth, width, name, value) and depth of the deepest frame. Root
+# is at depth 0, children are ordered by name. Frames narrower than
+# min_width are left out together with their children.
+#
+def flame_frames(folded, width, min_width):
+	root = [ "all", 0, {} ]
+	for (line, value) in folded.items():
+		node = root
+		node[1] = node[1] + value
+		for fn in line.split(";"):
+			if fn not in node[2]:
+				node[2][fn] = [ fn, 0, {} ]
+			node = node[2][fn]
+			node[1] = node[1] + value
+
+	frames = []
+	max_depth = 0
+	if root[1] == 0:
+		return (frames, max_depth)
+	scale = float(width) / root[1]
+	todo = [ (root, 0.0, 0) ]
+	while len(todo) > 0:
+		(node, x, depth) = todo.pop()
+		if node[1] * scale < min_width:
+			continue
+		frames.append((x, depth, node[1] * scale, node[0], node[1]))
+		max_depth = max(max_depth, depth)
+		for child in sorted(node[2].values(), key = lambda c : c[0]):
+			todo.append((child, x, depth + 1))
+			x = x + child[1] * scale
+	return (frames, max_depth)
+
+#
+# warm colors derived from frame name, so the same function has the
+# same color everywhere in graph.
+#
+def flame_color(name):
+	h = 0
+	for ch in get_function(name):
+		h = (h * 31 + ord(ch)) & 0xffffff
+	return "rgb({0},{1},{2})".format(205 + h % 50, (h >> 8) % 230,
+	    (h >> 16) % 55)
+
+class MProfile:
+	#
+	# retrieve a record chain for allocation record ar. Chains
+	# of leaks are known even if trace comes without chains.
 	#
 	def get_chain(self, ar):
+		self.leaks()
+		if get_id(ar) in self._leak_info:
+			return list(map(self.__record,
+			    self._leak_info[get_id(ar)][1]))
 		chain = []
 		chain.append(ar)
 		while get_nextid(ar) != 0:
@@ -164,61 +534,92 @@ class MProfile:
 		return chain
 
 	#
-	# constructor receives a json data. json data is dictionary
-	# which holds two lists:
-	#	allocations (list of memory records (operations)
-	#	stacks list of stack traces
+	# constructor receives records loaded to columns by
+	# load_columns().
 	#
-	def __init__(self, json_data):
+	def __init__(self, cols):
 		self._leaks = None
-		self._mem_records = json_data["allocations"]
-		for mr in self._mem_records:
-			set_mem_current(mr, 0)
-		self._stacks = json_data["stacks"]
-		#
-		# call stacks in json data are dump of RB-tree,
-		# we need to sort the array/list by 'id'
-		#
-		self._stacks.sort(key = lambda x : x["id"])
-		self._start_time = time_to_float(json_data["start_time"])
-		self.__calc_current()
+		self._leak_info = {}
+		self._sites = None
+		self._cols = cols
+		self._stacks = cols.stacks
+		self._start_ns = cols.start_time["s"] * 1000000000 + \
+		    cols.start_time["ns"]
+		self._mem_current = numpy.cumsum(cols.delta, dtype = "i8")
 		self._samples = None
 
+	#
+	# builds record dictionary for column index i, so functions
+	# above and templates work with it as with record from .json
+	#
+	def __record(self, i):
+		c = self._cols
+		t_ns = int(c.t_ns[i])
+		mr = {
+			"id" : int(c.id[i]),
+			"addr" : int(c.addr[i]),
+			"realloc" : int(c.realloc[i]),
+			"delta_sz" : int(c.delta[i]),
+			"state" : mprofile_bin.STATES.get(int(c.state[i]), "???"),
+			"next_id" : int(c.next_id[i]),
+			"prev_id" : int(c.prev_id[i]),
+			"stack_id" : int(c.stack_id[i]),
+			"weight" : int(c.weight[i]),
+			"time" : {
+				"s" : t_ns // 1000000000,
+				"ns" : t_ns % 1000000000
+			}
+		}
+		set_mem_current(mr, int(self._mem_current[i]))
+		return mr
+
+	def __records(self, mask):
+		return map(self.__record, numpy.flatnonzero(mask))
+
 	#
 	# count allocation failures
 	#
 	def alloc_failures(self):
-		return filter(
-		    lambda x: True if is_alloc(x) and get_addr(x) == 0
-			else False,
-		    self._mem_records)
+		c = self._cols
+		return self.__records((c.state == ALLOC) & (c.addr == 0))
 
 	#
 	# count reallocation failures
 	#
 	def realloc_failures(self):
-		return filter(
-		    lambda x: True if is_realloc(x) and get_addr(x) == 0 and \
-			get_size(x) > 0 else False, self._mem_records)
-
-	def is_leak(self, mr):
-		if not is_alloc(mr):
-			return False
+		c = self._cols
+		return self.__records((c.state == REALLOC) & (c.addr == 0) &
+		    (c.delta > 0))
 
-		next_mr = self.get_mr(get_nextid(mr))
-		while next_mr != None:
-			mr = next_mr
-			next_mr = self.get_mr(get_nextid(mr))
+	#
+	# single pass over records finds buffers which are not released
+	# at the end, see LiveSet.
+	#
+	def __find_leaks(self):
+		c = self._cols
+		live = LiveSet(keep_chains = True)
+		for (i, state, addr, realloc, delta_sz) in zip(
+		    range(0, len(c)), c.state.tolist(), c.addr.tolist(),
+		    c.realloc.tolist(), c.delta.tolist()):
+			live.add(i, state, addr, realloc, delta_sz)
+
+		self._leaks = []
+		self._leak_info = {}
+		for (origin, leak_sz, chain) in live.buffers():
+			leak = self.__record(origin)
+			self._leaks.append(leak)
+			self._leak_info[get_id(leak)] = (leak_sz, chain)
 
-		return not is_free(mr)
+	def is_leak(self, mr):
+		self.leaks()
+		return get_id(mr) in self._leak_info
 
 	#
 	# return list of memory leaks
 	#
 	def leaks(self):
 		if self._leaks == None:
-			leaks = filter(self.is_leak, self._mem_records)
-			self._leaks = list(leaks)
+			self.__find_leaks()
 
 		return self._leaks
 
@@ -226,56 +627,44 @@ class MProfile:
 	# return the size of given memory leak
 	#
 	def get_leak_sz(self, leak_mr):
-		leak_sz = get_delta_sz(leak_mr)
-		next_mr = self.get_next(leak_mr)
-		while next_mr != None:
-			leak_mr = next_mr
-			leak_sz = leak_sz + get_delta_sz(leak_mr)
-			next_mr = self.get_next(leak_mr)
-		return leak_sz
+		self.leaks()
+		return self._leak_info[get_id(leak_mr)][0]
 
 	#
 	# return list of allocation operations
 	#
 	def alloc_ops(self):
-		return filter(
-		    lambda x: True if is_alloc(x) and get_addr(x) != 0
-			else False,
-		    self._mem_records)
+		c = self._cols
+		return self.__records((c.state == ALLOC) & (c.addr != 0))
 
 	#
 	# return list of reallocation operations
 	#
 	def realloc_ops(self):
-		return filter(
-		    lambda x: True if is_realloc(x) and get_addr(x) != 0
-			else False,
-		    self._mem_records)
+		c = self._cols
+		return self.__records((c.state == REALLOC) & (c.addr != 0))
 
 	#
 	# return list of all free (release) operations
 	#
 	def release_ops(self):
-		f = filter(
-		    lambda x: True if is_free(x) and get_addr(x) != 0
-			else False,
-		    self._mem_records)
+		c = self._cols
+		return self.__records((c.state == FREE) & (c.addr != 0))
 
 	def all_ops(self):
 		if self._samples != None:
-			return self._samples
+			return list(map(self.__record, self._samples))
 		else:
-			return self._mem_records
+			return list(map(self.__record, range(0, len(self._cols))))
 
 	#
 	# get memory record for given id. returns None when
 	# id not found
 	# 
 	def get_mr(self, op_id):
-		if op_id < 1 or op_id > len(self._mem_records):
+		if op_id < 1 or op_id > len(self._cols):
 			return None
-		op_id = op_id - 1
-		return self._mem_records[op_id]
+		return self.__record(op_id - 1)
 
 	#
 	# get callstack for given memory record
@@ -283,7 +672,30 @@ class MProfile:
 	def get_stack(self, mr):
 		if mr == None or get_stackid(mr) == 0:
 			return None
-		return get_trace(self._stacks[get_stackid(mr) - 1])
+		return get_trace(self._stacks[get_stackid(mr)])
+
+	def get_trace_by_id(self, stack_id):
+		if stack_id not in self._stacks:
+			return []
+		return get_trace(self._stacks[stack_id])
+
+	def get_stacks(self):
+		return self._stacks.values()
+
+	#
+	# returns allocation sites (stacks), see SiteStats.
+	#
+	def sites(self):
+		if self._sites != None:
+			return self._sites
+		c = self._cols
+		ss = SiteStats()
+		for (state, addr, realloc, delta_sz, stack_id, weight) in zip(
+		    c.state.tolist(), c.addr.tolist(), c.realloc.tolist(),
+		    c.delta.tolist(), c.stack_id.tolist(), c.weight.tolist()):
+			ss.add(state, addr, realloc, delta_sz, stack_id, weight)
+		self._sites = ss.sites(self.get_trace_by_id)
+		return self._sites
 
 	#
 	# get next link in memory lifecycle chain
@@ -307,79 +719,207 @@ class MProfile:
 	# calculate total number of bytes allocated
 	#
 	def get_total_mem(self):
-		alloc_sz = sum(map(lambda mr: 0 if get_delta_sz(mr) < 0 \
-		    else get_delta_sz(mr), self._mem_records))
-		return alloc_sz
+		delta = self._cols.delta
+		return int(delta[delta > 0].sum())
+
+	#
+	# returns True when stacks were collected for sample of
+	# operations only.
+	#
+	def is_sampled(self):
+		return bool((self._cols.weight > 1).any())
+
+	#
+	# estimate total number of bytes allocated from sampled
+	# records. Each sample is scaled up by its weight.
+	#
+	def get_sampled_mem(self):
+		c = self._cols
+		alloc = c.delta > 0
+		return int((c.delta[alloc] * c.weight[alloc]).sum())
+
+	#
+	# estimate number of operations which allocate memory from
+	# sampled records.
+	#
+	def get_sampled_allocs(self):
+		c = self._cols
+		return int(c.weight[c.delta > 0].sum())
 
 	#
 	# calculate total number of operations (malloc/realloc)
 	# which allocate memory
 	#
 	def get_total_allocs(self):
-		alloc_ops = sum(map(lambda mr: 1 if get_delta_sz(mr) > 0 else 0,
-		    self._mem_records))
-		return alloc_ops
+		return int(numpy.count_nonzero(self._cols.delta > 0))
+
+	def __indices(self):
+		if self._samples == None:
+			return slice(None)
+		else:
+			return self._samples
 
 	#
 	# returns a memory profile which is list of memory allocated
 	# at exact point of application lifetime
 	#
 	def get_profile(self):
-		mem_records = None
-		if self._samples == None:
-			mem_records = self._mem_records
-		else:
-			mem_records = self._samples
-
-		return [ 0 ] + \
-		    list(map(lambda mr: get_mem_current(mr), mem_records))
-
+		return [ 0 ] + self._mem_current[self.__indices()].tolist()
 
 	def get_time_axis(self):
-		t = [ float(0) ]
-		mem_records = None
-		if self._samples == None:
-			mem_records = self._mem_records
-		else:
-			mem_records = self._samples
-
-		for mr in mem_records:
-			t.append((get_timef(mr) - self._start_time) * 1000000)
-
-		return t
+		t_ns = self._cols.t_ns[self.__indices()].astype("i8")
+		return [ float(0) ] + ((t_ns - self._start_ns) / 1000).tolist()
 
 	def get_time(self, mr):
-		return (get_timef(mr) - self._start_time) * 1000000
+		t_ns = mr["time"]["s"] * 1000000000 + mr["time"]["ns"]
+		return (t_ns - self._start_ns) / 1000
 
 	def get_mem_peak(self):
-		return max(self._mem_records,
-		    key = lambda k : get_mem_current(k))	
+		if len(self._cols) == 0:
+			return None
+		return self.__record(int(numpy.argmax(self._mem_current)))
 
+	#
+	# keeps record with highest memory use from each slice
+	# of slice_size records.
+	#
 	def samples(self, samples_count):
-		slice_size = int(len(self._mem_records)/samples_count)
+		n = len(self._cols)
+		slice_size = int(n / samples_count)
 		if slice_size == 0:
 			self._samples = None
 			return
-		mem_slices = [ self._mem_records[i : i + slice_size ]
-		    for i in range(0, len(self._mem_records), slice_size) ]
-		self._samples = list(map(
-		    lambda x: max(x, key = lambda k : get_mem_current(k)),
-		    mem_slices))
+		full = n // slice_size
+		mc = self._mem_current
+		samples = numpy.argmax(mc[:full * slice_size].reshape(full,
+		    slice_size), axis = 1) + numpy.arange(0, full * slice_size,
+		    slice_size)
+		if full * slice_size < n:
+			samples = numpy.append(samples, full * slice_size +
+			    numpy.argmax(mc[full * slice_size:]))
+		self._samples = samples.tolist()
 
 	def check(self):
-		import pdb;pdb.set_trace()
-		test = 1
-		for mr in self._mem_records:
-			if get_id(mr) != test:
-				print("Expected {0} for {1}".format(test,
-				    get_id(mr)))
-			test = test + 1
+		ids = self._cols.id
+		expected = numpy.arange(1, len(ids) + 1, dtype = ids.dtype)
+		for i in numpy.flatnonzero(ids != expected):
+			print("Expected {0} for {1}".format(int(expected[i]),
+			    int(ids[i])))
+
+#
+# computes the same results as MProfile in single pass over the trace.
+# Records are not kept, memory is bounded by number of buffers which
+# are live at the end of trace and by number of unique stacks.
+#
+class StreamProfile:
+	def __init__(self, fname, keep_chains = False, sites = False):
+		self._trace = mprofile_stream.TraceStream(fname)
+		self._total_mem = 0
+		self._total_allocs = 0
+		self._sampled_mem = 0
+		self._sampled_allocs = 0
+		self._sampled = False
+		self._peak = None
+		live = LiveSet(keep_chains)
+		ss = SiteStats() if sites else None
+
+		mem_current = 0
+		peak_sz = None
+		for mr in self._trace.records():
+			delta_sz = get_delta_sz(mr)
+			mem_current = mem_current + delta_sz
+			if peak_sz == None or mem_current > peak_sz:
+				peak_sz = mem_current
+				self._peak = mr
+				set_mem_current(mr, mem_current)
+			if delta_sz > 0:
+				weight = get_weight(mr)
+				self._total_mem = self._total_mem + delta_sz
+				self._total_allocs = self._total_allocs + 1
+				self._sampled_mem = self._sampled_mem + \
+				    delta_sz * weight
+				self._sampled_allocs = self._sampled_allocs + \
+				    weight
+			if get_weight(mr) > 1:
+				self._sampled = True
+			state = STATE_CODES.get(get_operation(mr), 0)
+			live.add(mr, state, get_addr(mr), get_realloc(mr),
+			    delta_sz)
+			if ss != None:
+				ss.add(state, get_addr(mr), get_realloc(mr),
+				    delta_sz, get_stackid(mr), get_weight(mr))
+
+		self._leaks = []
+		self._leak_info = {}
+		for buf in live.buffers():
+			self._leaks.append(buf[0])
+			self._leak_info[get_id(buf[0])] = buf
+		self._start_time = time_to_float(self._trace.start_time)
+		self._sites = [] if ss == None else \
+		    ss.sites(self.get_trace_by_id)
+
+	def leaks(self):
+		return self._leaks
+
+	def get_leak_sz(self, leak_mr):
+		return self._leak_info[get_id(leak_mr)][1]
+
+	#
+	# chain is known for leaks only and only when profile
+	# was created with keep_chains.
+	#
+	def get_chain(self, ar):
+		buf = self._leak_info.get(get_id(ar))
+		if buf == None or buf[2] == None:
+			return [ ar ]
+		return buf[2]
+
+	def get_stack(self, mr):
+		if mr == None or get_stackid(mr) == 0:
+			return None
+		return get_trace(self._trace.stacks[get_stackid(mr)])
+
+	def get_trace_by_id(self, stack_id):
+		if stack_id not in self._trace.stacks:
+			return []
+		return get_trace(self._trace.stacks[stack_id])
+
+	def get_stacks(self):
+		return self._trace.stacks.values()
+
+	def sites(self):
+		return self._sites
+
+	def get_total_mem(self):
+		return self._total_mem
+
+	def get_total_allocs(self):
+		return self._total_allocs
+
+	def is_sampled(self):
+		return self._sampled
+
+	def get_sampled_mem(self):
+		return self._sampled_mem
+
+	def get_sampled_allocs(self):
+		return self._sampled_allocs
+
+	def get_time(self, mr):
+		return (get_timef(mr) - self._start_time) * 1000000
+
+	#
+	# returns record at which memory use was highest, None for
+	# empty trace.
+	#
+	def get_mem_peak(self):
+		return self._peak
 
 def create_parser():
 	parser = argparse.ArgumentParser()
 	parser.add_argument("json_file",
 	    type = str,
-	    help = "mprofile json data")
+	    help = "mprofile json data (or binary trace)")
 	parser.add_argument("-v", "--verbose", action = "store_true")
 	parser.add_argument("-l", "--leaks", help = "report memory leaks",
 	    action = "store_true")
@@ -394,6 +934,20 @@ def create_parser():
 	parser.add_argument("-r", "--samples",
 	    help = "reduce the set of events for html output",
 	    default = "0")
+	parser.add_argument("-s", "--sites",
+	    help = "report top allocation sites by stack and by function",
+	    action = "store_true")
+	parser.add_argument("-n", "--top", type = int, default = 20,
+	    help = "number of allocation sites to report")
+	parser.add_argument("-k", "--sort", choices = SITE_KEYS,
+	    default = "leaked", help = "sort allocation sites by")
+	parser.add_argument("-F", "--folded",
+	    help = "write folded stacks to file", nargs = 1)
+	parser.add_argument("-G", "--flamegraph",
+	    help = "write flame graph to .svg or .html file", nargs = 1)
+	parser.add_argument("-w", "--weight", choices = FOLDED_WEIGHTS,
+	    default = "total",
+	    help = "weight of stacks in folded stacks and flame graph")
 	parser.add_argument("-c", "--check",
 	    help = "check the source data and report errors",
 	    default = "store_true")
@@ -423,8 +977,68 @@ def report_leaks(mp, parser_args):
 def report_mem_total(mp, parser_args):
 	print("Total memory allocated: {0} in {1} operations".format(
 	    mp.get_total_mem(), mp.get_total_allocs()))
+	if mp.is_sampled():
+		print("Estimated from stack samples: {0} in {1} operations".format(
+		    mp.get_sampled_mem(), mp.get_sampled_allocs()))
 	return
 
+def print_sites(title, sites, frames):
+	print(title)
+	print("{0:>12} {1:>12} {2:>12} {3:>10}  {4}".format("leaked",
+	    "peak", "total", "allocs", "site"))
+	for site in sites:
+		print("{0:12d} {1:12d} {2:12d} {3:10d}  {4}".format(
+		    site.leaked, site.peak, site.total, site.allocs, site.name))
+		for frame in site.trace[:frames]:
+			print("{0:>50}  {1}".format("", frame))
+
+def report_sites(mp, parser_args):
+	sites = mp.sites()
+	if len(sites) == 0:
+		print("There are no stacks in trace")
+		return
+
+	n = parser_args.top
+	key = parser_args.sort
+	print_sites("Top {0} stacks by {1}:".format(n, key),
+	    top_sites(sites, key, n), 1000 if parser_args.verbose else 0)
+	print_sites("Top {0} functions by {1}:".format(n, key),
+	    top_sites(leaf_sites(sites), key, n), 0)
+	return
+
+def report_folded(mp, parser_args):
+	folded = folded_stacks(mp, parser_args.weight)
+	f = open(parser_args.folded[0], mode = "w", encoding = "utf-8")
+	for line in sorted(folded):
+		f.write("{0} {1}\n".format(line, folded[line]))
+	f.close()
+
+def report_flamegraph(mp, parser_args):
+	width = 1200
+	frame_height = 16
+	units = { "count" : "stacks", "allocs" : "allocations" }
+	(frames, max_depth) = flame_frames(folded_stacks(mp,
+	    parser_args.weight), width - 20, 0.5)
+
+	e = Environment(loader = FileSystemLoader("templates/"))
+	if parser_args.flamegraph[0].endswith(".html"):
+		t = e.get_template("flamegraph.html")
+	else:
+		t = e.get_template("flamegraph.svg")
+	context = {
+		"title" : parser_args.title,
+		"weight" : parser_args.weight,
+		"unit" : units.get(parser_args.weight, "bytes"),
+		"frames" : frames,
+		"width" : width,
+		"frame_height" : frame_height,
+		"height" : (max_depth + 1) * frame_height + 60,
+		"color" : flame_color
+	}
+	f = open(parser_args.flamegraph[0], mode = "w", encoding = "utf-8")
+	f.write(t.render(context))
+	f.close()
+
 def report_to_html(mp, parser_args):
 	e = Environment(loader = FileSystemLoader("templates/"))
 	t = e.get_template("mprofile.html")
@@ -437,7 +1051,12 @@ def report_to_html(mp, parser_args):
 		"mp" : mp,
 		"MR" : MR,
 		"leak_count" : len(mp.leaks()),
-		"lost_bytes" : sum(map(lambda x: mp.get_leak_sz(x), mp.leaks()))
+		"lost_bytes" : sum(map(lambda x: mp.get_leak_sz(x), mp.leaks())),
+		"site_key" : parser_args.sort,
+		"stack_sites" : top_sites(mp.sites(), parser_args.sort,
+		    parser_args.top),
+		"leaf_sites" : top_sites(leaf_sites(mp.sites()),
+		    parser_args.sort, parser_args.top)
 	}
 	f = open(parser_args.output[0], mode = "w", encoding = "utf-8")
 	f.write(t.render(context))
@@ -449,9 +1068,15 @@ if __name__ == "__main__":
 	if args.json_file == None:
 		parser.usage()
 
-	j = json.load(open(args.json_file))
-
-	mp = MProfile(j)
+	#
+	# html report and check need all records, text reports are
+	# computed while trace is read.
+	#
+	if args.output or args.check == True:
+		mp = MProfile(load_columns(args.json_file))
+	else:
+		mp = StreamProfile(args.json_file, keep_chains = args.verbose,
+		    sites = args.sites or args.folded or args.flamegraph)
 
 	if args.check == True:
 		mp.check()
@@ -465,5 +1090,15 @@ if __name__ == "__main__":
 		if args.leaks:
 			report_leaks(mp, args)
 
+		if args.sites:
+			report_sites(mp, args)
+
 		if args.max:
-			print(get_mem_current(mp.get_mem_peak()))
+			peak = mp.get_mem_peak()
+			print(0 if peak == None else get_mem_current(peak))
+
+	if args.folded:
+		report_folded(mp, args)
+
+	if args.flamegraph:
+		report_flamegraph(mp, args)
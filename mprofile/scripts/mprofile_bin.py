@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+
+#
+# Copyright (c) 2025 <sashan@openssl.org>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Reader for binary traces written by libmprofile.so when
+# MPROFILE_FORMAT=bin is set. The format is described in record.c.
+# When run as script it converts binary trace to .json which
+# is understood by mprofile.py.
+#
+
+import sys
+import json
+import struct
+import argparse
+
+MPB_MAGIC = b"MPRB"
+MPB_VERSION = 2
+
+MPB_END = 0
+MPB_ANNOTATION = 1
+MPB_RECORDS = 2
+MPB_STACKS = 3
+MPB_MERGE_TIME = 4
+MPB_CHAINS_TIME = 5
+MPB_MODULES = 6
+MPB_STACKS_DROPPED = 7
+
+MPB_F_CHAINS = 1
+MPB_F_STACKS = 2
+MPB_F_UNSORTED = 4
+
+MPB_HDR = struct.Struct("<4sIIIqIIII")
+MPB_SECTION = struct.Struct("<II")
+MPB_RECORD = struct.Struct("<QQQqQQQIB3xI4x")
+MPB_STACK = struct.Struct("<IIQI")
+MPB_FRAME_LEN = struct.Struct("<H")
+MPB_MODULE = struct.Struct("<QQQH")
+
+STATES = { 1 : "allocated", 2 : "free", 3 : "realloc" }
+
+def is_bin_trace(fname):
+	with open(fname, "rb") as f:
+		return f.read(len(MPB_MAGIC)) == MPB_MAGIC
+
+class BinTrace:
+	#
+	# reads the header, sections are read on demand by
+	# sections() generator.
+	#
+	def __init__(self, f):
+		self._f = f
+		hdr = f.read(MPB_HDR.size)
+		if len(hdr) != MPB_HDR.size:
+			raise ValueError("short read of header")
+		(magic, version, rec_sz, flags, start_s, start_ns, chunks,
+		    chunk_records, _) = MPB_HDR.unpack(hdr)
+		if magic != MPB_MAGIC:
+			raise ValueError("not a binary mprofile trace")
+		if version != MPB_VERSION:
+			raise ValueError("unsupported version {0}".format(
+			    version))
+		if rec_sz != MPB_RECORD.size:
+			raise ValueError("unexpected record size {0}".format(
+			    rec_sz))
+		self.flags = flags
+		self.start_time = { "s" : start_s, "ns" : start_ns }
+		self.chunks = chunks
+		self.chunk_records = chunk_records
+		self.annotation = ""
+		self.merge_usec = 0
+		self.chains_usec = 0
+		self.stacks_dropped = 0
+		self.modules = None
+
+	def __read(self, sz):
+		buf = self._f.read(sz)
+		if len(buf) != sz:
+			raise ValueError("truncated trace")
+		return buf
+
+	def __records(self, count):
+		buf = self.__read(count * MPB_RECORD.size)
+		for (mr_id, addr, realloc, delta_sz, next_id, prev_id, t,
+		    stack_id, state, weight) in MPB_RECORD.iter_unpack(buf):
+			yield {
+				"id" : mr_id,
+				"addr" : addr,
+				"realloc" : realloc,
+				"delta_sz" : delta_sz,
+				"state" : STATES.get(state, "???"),
+				"next_id" : next_id,
+				"prev_id" : prev_id,
+				"stack_id" : stack_id,
+				"weight" : weight,
+				"time" : {
+					"s" : t // 1000000000,
+					"ns" : t % 1000000000
+				}
+			}
+
+	def __stacks(self, count):
+		for i in range(0, count):
+			(st_id, st_count, thread_id, depth) = MPB_STACK.unpack(
+			    self.__read(MPB_STACK.size))
+			trace = []
+			for j in range(0, depth):
+				(l, ) = MPB_FRAME_LEN.unpack(
+				    self.__read(MPB_FRAME_LEN.size))
+				trace.append(self.__read(l).decode(
+				    errors = "replace"))
+			#
+			# .json data always come with empty string
+			# at the end of stack_trace.
+			#
+			trace.append("")
+			yield {
+				"id" : st_id,
+				"stack_count" : st_count,
+				"thread_id" : thread_id,
+				"stack_trace" : trace
+			}
+
+	#
+	# objects loaded to process, written with
+	# MPROFILE_SYMBOLIZE=offline
+	#
+	def __modules(self, count):
+		modules = []
+		for i in range(0, count):
+			(base, start, end, id_len) = MPB_MODULE.unpack(
+			    self.__read(MPB_MODULE.size))
+			build_id = self.__read(id_len).hex()
+			(l, ) = MPB_FRAME_LEN.unpack(
+			    self.__read(MPB_FRAME_LEN.size))
+			modules.append({
+				"path" : self.__read(l).decode(
+				    errors = "replace"),
+				"build_id" : build_id,
+				"base" : base,
+				"start" : start,
+				"end" : end
+			})
+		return modules
+
+	#
+	# generator yields tuples (section_type, iterator) where
+	# iterator walks through records or stacks found in section.
+	# The iterator must be consumed before next section is read.
+	# With raw records come as bytes instead of iterator.
+	#
+	def sections(self, raw = False):
+		while True:
+			(sect, count) = MPB_SECTION.unpack(
+			    self.__read(MPB_SECTION.size))
+			if sect == MPB_END:
+				return
+			elif sect == MPB_ANNOTATION:
+				self.annotation = self.__read(count).decode(
+				    errors = "replace")
+			elif sect == MPB_MERGE_TIME:
+				self.merge_usec = count
+			elif sect == MPB_CHAINS_TIME:
+				self.chains_usec = count
+			elif sect == MPB_MODULES:
+				self.modules = self.__modules(count)
+			elif sect == MPB_STACKS_DROPPED:
+				self.stacks_dropped = count
+			elif sect == MPB_RECORDS and raw:
+				yield (sect, self.__read(count * MPB_RECORD.size))
+			elif sect == MPB_RECORDS:
+				yield (sect, self.__records(count))
+			elif sect == MPB_STACKS:
+				yield (sect, self.__stacks(count))
+			else:
+				raise ValueError("unknown section {0}".format(
+				    sect))
+
+#
+# loads the whole binary trace to dictionary which looks
+# the same as the one we get from json.load() on .json trace.
+#
+def load_bin(fname):
+	with open(fname, "rb") as f:
+		bt = BinTrace(f)
+		allocations = []
+		stacks = []
+		for (sect, it) in bt.sections():
+			if sect == MPB_RECORDS:
+				allocations.extend(it)
+			elif sect == MPB_STACKS:
+				stacks.extend(it)
+		#
+		# records written in streaming mode come in order
+		# in which threads handed them to writer.
+		#
+		if bt.flags & MPB_F_UNSORTED:
+			allocations.sort(key = lambda x : x["id"])
+		trace = {
+			"start_time" : bt.start_time,
+			"annotation" : bt.annotation,
+			"chunks" : bt.chunks,
+			"chunk_records" : bt.chunk_records,
+			"merge_usec" : bt.merge_usec,
+			"chains_usec" : bt.chains_usec,
+			"stacks_dropped" : bt.stacks_dropped
+		}
+		if bt.modules is not None:
+			trace["modules"] = bt.modules
+		trace["allocations"] = allocations
+		trace["stacks"] = stacks
+		return trace
+
+#
+# converts binary trace to .json without holding all records in memory.
+# records must go first in json, this matches the order in which sections
+# are stored in binary trace. Records from streaming mode must be sorted,
+# so those are loaded to memory.
+#
+def bin_to_json(fname, out):
+	with open(fname, "rb") as f:
+		bt = BinTrace(f)
+		if bt.flags & MPB_F_UNSORTED:
+			json.dump(load_bin(fname), out)
+			return
+		first = True
+		in_stacks = False
+		out.write("{{ \"start_time\" : {0},\n".format(
+		    json.dumps(bt.start_time)))
+		out.write("  \"allocations\" : [\n")
+		for (sect, it) in bt.sections():
+			if sect == MPB_STACKS and not in_stacks:
+				out.write("\n],\n \"stacks\" : [\n")
+				in_stacks = True
+				first = True
+			for item in it:
+				if not first:
+					out.write(",\n")
+				first = False
+				out.write("\t" + json.dumps(item))
+		if not in_stacks:
+			out.write("\n],\n \"stacks\" : [\n")
+		out.write("\n],\n")
+		out.write("  \"annotation\" : {0},\n".format(
+		    json.dumps(bt.annotation)))
+		out.write("  \"chunks\" : {0},\n".format(bt.chunks))
+		out.write("  \"chunk_records\" : {0},\n".format(
+		    bt.chunk_records))
+		out.write("  \"merge_usec\" : {0},\n".format(bt.merge_usec))
+		out.write("  \"stacks_dropped\" : {0},\n".format(
+		    bt.stacks_dropped))
+		if bt.modules is not None:
+			out.write("  \"modules\" : {0},\n".format(
+			    json.dumps(bt.modules)))
+		out.write("  \"chains_usec\" : {0}\n".format(bt.chains_usec))
+		out.write("}\n")
+
+def create_parser():
+	parser = argparse.ArgumentParser(
+	    description = "convert binary mprofile trace to json")
+	parser.add_argument("bin_file",
+	    type = str,
+	    help = "binary trace written with MPROFILE_FORMAT=bin")
+	parser.add_argument("-o", "--output", help = "write json to file",
+	    nargs = 1)
+
+	return parser
+
+if __name__ == "__main__":
+	parser = create_parser()
+	args = parser.parse_args()
+
+	if args.output:
+		out = open(args.output[0], mode = "w", encoding = "utf-8")
+	else:
+		out = sys.stdout
+
+	bin_to_json(args.bin_file, out)
+
+	if out != sys.stdout:
+		out.close()
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+#
+# Copyright (c) 2025 <sashan@openssl.org>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Compares two heap snapshots written by libmprofile.so (see
+# mprofile_snapshot()). It prints stacks whose live memory changed
+# between snapshots, the biggest growth comes first.
+#
+
+import json
+import argparse
+
+def load_snapshot(fname):
+	with open(fname) as f:
+		snap = json.load(f)
+	stacks = {}
+	for st in snap["stacks"]:
+		stacks[st["id"]] = tuple(st["stack_trace"][:-1])
+	live = {}
+	for l in snap["live"]:
+		#
+		# stack ids are the same for all snapshots taken by the
+		# same process, but keying by trace allows to compare
+		# snapshots from different runs too.
+		#
+		key = stacks.get(l["stack_id"], (str(l["stack_id"]), ))
+		(count, sz) = live.get(key, (0, 0))
+		live[key] = (count + l["count"], sz + l["size"])
+	return (snap, live)
+
+def print_diff(old_fname, new_fname, frames, limit):
+	(old_snap, old_live) = load_snapshot(old_fname)
+	(new_snap, new_live) = load_snapshot(new_fname)
+
+	diff = []
+	for key in set(old_live) | set(new_live):
+		(old_count, old_sz) = old_live.get(key, (0, 0))
+		(new_count, new_sz) = new_live.get(key, (0, 0))
+		if old_sz != new_sz or old_count != new_count:
+			diff.append((new_sz - old_sz, new_count - old_count,
+			    new_sz, key))
+	diff.sort(key = lambda x : x[0], reverse = True)
+
+	print("live memory {0} -> {1} bytes ({2:+d})".format(
+	    old_snap["stats"]["current"], new_snap["stats"]["current"],
+	    new_snap["stats"]["current"] - old_snap["stats"]["current"]))
+	for (d_sz, d_count, sz, key) in diff[:limit]:
+		print("{0:+12d} bytes {1:+8d} buffers (now {2} bytes)".format(
+		    d_sz, d_count, sz))
+		for frame in key[:frames]:
+			print("\t{0}".format(frame))
+
+def create_parser():
+	parser = argparse.ArgumentParser(
+	    description = "compare two heap snapshots")
+	parser.add_argument("old_snapshot", type = str,
+	    help = "snapshot taken first")
+	parser.add_argument("new_snapshot", type = str,
+	    help = "snapshot taken later")
+	parser.add_argument("-f", "--frames", type = int, default = 8,
+	    help = "number of frames to print for each stack")
+	parser.add_argument("-n", "--limit", type = int, default = 20,
+	    help = "number of stacks to print")
+
+	return parser
+
+if __name__ == "__main__":
+	parser = create_parser()
+	args = parser.parse_args()
+	print_diff(args.old_snapshot, args.new_snapshot, args.frames,
+	    args.limit)
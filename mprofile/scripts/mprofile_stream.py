@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+
+#
+# Copyright (c) 2025 <sashan@openssl.org>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Incremental reader of traces written by libmprofile.so. Records are
+# read one at a time from .json or binary trace, so the whole trace is
+# never held in memory. Stacks are kept, there is one entry for each
+# unique stack only.
+#
+
+import re
+import json
+import heapq
+import mprofile_bin
+
+READ_SZ = 1024 * 1024
+WHITESPACE = re.compile(r"\s*")
+
+#
+# reads .json in chunks. Only top level object is parsed here, its
+# values are decoded by json module. Arrays we expect to be large
+# (allocations, stacks) are decoded element by element.
+#
+class JsonReader:
+	def __init__(self, f):
+		self._f = f
+		self._buf = ""
+		self._pos = 0
+		self._eof = False
+		self._decoder = json.JSONDecoder()
+
+	def __fill(self):
+		if self._eof:
+			return False
+		data = self._f.read(READ_SZ)
+		if data == "":
+			self._eof = True
+			return False
+		self._buf = self._buf[self._pos:] + data
+		self._pos = 0
+		return True
+
+	#
+	# returns next character which is not white space, None
+	# at the end of file.
+	#
+	def __peek(self):
+		while True:
+			self._pos = WHITESPACE.match(self._buf, self._pos).end()
+			if self._pos < len(self._buf):
+				return self._buf[self._pos]
+			if not self.__fill():
+				return None
+
+	def __expect(self, chars):
+		ch = self.__peek()
+		if ch == None or ch not in chars:
+			raise ValueError("expected '{0}' got '{1}'".format(
+			    chars, ch))
+		self._pos = self._pos + 1
+		return ch
+
+	def __value(self):
+		self.__peek()
+		while True:
+			try:
+				(v, end) = self._decoder.raw_decode(self._buf,
+				    self._pos)
+			except json.JSONDecodeError:
+				if self.__fill():
+					continue
+				raise
+			#
+			# number at the end of buffer might continue
+			# in the next chunk
+			#
+			if end == len(self._buf) and self.__fill():
+				continue
+			self._pos = end
+			return v
+
+	def __elements(self):
+		self.__expect("[")
+		if self.__peek() == "]":
+			self._pos = self._pos + 1
+			return
+		while True:
+			yield self.__value()
+			if self.__expect(",]") == "]":
+				return
+
+	#
+	# yields (key, value) pairs of top level object. Arrays whose
+	# keys are listed in streamed come as generators which yield
+	# one element at a time. Generator must be consumed before the
+	# next pair is read.
+	#
+	def members(self, streamed):
+		self.__expect("{")
+		if self.__peek() == "}":
+			return
+		while True:
+			key = self.__value()
+			self.__expect(":")
+			if key in streamed:
+				yield (key, self.__elements())
+			else:
+				yield (key, self.__value())
+			if self.__expect(",}") == "}":
+				return
+
+class TraceStream:
+	def __init__(self, fname):
+		self._fname = fname
+		self.start_time = { "s" : 0, "ns" : 0 }
+		self.annotation = ""
+		self.stacks = {}
+		self.modules = None
+
+	def __add_stack(self, st):
+		self.stacks[st["id"]] = st
+
+	def __json_records(self):
+		with open(self._fname, encoding = "utf-8") as f:
+			jr = JsonReader(f)
+			for (key, value) in jr.members([ "allocations",
+			    "stacks" ]):
+				if key == "allocations":
+					yield from value
+				elif key == "stacks":
+					for st in value:
+						self.__add_stack(st)
+				elif key == "start_time":
+					self.start_time = value
+				elif key == "annotation":
+					self.annotation = value
+				elif key == "modules":
+					self.modules = value
+
+	#
+	# records from streaming mode come in order in which threads
+	# handed their chunks to writer. Those are put back to order
+	# using heap, it holds only records which arrived ahead of
+	# record we wait for. The heap is not bounded: thread hands
+	# over its chunk when chunk is full or when thread exits, so
+	# chunk of thread which stopped allocating arrives at the end
+	# and all records created after it wait in heap. Per-thread
+	# watermark does not help, record may come from thread we have
+	# not seen yet, so records can't be released before the gap
+	# is filled.
+	#
+	def __bin_records(self):
+		with open(self._fname, "rb") as f:
+			bt = mprofile_bin.BinTrace(f)
+			self.start_time = bt.start_time
+			unsorted = bt.flags & mprofile_bin.MPB_F_UNSORTED
+			pending = []
+			next_id = 1
+			for (sect, it) in bt.sections():
+				if sect == mprofile_bin.MPB_STACKS:
+					for st in it:
+						self.__add_stack(st)
+					continue
+				if not unsorted:
+					yield from it
+					continue
+				for mr in it:
+					heapq.heappush(pending, (mr["id"], mr))
+					while pending and pending[0][0] == next_id:
+						yield heapq.heappop(pending)[1]
+						next_id = next_id + 1
+			while pending:
+				yield heapq.heappop(pending)[1]
+			self.annotation = bt.annotation
+			self.modules = bt.modules
+
+	#
+	# generator yields records sorted by id. stacks, start_time and
+	# annotation are complete once all records are read.
+	#
+	def records(self):
+		if mprofile_bin.is_bin_trace(self._fname):
+			return self.__bin_records()
+		else:
+			return self.__json_records()
@@ -13,18 +13,27 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <limits.h>
 
-#include "utils/tree.h"
 #include "mprofile.h"
 
 #define	MPS_STACK_DEPTH		64
 
 #define	MPS_FLAG_MANAGED	1
 
+/*
+ * FNV-1a style hash updated by mprofile_push_frame() for every frame,
+ * so stack comes with its hash when it is looked up in stack set.
+ */
+#define	MPS_HASH_SEED		0xcbf29ce484222325ULL
+#define	MPS_HASH_PRIME		0x100000001b3ULL
+
 struct mprofile_stack {
 	size_t				 mps_stack_limit;
 	unsigned int			 mps_id;
@@ -32,56 +41,56 @@ struct mprofile_stack {
 	unsigned int			 mps_flags;
 	unsigned int			 mps_count;
 	pthread_t			 mps_thread;
-	RB_ENTRY(mprofile_stack)	 mps_rbe;
-	RB_ENTRY(mprofile_stack)	 mps_id_rbe;
+	uint64_t			 mps_hash;
 	unsigned long long		*mps_stack;
 };
 
-struct mprofile_stack_set {
-	unsigned int	 			stset_id;
-	RB_HEAD(mp_stack_set, mprofile_stack)	stset_rbh;
-	RB_HEAD(mp_stack_id, mprofile_stack)	stset_id_rbh;
-};
-
-static int stack_compare(mprofile_stack_t *, mprofile_stack_t *);
-static int stack_id_compare(mprofile_stack_t *, mprofile_stack_t *);
-
-RB_GENERATE_STATIC(mp_stack_set, mprofile_stack, mps_rbe, stack_compare);
-RB_GENERATE_STATIC(mp_stack_id, mprofile_stack, mps_id_rbe, stack_id_compare);
-
-static int
-stack_compare(mprofile_stack_t *a_mps, mprofile_stack_t *b_mps)
-{
-	int	i = 0;
-
-	if (a_mps->mps_stack_depth < b_mps->mps_stack_depth)
-		return (-1);
-	else if (a_mps->mps_stack_depth > b_mps->mps_stack_depth)
-		return (1);
-	else while ((a_mps->mps_stack[i] == b_mps->mps_stack[i]) &&
-	    (i < b_mps->mps_stack_depth))
-		i++;
-
-	if (i == b_mps->mps_stack_depth)
-		i--;
+/*
+ * Stack set is shared by all threads. It is chain of insert-only open
+ * addressing hash tables (segments) keyed by mps_hash, frames are
+ * compared on hash hit only. Segment takes new stacks until it is 3/4
+ * full, then the next segment twice as large is added. So there is
+ * always an empty slot which ends the probe in each segment.
+ *
+ * Lookup does not lock, it probes all segments in turn. Stack is fully
+ * initialized before it gets published, so readers just follow the
+ * pointer. Thread which does not find its stack takes stset_mtx, looks
+ * again and inserts a copy. New stacks are rare once application
+ * warms up, so the mutex is not contended.
+ *
+ * Stack id is slot number + number of slots in previous segments + 1,
+ * so ids are global from the start and stack can be found by its id
+ * without any lookup. Stacks are walked in order of ids. Ids are below
+ * stset_max, stacks which would need more are dropped (record gets
+ * stack id 0) and counted in stset_dropped.
+ */
+#define	MPS_SEGMENTS		32
 
-	if (a_mps->mps_stack[i] < b_mps->mps_stack[i])
-		return (-1);
-	else if (a_mps->mps_stack[i] > b_mps->mps_stack[i])
-		return (1);
+struct mprofile_stack_seg {
+	unsigned int			 sseg_sz;
+	unsigned int			 sseg_first_id;
+	unsigned int			 sseg_count;
+	mprofile_stack_t		**sseg_slots;
+};
 
-	return (0);
-}
+struct mprofile_stack_set {
+	unsigned int			 stset_max;
+	unsigned int			 stset_count;
+	unsigned int			 stset_dropped;
+	unsigned int			 stset_nsegs;
+	pthread_mutex_t			 stset_mtx;
+	struct mprofile_stack_seg	*stset_segs[MPS_SEGMENTS];
+};
 
 static int
-stack_id_compare(mprofile_stack_t *a_mps, mprofile_stack_t *b_mps)
+stack_equal(mprofile_stack_t *a_mps, mprofile_stack_t *b_mps)
 {
-	if (a_mps->mps_id < b_mps->mps_id)
-		return (-1);
-	else if (a_mps->mps_id > b_mps->mps_id)
-		return (1);
-	else
+	if (a_mps->mps_hash != b_mps->mps_hash ||
+	    a_mps->mps_stack_depth != b_mps->mps_stack_depth)
 		return (0);
+
+	return (memcmp(a_mps->mps_stack, b_mps->mps_stack,
+	    sizeof (unsigned long long) * a_mps->mps_stack_depth) == 0);
 }
 
 mprofile_stack_t *
@@ -106,6 +115,7 @@ mprofile_init_stack(char *buf, size_t buf_sz)
 		mps->mps_stack_limit = MPS_STACK_DEPTH;
 		mps->mps_thread = pthread_self();
 		mps->mps_count = 0;
+		mps->mps_hash = MPS_HASH_SEED;
 		memset(mps->mps_stack, 0,
 		    sizeof (unsigned long long) * MPS_STACK_DEPTH);
 	} else {
@@ -120,6 +130,7 @@ mprofile_init_stack(char *buf, size_t buf_sz)
 		stack_sz = buf_sz - sizeof (mprofile_stack_t);
 		mps->mps_stack_limit = stack_sz / sizeof (unsigned long long);
 		mps->mps_stack_depth = 0;
+		mps->mps_hash = MPS_HASH_SEED;
 		memset(mps->mps_stack, 0, stack_sz);
 	}
 
@@ -147,6 +158,7 @@ mprofile_copy_stack(mprofile_stack_t *mps)
 		new_mps->mps_stack[i] = mps->mps_stack[i];
 
 	new_mps->mps_stack_depth = mps->mps_stack_depth;
+	new_mps->mps_hash = mps->mps_hash;
 	/* using stack_depth here freezes the stack */
 	new_mps->mps_stack_limit = mps->mps_stack_depth;
 	new_mps->mps_flags = MPS_FLAG_MANAGED;
@@ -161,26 +173,138 @@ mprofile_copy_stack(mprofile_stack_t *mps)
 	return (new_mps);
 }
 
+static mprofile_stack_t *
+stack_seg_find(struct mprofile_stack_seg *sseg, mprofile_stack_t *new_mps,
+    unsigned int *empty)
+{
+	mprofile_stack_t	*mps;
+	unsigned int		 slot, mask;
+
+	mask = sseg->sseg_sz - 1;
+	slot = new_mps->mps_hash & mask;
+	for (;;) {
+		mps = __atomic_load_n(&sseg->sseg_slots[slot],
+		    __ATOMIC_ACQUIRE);
+		if (mps == NULL) {
+			*empty = slot;
+			return (NULL);
+		}
+		if (stack_equal(mps, new_mps))
+			return (mps);
+		slot = (slot + 1) & mask;
+	}
+}
+
+static mprofile_stack_t *
+stack_set_find(mprofile_stset_t *stset, mprofile_stack_t *new_mps)
+{
+	struct mprofile_stack_seg	*sseg;
+	mprofile_stack_t		*mps;
+	unsigned int			 i, nsegs, empty;
+
+	nsegs = __atomic_load_n(&stset->stset_nsegs, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nsegs; i++) {
+		sseg = stset->stset_segs[i];
+		if ((mps = stack_seg_find(sseg, new_mps, &empty)) != NULL)
+			return (mps);
+	}
+
+	return (NULL);
+}
+
+static struct mprofile_stack_seg *
+stack_seg_create(unsigned int sz, unsigned int first_id)
+{
+	struct mprofile_stack_seg *sseg;
+
+	sseg = (struct mprofile_stack_seg *)malloc(
+	    sizeof (struct mprofile_stack_seg));
+	if (sseg == NULL)
+		return (NULL);
+
+	sseg->sseg_slots = (mprofile_stack_t **)calloc(sz,
+	    sizeof (mprofile_stack_t *));
+	if (sseg->sseg_slots == NULL) {
+		free(sseg);
+		return (NULL);
+	}
+	sseg->sseg_sz = sz;
+	sseg->sseg_first_id = first_id;
+	sseg->sseg_count = 0;
+
+	return (sseg);
+}
+
+/*
+ * returns segment which takes the next new stack, it is called with
+ * stset_mtx held.
+ */
+static struct mprofile_stack_seg *
+stack_set_grow(mprofile_stset_t *stset)
+{
+	struct mprofile_stack_seg	*sseg;
+	unsigned int			 sz, first_id;
+
+	sseg = stset->stset_segs[stset->stset_nsegs - 1];
+	if (sseg->sseg_count < sseg->sseg_sz - sseg->sseg_sz / 4)
+		return (sseg);
+
+	if (stset->stset_nsegs == MPS_SEGMENTS || sseg->sseg_sz > UINT_MAX / 2)
+		return (NULL);
+	sz = sseg->sseg_sz * 2;
+	first_id = sseg->sseg_first_id + sseg->sseg_sz;
+	if (first_id > stset->stset_max || stset->stset_max - first_id < sz)
+		return (NULL);
+
+	if ((sseg = stack_seg_create(sz, first_id)) == NULL)
+		return (NULL);
+	stset->stset_segs[stset->stset_nsegs] = sseg;
+	__atomic_store_n(&stset->stset_nsegs, stset->stset_nsegs + 1,
+	    __ATOMIC_RELEASE);
+
+	return (sseg);
+}
+
 mprofile_stack_t *
 mprofile_add_stack(mprofile_stset_t *stset, mprofile_stack_t *new_mps)
 {
-	mprofile_stack_t	*mps;
+	struct mprofile_stack_seg	*sseg;
+	mprofile_stack_t		*mps;
+	unsigned int			 slot;
 
 	if (stset == NULL)
 		return (NULL);
 
-	mps = RB_FIND(mp_stack_set, &stset->stset_rbh, new_mps);
-	if (mps != NULL) {
-		mps->mps_count++;
-	} else {
-		mps = mprofile_copy_stack(new_mps);
-		if (mps == NULL)
-			return (NULL);
-		mps->mps_id = stset->stset_id++;
-		RB_INSERT(mp_stack_set, &stset->stset_rbh, mps);
-		RB_INSERT(mp_stack_id, &stset->stset_id_rbh, mps);
+	if ((mps = stack_set_find(stset, new_mps)) != NULL) {
+		__atomic_add_fetch(&mps->mps_count, 1, __ATOMIC_RELAXED);
+		return (mps);
 	}
 
+	pthread_mutex_lock(&stset->stset_mtx);
+	/* other thread might have inserted the same stack meanwhile */
+	if ((mps = stack_set_find(stset, new_mps)) != NULL) {
+		pthread_mutex_unlock(&stset->stset_mtx);
+		__atomic_add_fetch(&mps->mps_count, 1, __ATOMIC_RELAXED);
+		return (mps);
+	}
+
+	if ((sseg = stack_set_grow(stset)) == NULL ||
+	    (mps = mprofile_copy_stack(new_mps)) == NULL) {
+		if (stset->stset_dropped++ == 0)
+			fprintf(stderr, "%s stack set is full (%u stacks), "
+			    "new stacks are dropped\n", __func__,
+			    stset->stset_count);
+		pthread_mutex_unlock(&stset->stset_mtx);
+		return (NULL);
+	}
+
+	stack_seg_find(sseg, new_mps, &slot);
+	mps->mps_id = sseg->sseg_first_id + slot;
+	sseg->sseg_count++;
+	__atomic_add_fetch(&stset->stset_count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sseg->sseg_slots[slot], mps, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stset->stset_mtx);
+
 	return (mps);
 }
 
@@ -201,20 +325,38 @@ mprofile_push_frame(mprofile_stack_t *mps, unsigned long long frame)
 	if (mps->mps_stack_depth < mps->mps_stack_limit) {
 		mps->mps_stack[mps->mps_stack_depth] = frame;
 		mps->mps_stack_depth++;
+		mps->mps_hash = (mps->mps_hash ^ frame) * MPS_HASH_PRIME;
 	}
 }
 
+/*
+ * sz is number of slots in the first segment, it is rounded up to
+ * power of 2 (4 at least). Stack ids do not exceed max.
+ */
 mprofile_stset_t *
-mprofile_create_stset(void)
+mprofile_create_stset(unsigned int sz, unsigned int max)
 {
 	mprofile_stset_t *stset;
+	unsigned int	 slots = 4;
+
+	while (slots < sz && slots < max / 2)
+		slots <<= 1;
 
 	stset = (mprofile_stset_t *) malloc(sizeof (mprofile_stset_t));
-	if (stset != NULL) {
-		RB_INIT(&stset->stset_rbh);
-		RB_INIT(&stset->stset_id_rbh);
-		stset->stset_id = 1;
+	if (stset == NULL)
+		return (NULL);
+
+	/* ids start at 1 */
+	stset->stset_segs[0] = stack_seg_create(slots, 1);
+	if (stset->stset_segs[0] == NULL) {
+		free(stset);
+		return (NULL);
 	}
+	stset->stset_max = max;
+	stset->stset_count = 0;
+	stset->stset_dropped = 0;
+	stset->stset_nsegs = 1;
+	pthread_mutex_init(&stset->stset_mtx, NULL);
 
 	return (stset);
 }
@@ -222,30 +364,107 @@ mprofile_create_stset(void)
 void
 mprofile_destroy_stset(mprofile_stset_t *stset)
 {
-	struct mprofile_stack *mps, *walk;
+	struct mprofile_stack_seg *sseg;
+	unsigned int i, j;
 
 	if (stset == NULL)
 		return;
 
-	RB_FOREACH_SAFE(mps, mp_stack_set, &stset->stset_rbh, walk) {
-		RB_REMOVE(mp_stack_set, &stset->stset_rbh, mps);
-		RB_REMOVE(mp_stack_id, &stset->stset_id_rbh, mps);
-		mprofile_destroy_stack(mps);
+	for (i = 0; i < stset->stset_nsegs; i++) {
+		sseg = stset->stset_segs[i];
+		for (j = 0; j < sseg->sseg_sz; j++) {
+			if (sseg->sseg_slots[j] != NULL)
+				mprofile_destroy_stack(sseg->sseg_slots[j]);
+		}
+		free(sseg->sseg_slots);
+		free(sseg);
 	}
 
+	pthread_mutex_destroy(&stset->stset_mtx);
 	free(stset);
 }
 
+unsigned int
+mprofile_get_stset_count(mprofile_stset_t *stset)
+{
+	if (stset == NULL)
+		return (0);
+
+	return (__atomic_load_n(&stset->stset_count, __ATOMIC_RELAXED));
+}
+
+unsigned int
+mprofile_get_stset_dropped(mprofile_stset_t *stset)
+{
+	unsigned int dropped;
+
+	if (stset == NULL)
+		return (0);
+
+	pthread_mutex_lock(&stset->stset_mtx);
+	dropped = stset->stset_dropped;
+	pthread_mutex_unlock(&stset->stset_mtx);
+
+	return (dropped);
+}
+
+/*
+ * returns segment stack id falls to, NULL if there is no such segment
+ * yet.
+ */
+static struct mprofile_stack_seg *
+stack_set_seg(mprofile_stset_t *stset, unsigned int stack_id)
+{
+	struct mprofile_stack_seg *sseg;
+	unsigned int i, nsegs;
+
+	nsegs = __atomic_load_n(&stset->stset_nsegs, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nsegs; i++) {
+		sseg = stset->stset_segs[i];
+		if (stack_id - sseg->sseg_first_id < sseg->sseg_sz)
+			return (sseg);
+	}
+
+	return (NULL);
+}
+
+mprofile_stack_t *
+mprofile_find_stack(mprofile_stset_t *stset, unsigned int stack_id)
+{
+	struct mprofile_stack_seg *sseg;
+
+	if (stset == NULL || stack_id == 0 ||
+	    (sseg = stack_set_seg(stset, stack_id)) == NULL)
+		return (NULL);
+
+	return (__atomic_load_n(
+	    &sseg->sseg_slots[stack_id - sseg->sseg_first_id],
+	    __ATOMIC_ACQUIRE));
+}
+
 mprofile_stack_t *
 mprofile_get_next_stack(mprofile_stset_t *stset, mprofile_stack_t *mps)
 {
+	struct mprofile_stack_seg *sseg;
+	mprofile_stack_t *next = NULL;
+	unsigned int id;
+
 	if (stset == NULL)
 		return (NULL);
 
-	if (mps == NULL)
-		return (RB_MIN(mp_stack_set, &stset->stset_rbh));
+	/* segments are adjacent, id after the last slot is in next one */
+	id = (mps == NULL) ? 1 : mps->mps_id + 1;
+	while (next == NULL && (sseg = stack_set_seg(stset, id)) != NULL) {
+		while (id - sseg->sseg_first_id < sseg->sseg_sz &&
+		    next == NULL) {
+			next = __atomic_load_n(
+			    &sseg->sseg_slots[id - sseg->sseg_first_id],
+			    __ATOMIC_ACQUIRE);
+			id++;
+		}
+	}
 
-	return (RB_NEXT(mp_stack_set, &stset->stset_rbh, mps));
+	return (next);
 }
 
 void
@@ -273,80 +492,23 @@ mprofile_get_stack_count(mprofile_stack_t *mps)
 	if (mps == NULL)
 		return (0);
 
-	return (mps->mps_count);
+	return (__atomic_load_n(&mps->mps_count, __ATOMIC_RELAXED));
 }
 
-unsigned long long
-mprofile_get_thread_id(mprofile_stack_t *mps)
+unsigned int
+mprofile_get_stack_depth(mprofile_stack_t *mps)
 {
 	if (mps == NULL)
 		return (0);
 
-	return ((unsigned long long)mps->mps_thread);
+	return (mps->mps_stack_depth);
 }
 
-mprofile_stack_t *
-mprofile_merge_stack(mprofile_stset_t *dst_stset, mprofile_stset_t *src_stset,
-    unsigned int stack_id)
+unsigned long long
+mprofile_get_thread_id(mprofile_stack_t *mps)
 {
-	mprofile_stack_t	*old_mps, *new_mps;
-	mprofile_stack_t	 key = { 0 };
-
-	key.mps_id = stack_id;
-	old_mps = RB_FIND(mp_stack_id, &src_stset->stset_id_rbh, &key);
-	assert(old_mps != NULL);
-
-	/*
-	 *  if there is single instance just try to move it.
-	 */
-	if (old_mps->mps_count == 1) {
-		RB_REMOVE(mp_stack_set, &src_stset->stset_rbh, old_mps);
-		RB_REMOVE(mp_stack_id, &src_stset->stset_id_rbh, old_mps);
-		new_mps = RB_INSERT(mp_stack_set, &dst_stset->stset_rbh,
-		    old_mps);
-		if (new_mps == NULL) {
-			mprofile_stack_t *chk_mps_id;
-			chk_mps_id = RB_INSERT(mp_stack_id,
-			    &dst_stset->stset_id_rbh, old_mps);
-			if (chk_mps_id != NULL) {
-				/*
-				 * need to generate new stack set id
-				 * and insert it.
-				 */
-				old_mps->mps_id = dst_stset->stset_id++;
-				chk_mps_id = RB_INSERT(mp_stack_id,
-				    &dst_stset->stset_id_rbh, old_mps);
-				assert(chk_mps_id == NULL);
-			}
-			/*
-			 * when moving then we must get new stack id,
-			 * which is unique for destination set.
-			 */
-			new_mps = old_mps;
-		} else {
-			/* same stack exists in dst_stset, then just free it */
-			free(old_mps);
-			new_mps->mps_count++;
-		}
-	} else {
-		/* check if the same stack exists in destination */
-		new_mps = RB_FIND(mp_stack_set, &dst_stset->stset_rbh,
-		    old_mps);
-		if (new_mps == NULL) {
-			/*
-			 * we must insert copy to destination, because
-			 * mps_count > 1
-			 */
-			new_mps = mprofile_add_stack(dst_stset, old_mps);
-			if (new_mps == NULL) {
-				perror("No memory");
-				abort();
-			}
-		} else {
-			new_mps->mps_count++;
-		}
-		old_mps->mps_count--;
-	}
+	if (mps == NULL)
+		return (0);
 
-	return (new_mps);
+	return ((unsigned long long)mps->mps_thread);
 }
@@ -0,0 +1,610 @@
+/*
+ * Copyright (c) 2025 <sashan@openssl.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Resolves frames of trace or snapshot written with
+ * MPROFILE_SYMBOLIZE=offline. Such trace comes with raw addresses
+ * ("0x7f12...") and table of objects loaded to process (modules).
+ * Symbols are read from the same files (optionally found under
+ * different root directory) using ksyms.c, build-id recorded in trace
+ * must match the file. Output is the same trace with addresses
+ * replaced by names:
+ *
+ *	mprofile-symbolize [-l] [-r root] [-o output] trace.json|trace.bin
+ *
+ * -l adds source lines (same as MPROFILE_LINES).
+ */
+
+#include <sys/types.h>
+
+#include <endian.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kelf.h"
+
+#define	NAME_LEN	90
+#define	LINE_LEN	512	/* with -l */
+#define	BUILD_ID_MAX	64
+
+/* must match record.c */
+#define	MPB_MAGIC	"MPRB"
+#define	MPB_VERSION	2
+#define	MPB_HDR_SZ	40
+
+enum {
+	MPB_END = 0,
+	MPB_ANNOTATION = 1,
+	MPB_RECORDS = 2,
+	MPB_STACKS = 3,
+	MPB_MERGE_TIME = 4,
+	MPB_CHAINS_TIME = 5,
+	MPB_MODULES = 6,
+	MPB_STACKS_DROPPED = 7
+};
+
+struct module {
+	char		*mod_path;
+	unsigned long	 mod_base;
+	unsigned long	 mod_start;
+	unsigned long	 mod_end;
+	size_t		 mod_id_len;
+	unsigned char	 mod_id[BUILD_ID_MAX];
+};
+
+static struct module *modules = NULL;
+static size_t nmodules = 0;
+
+/* unique addresses found in stacks, sorted when all are collected */
+static unsigned long *pcs = NULL;
+static size_t npcs = 0;
+static size_t pcs_size = 0;
+static char **names = NULL;
+
+static void
+add_module(const char *path, size_t path_len, const unsigned char *id,
+    size_t id_len, unsigned long base, unsigned long start, unsigned long end)
+{
+	struct module *mod;
+
+	mod = reallocarray(modules, nmodules + 1, sizeof *mod);
+	if (mod == NULL)
+		err(1, NULL);
+	modules = mod;
+	mod = &modules[nmodules++];
+	if ((mod->mod_path = strndup(path, path_len)) == NULL)
+		err(1, NULL);
+	mod->mod_base = base;
+	mod->mod_start = start;
+	mod->mod_end = end;
+	mod->mod_id_len = (id_len <= BUILD_ID_MAX) ? id_len : 0;
+	memcpy(mod->mod_id, id, mod->mod_id_len);
+}
+
+static void
+add_pc(unsigned long pc)
+{
+	unsigned long *tmp;
+
+	if (npcs == pcs_size) {
+		pcs_size = (pcs_size == 0) ? 1024 : pcs_size * 2;
+		tmp = reallocarray(pcs, pcs_size, sizeof *pcs);
+		if (tmp == NULL)
+			err(1, NULL);
+		pcs = tmp;
+	}
+	pcs[npcs++] = pc;
+}
+
+static int
+pc_compare(const void *a, const void *b)
+{
+	unsigned long a_pc = *(const unsigned long *)a;
+	unsigned long b_pc = *(const unsigned long *)b;
+
+	return ((a_pc < b_pc) ? -1 : (a_pc > b_pc));
+}
+
+/*
+ * frame is unresolved when it is "0x" followed by hex digits only.
+ */
+static int
+frame_pc(const char *frame, size_t len, unsigned long *pc)
+{
+	size_t i;
+
+	if (len < 3 || len > 2 + sizeof (unsigned long) * 2 ||
+	    frame[0] != '0' || frame[1] != 'x')
+		return (0);
+
+	*pc = 0;
+	for (i = 2; i < len; i++) {
+		*pc <<= 4;
+		if (frame[i] >= '0' && frame[i] <= '9')
+			*pc |= frame[i] - '0';
+		else if (frame[i] >= 'a' && frame[i] <= 'f')
+			*pc |= frame[i] - 'a' + 10;
+		else
+			return (0);
+	}
+
+	return (1);
+}
+
+static const char *
+pc_name(unsigned long pc)
+{
+	unsigned long *found;
+
+	found = bsearch(&pc, pcs, npcs, sizeof *pcs, pc_compare);
+
+	return ((found != NULL) ? names[found - pcs] : NULL);
+}
+
+static char *
+read_file(const char *fname, size_t *len)
+{
+	FILE *f;
+	char *buf = NULL, *tmp;
+	size_t size = 0, n;
+
+	if ((f = fopen(fname, "r")) == NULL)
+		err(1, "%s", fname);
+
+	*len = 0;
+	do {
+		if (*len + 1 >= size) {
+			size = (size == 0) ? 65536 : size * 2;
+			if ((tmp = realloc(buf, size)) == NULL)
+				err(1, NULL);
+			buf = tmp;
+		}
+		n = fread(buf + *len, 1, size - *len - 1, f);
+		*len += n;
+	} while (n != 0);
+	if (ferror(f))
+		err(1, "%s", fname);
+	fclose(f);
+	buf[*len] = '\0';
+
+	return (buf);
+}
+
+/*
+ * .json traces are written by libmprofile.so or mprofile_bin.py, we
+ * don't need a full parser. Strings are skipped with their escapes,
+ * returns pointer past closing quote.
+ */
+static const char *
+json_skip_string(const char *p, const char *end)
+{
+	for (p++; p < end && *p != '"'; p++) {
+		if (*p == '\\')
+			p++;
+	}
+
+	return ((p < end) ? p + 1 : end);
+}
+
+static const char *
+json_skip_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+	    *p == '\r' || *p == ',' || *p == ':'))
+		p++;
+
+	return (p);
+}
+
+/*
+ * returns value of key found in object [obj, end) or NULL.
+ */
+static const char *
+json_field(const char *obj, const char *end, const char *key)
+{
+	size_t key_len = strlen(key);
+	const char *p;
+
+	for (p = obj; p + key_len + 2 < end; p++) {
+		if (p[0] == '"' && strncmp(p + 1, key, key_len) == 0 &&
+		    p[key_len + 1] == '"')
+			return (json_skip_space(p + key_len + 2, end));
+	}
+
+	return (NULL);
+}
+
+static void
+json_modules(const char *buf, size_t len)
+{
+	const char *end = buf + len, *p, *obj_end, *v, *path;
+	unsigned char id[BUILD_ID_MAX];
+	unsigned long base, start, stop;
+	size_t path_len, id_len;
+	unsigned int byte;
+
+	if ((p = memmem(buf, len, "\"modules\"", 9)) == NULL)
+		return;
+	if ((p = memchr(p, '[', end - p)) == NULL)
+		return;
+
+	for (p = json_skip_space(p + 1, end); p < end && *p == '{';
+	    p = json_skip_space(obj_end + 1, end)) {
+		if ((obj_end = memchr(p, '}', end - p)) == NULL)
+			break;
+
+		if ((v = json_field(p, obj_end, "path")) == NULL || *v != '"')
+			continue;
+		path = v + 1;
+		path_len = json_skip_string(v, obj_end) - path - 1;
+
+		id_len = 0;
+		if ((v = json_field(p, obj_end, "build_id")) != NULL &&
+		    *v == '"') {
+			for (v++; id_len < BUILD_ID_MAX &&
+			    sscanf(v, "%2x", &byte) == 1; v += 2)
+				id[id_len++] = byte;
+		}
+
+		base = start = stop = 0;
+		if ((v = json_field(p, obj_end, "base")) != NULL)
+			base = strtoul(v, NULL, 10);
+		if ((v = json_field(p, obj_end, "start")) != NULL)
+			start = strtoul(v, NULL, 10);
+		if ((v = json_field(p, obj_end, "end")) != NULL)
+			stop = strtoul(v, NULL, 10);
+
+		add_module(path, path_len, id, id_len, base, start, stop);
+	}
+}
+
+static void
+json_write_name(FILE *out, const char *name)
+{
+	fputc('"', out);
+	for (; *name != '\0'; name++) {
+		if (*name == '"' || *name == '\\')
+			fprintf(out, "\\%c", *name);
+		else if ((unsigned char)*name < 0x20)
+			fprintf(out, "\\u%04x", *name);
+		else
+			fputc(*name, out);
+	}
+	fputc('"', out);
+}
+
+/*
+ * walks frames found in "stack_trace" arrays. Addresses are collected
+ * when out is NULL, otherwise the whole trace is copied to out with
+ * addresses replaced by names.
+ */
+static void
+json_frames(const char *buf, size_t len, FILE *out)
+{
+	const char *end = buf + len, *p = buf, *q, *copied = buf;
+	const char *name;
+	unsigned long pc;
+
+	while ((p = memmem(p, end - p, "\"stack_trace\"", 13)) != NULL) {
+		if ((p = memchr(p, '[', end - p)) == NULL)
+			break;
+		for (p = json_skip_space(p + 1, end); p < end && *p == '"';
+		    p = json_skip_space(q, end)) {
+			q = json_skip_string(p, end);
+			if (frame_pc(p + 1, q - p - 2, &pc) == 0)
+				continue;
+			if (out == NULL) {
+				add_pc(pc);
+				continue;
+			}
+			if ((name = pc_name(pc)) == NULL)
+				continue;
+			fwrite(copied, p - copied, 1, out);
+			json_write_name(out, name);
+			copied = q;
+		}
+	}
+
+	if (out != NULL)
+		fwrite(copied, end - copied, 1, out);
+}
+
+static uint16_t
+get16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof (v));
+
+	return (le16toh(v));
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof (v));
+
+	return (le32toh(v));
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof (v));
+
+	return (le64toh(v));
+}
+
+static const unsigned char *
+bin_need(const unsigned char *p, const unsigned char *end, size_t sz)
+{
+	if ((size_t)(end - p) < sz)
+		errx(1, "truncated trace");
+
+	return (p);
+}
+
+/*
+ * walks sections of binary trace (see record.c). Modules and addresses
+ * are collected when out is NULL, otherwise trace is copied to out
+ * with frames in MPB_STACKS replaced by names.
+ */
+static void
+bin_walk(const unsigned char *buf, size_t len, FILE *out)
+{
+	const unsigned char *end = buf + len, *p, *copied, *path;
+	const char *name;
+	unsigned char frame_len[2];
+	uint32_t sect, count, rec_sz, i, j, depth;
+	size_t l, id_len;
+	unsigned long pc;
+
+	p = bin_need(buf, end, MPB_HDR_SZ);
+	if (memcmp(p, MPB_MAGIC, 4) != 0)
+		errx(1, "not a binary mprofile trace");
+	if (get32(p + 4) != MPB_VERSION)
+		errx(1, "unsupported version %u", get32(p + 4));
+	rec_sz = get32(p + 8);
+	p += MPB_HDR_SZ;
+	copied = buf;
+
+	do {
+		p = bin_need(p, end, 8);
+		sect = get32(p);
+		count = get32(p + 4);
+		p += 8;
+
+		switch (sect) {
+		case MPB_END:
+		case MPB_MERGE_TIME:
+		case MPB_CHAINS_TIME:
+		case MPB_STACKS_DROPPED:
+			break;
+		case MPB_ANNOTATION:
+			p = bin_need(p, end, count) + count;
+			break;
+		case MPB_RECORDS:
+			l = (size_t)count * rec_sz;
+			p = bin_need(p, end, l) + l;
+			break;
+		case MPB_MODULES:
+			for (i = 0; i < count; i++) {
+				p = bin_need(p, end, 26);
+				id_len = get16(p + 24);
+				p = bin_need(p + 26, end, id_len + 2);
+				l = get16(p + id_len);
+				path = bin_need(p + id_len + 2, end, l);
+				if (out == NULL)
+					add_module((const char *)path, l, p,
+					    id_len, get64(p - 26),
+					    get64(p - 18), get64(p - 10));
+				p = path + l;
+			}
+			break;
+		case MPB_STACKS:
+			for (i = 0; i < count; i++) {
+				p = bin_need(p, end, 20);
+				depth = get32(p + 16);
+				p += 20;
+				for (j = 0; j < depth; j++) {
+					l = get16(bin_need(p, end, 2));
+					bin_need(p + 2, end, l);
+					if (frame_pc((const char *)p + 2, l,
+					    &pc) == 0) {
+						p += 2 + l;
+						continue;
+					}
+					if (out == NULL) {
+						add_pc(pc);
+						p += 2 + l;
+						continue;
+					}
+					if ((name = pc_name(pc)) == NULL) {
+						p += 2 + l;
+						continue;
+					}
+					fwrite(copied, p - copied, 1, out);
+					l = strlen(name);
+					if (l > UINT16_MAX)
+						l = UINT16_MAX;
+					frame_len[0] = l & 0xff;
+					frame_len[1] = l >> 8;
+					fwrite(frame_len, 2, 1, out);
+					fwrite(name, l, 1, out);
+					p += 2 + get16(p);
+					copied = p;
+				}
+			}
+			break;
+		default:
+			errx(1, "unknown section %u", sect);
+		}
+	} while (sect != MPB_END);
+
+	if (out != NULL)
+		fwrite(copied, end - copied, 1, out);
+}
+
+/*
+ * opens objects some frame falls to. Objects which changed since trace
+ * was recorded are skipped, their frames stay unresolved.
+ */
+static struct syms *
+load_modules(const char *root, int flags)
+{
+	struct syms *syms;
+	struct module *mod;
+	unsigned char id[BUILD_ID_MAX];
+	unsigned long *pc;
+	char path[1024];
+	size_t i;
+	int id_len;
+
+	syms = kelf_create(flags);
+	for (i = 0; i < nmodules; i++) {
+		mod = &modules[i];
+
+		/* first address at or above start must be below end */
+		pc = pcs;
+		while (pc < pcs + npcs && *pc < mod->mod_start)
+			pc++;
+		if (pc == pcs + npcs || *pc >= mod->mod_end)
+			continue;
+
+		if (mod->mod_path[0] != '/') {
+			warnx("%s: not an absolute path, skipped",
+			    mod->mod_path);
+			continue;
+		}
+
+		if ((size_t)snprintf(path, sizeof (path), "%s%s", root,
+		    mod->mod_path) >= sizeof (path)) {
+			warnx("%s%s: path too long", root, mod->mod_path);
+			continue;
+		}
+		if (mod->mod_id_len != 0) {
+			id_len = kelf_build_id(path, id, sizeof (id));
+			if (id_len == -1) {
+				warn("%s", path);
+				continue;
+			}
+			if ((size_t)id_len != mod->mod_id_len ||
+			    memcmp(id, mod->mod_id, id_len) != 0) {
+				warnx("%s: build-id does not match, skipped",
+				    path);
+				continue;
+			}
+		}
+		syms = kelf_open(path, syms, mod->mod_base);
+	}
+
+	return (syms);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mprofile-symbolize [-l] [-r root] "
+	    "[-o output] trace.json|trace.bin\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct syms *syms;
+	const char *root = "", *output = NULL;
+	FILE *out = stdout;
+	char *buf;
+	size_t len, i, n;
+	int ch, bin, flags = 0;
+
+	while ((ch = getopt(argc, argv, "lo:r:")) != -1) {
+		switch (ch) {
+		case 'l':
+			flags |= KELF_LINES;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'r':
+			root = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	buf = read_file(argv[0], &len);
+	bin = (len >= 4 && memcmp(buf, MPB_MAGIC, 4) == 0);
+	if (bin) {
+		bin_walk((const unsigned char *)buf, len, NULL);
+	} else {
+		json_modules(buf, len);
+		json_frames(buf, len, NULL);
+	}
+	if (nmodules == 0)
+		errx(1, "%s: no modules found, record trace with "
+		    "MPROFILE_SYMBOLIZE=offline", argv[0]);
+
+	qsort(pcs, npcs, sizeof *pcs, pc_compare);
+	for (i = 0, n = 0; i < npcs; i++) {
+		if (n == 0 || pcs[n - 1] != pcs[i])
+			pcs[n++] = pcs[i];
+	}
+	npcs = n;
+
+	syms = load_modules(root, flags);
+	if ((names = calloc(npcs + 1, sizeof *names)) == NULL ||
+	    kelf_snprintsyms(syms, pcs, names, npcs,
+	    (flags & KELF_LINES) ? LINE_LEN : NAME_LEN) != 0)
+		err(1, NULL);
+
+	if (output != NULL && (out = fopen(output, "w")) == NULL)
+		err(1, "%s", output);
+	if (bin)
+		bin_walk((const unsigned char *)buf, len, out);
+	else
+		json_frames(buf, len, out);
+	if (fflush(out) != 0 || ferror(out))
+		err(1, "%s", (output != NULL) ? output : "stdout");
+	if (out != stdout)
+		fclose(out);
+
+	for (i = 0; i < npcs; i++)
+		free(names[i]);
+	free(names);
+	free(pcs);
+	for (i = 0; i < nmodules; i++)
+		free(modules[i].mod_path);
+	free(modules);
+	kelf_close(syms);
+	free(buf);
+
+	return (0);
+}